@@ -0,0 +1,454 @@
+/**
+ *
+ */
+
+// scard_bench: cost of the card stack against the in-process mock card,
+// one JSON document per run so releases can be compared
+//
+//   make bench                         build and write bench.json
+//   ./scard_bench -r -n 50             mock with ACR38 and EEPROM timing
+
+#include "scard.h"
+#include "scard_metrics.h"
+#include "scard_transport.h"
+
+#include <errno.h>
+#include <getopt.h>
+
+#define BENCH_VERSION                   2
+// micro benchmarks are timed in batches, the clock costs more than some of them
+#define BENCH_BATCH                     100
+#define BENCH_WAIT_MS                   5000
+
+static FILE *_out = nullptr;
+static bool _first_result = true;
+
+// session status changes, see scard_set_notify()
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r] [-n <cards>] [-o <file>]\n", prog);
+    fprintf(stderr, "  -r         mock with the ACR38 and EEPROM timing instead of none\n");
+    fprintf(stderr, "  -n <cards> card sessions to time, top-ups are 10x that (default 200)\n");
+    fprintf(stderr, "  -o <file>  write the JSON there instead of stdout\n");
+}
+
+static void result_begin(const char *name, const char *unit)
+{
+    fprintf(_out, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\"", _first_result ? "" : ",", name, unit);
+    _first_result = false;
+}
+
+// mean as the value, with the distribution
+static void result_histogram(const char *name, const scard_histogram_t *hist)
+{
+    scard_histogram_summary_t s;
+    scard_histogram_summary(hist, &s);
+    result_begin(name, "ns");
+    fprintf(_out, ", \"value\": %lu, \"count\": %lu, \"min\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu}",
+        (unsigned long)s.mean_ns, (unsigned long)s.count, (unsigned long)s.min_ns, (unsigned long)s.p50_ns,
+        (unsigned long)s.p90_ns, (unsigned long)s.p99_ns, (unsigned long)s.max_ns);
+    fprintf(stderr, "%-28s mean %10.1f ns  p50 %10.1f  p99 %10.1f  n=%lu\n", name, (double)s.mean_ns,
+        (double)s.p50_ns, (double)s.p99_ns, (unsigned long)s.count);
+}
+
+static void result_count(const char *name, const char *unit, unsigned long count)
+{
+    result_begin(name, unit);
+    fprintf(_out, ", \"value\": %lu}", count);
+    fprintf(stderr, "%-28s %10lu %s\n", name, count, unit);
+}
+
+static void result_rate(const char *name, unsigned long count, uint64_t duration_ns)
+{
+    double rate = duration_ns ? count * 1e9 / duration_ns : 0;
+    result_begin(name, "ops/s");
+    fprintf(_out, ", \"value\": %.1f, \"count\": %lu}", rate, count);
+    fprintf(stderr, "%-28s %10.1f ops/s  n=%lu\n", name, rate, count);
+}
+
+// runs op() batches times BENCH_BATCH, one histogram sample per batch;
+// between() runs after every batch and is not timed, it may be NULL
+static void bench_batched_between(const char *name, unsigned batches, void (*op)(void *arg), void *arg,
+    void (*between)())
+{
+    static scard_histogram_t hist;
+    scard_histogram_reset(&hist);
+    for (unsigned b = 0; b < batches; b++) {
+        uint64_t start_ns = scard_now_ns();
+        for (unsigned i = 0; i < BENCH_BATCH; i++) {
+            op(arg);
+        }
+        scard_histogram_record(&hist, (scard_now_ns() - start_ns) / BENCH_BATCH);
+        if (between) {
+            between();
+        }
+    }
+    result_histogram(name, &hist);
+}
+
+static void bench_batched(const char *name, unsigned batches, void (*op)(void *arg), void *arg)
+{
+    bench_batched_between(name, batches, op, arg, NULL);
+}
+
+typedef struct {
+    SCARDCONTEXT context;
+    scard_reader_t reader;
+    SCARDHANDLE card;
+} bench_card_t;
+
+static void op_transmit(void *arg)
+{
+    bench_card_t *bc = (bench_card_t *)arg;
+    // READ_PRESENTATION_ERROR_COUNTER_MEMORY_CARD, straight to the transport
+    BYTE send_data[] = {0xFF, 0xB1, 0x00, 0x00, 0x04};
+    BYTE recv_data[8];
+    DWORD recv_len = sizeof(recv_data);
+    scard_get_transport()->transmit(bc->card, bc->reader.card_protocol, send_data, sizeof(send_data),
+        recv_data, &recv_len);
+}
+
+static void op_error_counter(void *arg)
+{
+    bench_card_t *bc = (bench_card_t *)arg;
+    BYTE pin1, pin2, pin3, retries;
+    scard_get_error_counter(&bc->reader, bc->card, &pin1, &pin2, &pin3, &retries);
+}
+
+static void op_read_image(void *arg)
+{
+    bench_card_t *bc = (bench_card_t *)arg;
+    scard_read_card_image(&bc->reader, bc->card);
+}
+
+static void op_read_user_data(void *arg)
+{
+    bench_card_t *bc = (bench_card_t *)arg;
+    BYTE data[16];
+    scard_read_user_data(&bc->reader, bc->card, 0x40, data, sizeof(data));
+}
+
+static void op_plan_write(void *arg)
+{
+    static scard_write_plan_t plan;
+    static BYTE current[SC_CARD_MEMORY_LEN];
+    BYTE data[16] = {0x55, 0x53, 0x45, 0x52, 0x01, 0x02};
+    scard_plan_write(current, 0x40, data, sizeof(data), 128, &plan);
+}
+
+static void op_classify_atr(void *arg)
+{
+    static const BYTE atr[] = {0x3B, 0x04, 0xA2, 0x13, 0x10, 0x91};
+    scard_card_class_t card_class = scard_classify_atr(atr, sizeof(atr));
+    __asm__ __volatile__("" : : "r"(card_class));
+}
+
+// APDU encode/decode and do_xfer against the transmit underneath
+static bool bench_apdus(unsigned batches)
+{
+    bench_card_t bc;
+    memset(&bc, 0, sizeof(bc));
+    if (! scard_create_context(&bc.context)) {
+        return false;
+    }
+    char names[1][SC_MAX_READERNAME_LEN+1];
+    if (scard_list_readers(bc.context, names, 1) != 1) {
+        scard_destroy_context(&bc.context);
+        return false;
+    }
+    scard_reader_init(&bc.reader, names[0]);
+    bool rv = scard_connect_card(bc.context, &bc.reader, &bc.card) && scard_identify_reader(&bc.reader, bc.card);
+    if (rv) {
+        bench_batched("apdu.transmit", batches, op_transmit, &bc);
+        bench_batched("apdu.xfer_error_counter", batches, op_error_counter, &bc);
+        bench_batched("apdu.read_card_image", batches / 10 + 1, op_read_image, &bc);
+        bench_batched("parse.read_user_data", batches, op_read_user_data, &bc);
+        bench_batched("build.plan_write", batches, op_plan_write, NULL);
+        bench_batched("parse.classify_atr", batches, op_classify_atr, NULL);
+        scard_disconnect_card(&bc.reader, &bc.card);
+    }
+    scard_reader_destroy(&bc.reader);
+    scard_destroy_context(&bc.context);
+    return rv;
+}
+
+static void op_log_trc(void *arg)
+{
+    scard_log(SC_LOG_LEVEL_TRC, __func__, __LINE__, "trace %u\n", 1u);
+}
+
+static void op_log_dbg(void *arg)
+{
+    scard_log(SC_LOG_LEVEL_DBG, __func__, __LINE__, "debug %u\n", 2u);
+}
+
+static void op_log_inf(void *arg)
+{
+    scard_log(SC_LOG_LEVEL_INF, __func__, __LINE__, "info %s %u\n", "reader", 3u);
+}
+
+static void op_log_err(void *arg)
+{
+    scard_log(SC_LOG_LEVEL_ERR, __func__, __LINE__, "error %s %d\n", "card", -4);
+}
+
+static void op_log_hex(void *arg)
+{
+    static const BYTE apdu[] = {0xFF, 0xB0, 0x00, 0x40, 0x10};
+    scard_log_hex(SC_LOG_LEVEL_DBG, __func__, __LINE__, "SEND", apdu, sizeof(apdu));
+}
+
+// a batch fits the ring and the rings are written out after every batch, so
+// the queueing is timed and not the cheaper drop of a full ring
+#if BENCH_BATCH >= SC_LOG_RING_SIZE
+#error "a log batch must fit the log ring"
+#endif
+
+// one call per level; only SC_LOG_LEVEL filters, at build time, so every
+// level that is compiled in costs the same queueing
+static void bench_logging(unsigned batches)
+{
+    static const struct {
+        const char *name;
+        void (*op)(void *arg);
+    } levels[] = {
+        { "log.trc", op_log_trc },
+        { "log.dbg", op_log_dbg },
+        { "log.inf", op_log_inf },
+        { "log.err", op_log_err },
+        { "log.hex", op_log_hex },
+    };
+    char name[32];
+    for (unsigned i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        scard_log_flush();
+        unsigned long dropped = scard_log_dropped();
+        bench_batched_between(levels[i].name, batches, levels[i].op, NULL, scard_log_flush);
+        // none expected, any would make the timing above too good
+        snprintf(name, sizeof(name), "%s.dropped", levels[i].name);
+        result_count(name, "records", scard_log_dropped() - dropped);
+    }
+}
+
+static void on_notify(void *arg)
+{
+    pthread_mutex_lock(&_mutex);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+// waits for the reader in slot 0 to get there, false on timeout
+static bool wait_reader(bool (*done)(const scard_reader_status_t *reader, unsigned arg), unsigned arg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += BENCH_WAIT_MS / 1000;
+    pthread_mutex_lock(&_mutex);
+    for (;;) {
+        scard_status_t status;
+        scard_get_status(&status);
+        if (done(&status.readers[0], arg)) {
+            break;
+        }
+        if (pthread_cond_timedwait(&_cond, &_mutex, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&_mutex);
+            return false;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+static bool is_attached(const scard_reader_status_t *reader, unsigned arg)
+{
+    return reader->active && reader->state == arg;
+}
+
+static bool is_ready(const scard_reader_status_t *reader, unsigned arg)
+{
+    return reader->card_ready && reader->state == arg;
+}
+
+static bool is_empty(const scard_reader_status_t *reader, unsigned arg)
+{
+    return ! reader->card_present && reader->state == arg;
+}
+
+static unsigned state_index(const char *name)
+{
+    unsigned state = 0;
+    while (strcmp(scard_state_name(state), name) && strcmp(scard_state_name(state), "?")) {
+        state++;
+    }
+    return state;
+}
+
+// full sessions through the FSM, then top-ups on the last card
+static bool bench_sessions(unsigned cards)
+{
+    unsigned wait_card = state_index("WAIT_CARD");
+    unsigned wait_user = state_index("WAIT_USER");
+    scard_set_notify(on_notify, NULL);
+    if (! scard_user_thread_start() || ! wait_reader(is_attached, wait_card)) {
+        fprintf(stderr, "mock reader did not attach\n");
+        return false;
+    }
+
+    // the first card is blank and set up by the session, the others are
+    // copies of it and only read
+    scard_mock_insert_card(0, NULL, NULL);
+    if (! wait_reader(is_ready, wait_user)) {
+        fprintf(stderr, "blank card was not set up\n");
+        return false;
+    }
+    BYTE memory[SC_MOCK_MEMORY_LEN];
+    scard_mock_card_memory(0, memory);
+    const BYTE psc[3] = {SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3};
+    scard_mock_remove_card(0);
+    wait_reader(is_empty, wait_card);
+
+    static scard_histogram_t hist;
+    scard_histogram_reset(&hist);
+    for (unsigned i = 0; i < cards; i++) {
+        uint64_t start_ns = scard_now_ns();
+        scard_mock_insert_card(0, memory, psc);
+        if (! wait_reader(is_ready, wait_user)) {
+            fprintf(stderr, "card %u did not get ready\n", i);
+            return false;
+        }
+        scard_histogram_record(&hist, scard_now_ns() - start_ns);
+        if (i + 1 < cards) {
+            scard_mock_remove_card(0);
+            wait_reader(is_empty, wait_card);
+        }
+    }
+    result_histogram("session.insert_to_ready", &hist);
+
+    // one at a time, each waits for the card write and its verification
+    unsigned long topups = cards * 10;
+    scard_command_t command;
+    command.type = SC_CMD_TOPUP;
+    command.arg = 1;
+    scard_histogram_reset(&hist);
+    uint64_t start_ns = scard_now_ns();
+    for (unsigned long i = 0; i < topups; i++) {
+        scard_completion_t completion;
+        scard_submit(0, &command, &completion);
+        if (! scard_command_wait(&completion, BENCH_WAIT_MS) || scard_command_status(&completion) != SC_CMD_DONE) {
+            fprintf(stderr, "top-up %lu failed: %s\n", i, scard_command_status_name(scard_command_status(&completion)));
+            return false;
+        }
+        scard_histogram_record(&hist, completion.done_ns - completion.submit_ns);
+    }
+    result_rate("topup.sequential", topups, scard_now_ns() - start_ns);
+    result_histogram("topup.round_trip", &hist);
+
+    // a full queue at a time, the session merges them into fewer writes;
+    // only top-ups that made it to the card count
+    scard_completion_t completions[SC_COMMAND_QUEUE_LEN];
+    unsigned long done = 0;
+    unsigned long failed = 0;
+    start_ns = scard_now_ns();
+    for (unsigned long i = 0; i < topups; i += SC_COMMAND_QUEUE_LEN) {
+        for (unsigned j = 0; j < SC_COMMAND_QUEUE_LEN; j++) {
+            scard_submit(0, &command, &completions[j]);
+        }
+        for (unsigned j = 0; j < SC_COMMAND_QUEUE_LEN; j++) {
+            if (! scard_command_wait(&completions[j], BENCH_WAIT_MS)) {
+                fprintf(stderr, "pipelined top-up timed out\n");
+                return false;
+            }
+            if (scard_command_status(&completions[j]) == SC_CMD_DONE) {
+                done++;
+            } else {
+                failed++;
+            }
+        }
+    }
+    result_rate("topup.pipelined", done, scard_now_ns() - start_ns);
+    result_count("topup.pipelined_failed", "commands", failed);
+    if (failed) {
+        fprintf(stderr, "%lu pipelined top-ups failed\n", failed);
+        return false;
+    }
+
+    scard_user_thread_stop();
+    scard_set_notify(NULL, NULL);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool realistic = false;
+    unsigned cards = 200;
+    const char *path = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "rn:o:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            realistic = true;
+            break;
+        case 'n':
+            cards = atoi(optarg);
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cards == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    _out = path ? fopen(path, "w") : stdout;
+    if (! _out) {
+        fprintf(stderr, "failed to create %s\n", path);
+        return 1;
+    }
+    // the records are formatted and written, only not kept
+    FILE *log_file = fopen("/dev/null", "w");
+    scard_log_set_file(log_file);
+
+    scard_mock_config_t config;
+    scard_mock_default_config(&config);
+    if (! realistic) {
+        // what is left is the cost of the stack itself
+        config.apdu_latency_us = 0;
+        config.byte_latency_us = 0;
+        config.eeprom_write_us = 0;
+    }
+    scard_mock_configure(&config);
+    scard_set_transport(&scard_mock_transport);
+    scard_mock_insert_card(0, NULL, NULL);
+
+    char time[32];
+    time_t now = scard_wall_ns() / 1000000000ULL;
+    struct tm tm;
+    strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+    fprintf(_out, "{\n  \"benchmark\": \"scard_bench\",\n  \"version\": %u,\n  \"time\": \"%s\",\n", BENCH_VERSION, time);
+    fprintf(_out, "  \"config\": {\"mock_timing\": %s, \"log_level\": %u, \"cards\": %u, \"batch\": %u},\n",
+        realistic ? "true" : "false", SC_LOG_LEVEL, cards, BENCH_BATCH);
+    fprintf(_out, "  \"results\": [");
+
+    // the slow mock takes milliseconds per APDU, fewer rounds do
+    unsigned batches = realistic ? 5 : 200;
+    bool rv = bench_apdus(batches);
+    bench_logging(200);
+    scard_mock_remove_card(0);
+    rv = bench_sessions(cards) && rv;
+
+    fprintf(_out, "\n  ],\n  \"ok\": %s\n}\n", rv ? "true" : "false");
+    if (path) {
+        fclose(_out);
+    }
+    scard_log_flush();
+    scard_log_set_file(stderr);
+    fclose(log_file);
+    return rv ? 0 : 1;
+}
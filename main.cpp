@@ -32,6 +32,14 @@
 
 // SCard API
 #include "scard.h"
+#include "scard_audit.h"
+#include "scard_exporter.h"
+#include "scard_ipc.h"
+#include "scard_journal.h"
+#include "scard_ledger.h"
+#include "scard_metrics.h"
+#include "scard_shm.h"
+#include "scard_trace.h"
 
 static void glfw_error_callback(int error, const char* description)
 {
@@ -125,13 +133,68 @@ int main(int, char**)
     bool show_another_window = false;
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
-    static ImU8 new_value = 2;
+    // per reader slot UI state
+    static ImU8 new_value[SC_MAX_READERS];
     const ImU8 u8_one = 1;
-    int card_id = 0;
-    bool ready = false;
-    bool ready_changed = false;
-
+    int card_id[SC_MAX_READERS] = {0};
+    bool ready[SC_MAX_READERS] = {false};
+    bool ready_changed[SC_MAX_READERS] = {false};
+    // commands per slot, one completion per click so none is dropped while
+    // an earlier one is in flight; polled every frame
+    static scard_completion_t completion[SC_MAX_READERS][SC_COMMAND_QUEUE_LEN];
+    // next completion to use and the one shown as the last command
+    unsigned completion_next[SC_MAX_READERS] = {0};
+    scard_completion_t *completion_last[SC_MAX_READERS] = {NULL};
+
+    // SCUI_MOCK=1 runs against an in-process reader with a blank card
+    if (getenv("SCUI_MOCK")) {
+        scard_set_transport(&scard_mock_transport);
+        scard_mock_insert_card(0, NULL, NULL);
+    }
+    // SCUI_TRACE=<file> records every APDU and card event, see scard_replay
+    if (getenv("SCUI_TRACE")) {
+        scard_trace_open(getenv("SCUI_TRACE"), SC_TRACE_DEFAULT_SLOTS);
+    }
+    // SCUI_READER_CACHE=<file> keeps the reader capabilities between runs
+    if (getenv("SCUI_READER_CACHE")) {
+        scard_reader_cache_open(getenv("SCUI_READER_CACHE"));
+    }
+    // SCUI_METRICS=<seconds> logs the latency histograms periodically
+    if (getenv("SCUI_METRICS")) {
+        scard_metrics_set_dump_interval(atoi(getenv("SCUI_METRICS")));
+    }
+    // SCUI_JOURNAL=<file> journals every card write, see scard_journal.h
+    if (getenv("SCUI_JOURNAL")) {
+        scard_journal_open(getenv("SCUI_JOURNAL"));
+    }
+    // SCUI_AUDIT=<prefix> reads every card without touching it, exported to <prefix>.csv and <prefix>.bin
+    if (getenv("SCUI_AUDIT")) {
+        char csv_path[256], bin_path[256];
+        snprintf(csv_path, sizeof(csv_path), "%s.csv", getenv("SCUI_AUDIT"));
+        snprintf(bin_path, sizeof(bin_path), "%s.bin", getenv("SCUI_AUDIT"));
+        scard_audit_open(csv_path, bin_path);
+    }
+    // SCUI_PROVISION=1 starts with blank card provisioning enabled
+    if (getenv("SCUI_PROVISION")) {
+        scard_set_provisioning(true);
+    }
+    // SCUI_LEDGER=<file> keeps the history of every card seen
+    if (getenv("SCUI_LEDGER")) {
+        scard_ledger_open(getenv("SCUI_LEDGER"));
+    }
+    // SCUI_SHM=<file> keeps a status page for other processes, see scard_shm.h
+    if (getenv("SCUI_SHM")) {
+        scard_shm_open(getenv("SCUI_SHM"));
+    }
     scard_user_thread_start();
+    // SCUI_SOCKET=<path> serves status and commands to scardctl
+    if (getenv("SCUI_SOCKET")) {
+        scard_ipc_start(getenv("SCUI_SOCKET"));
+    }
+    // SCUI_EXPORTER=[host:]port serves the metrics to Prometheus
+    if (getenv("SCUI_EXPORTER")) {
+        scard_exporter_start(getenv("SCUI_EXPORTER"));
+    }
 
 
     // Main loop
@@ -151,11 +214,6 @@ int main(int, char**)
 
         // SCard window
         {
-            if (ready != is_card_ready()) {
-                ready = is_card_ready();
-                ready_changed = true;
-            }
-
             ImGui::Begin("Sole Card UI 0.0.3");
 
             // FONT
@@ -164,38 +222,173 @@ int main(int, char**)
             // ImGui::Text("Hello with another font");
             // ImGui::PopFont();
 
-            ImGui::Text("Reader attached: %s (%s)", scard_reader_presence() ? "YES" : "NO", scard_reader_name());
-            ImGui::Text("Card inserted: %s", scard_card_presence() ? "YES" : "NO");
-            ImGui::Text("Card pin retries: %u", scard_get_pin_retries());
-
-            ImGui::Text("User info:");
-            ImGui::Text(" Magic: %u", scard_get_pin_user_magic());
-            ImGui::Text("    ID: %u", scard_get_pin_user_id());
-            ImGui::Text(" Value: %u", scard_get_pin_user_value());
-            ImGui::Text(" Total: %u", scard_get_pin_user_total());
-
-            if (ready) {
-                // if ready change was detected and we card is present set the initial card ID
-                // and reset the new user initial value to default
-                if (ready_changed) {
-                    card_id = scard_get_pin_user_id();
-                    new_value = 2;
-                }
-                ImGui::Text("Card type:"); ImGui::SameLine();
-                ImGui::RadioButton("Regular", &card_id, SC_REGULAR_ID); ImGui::SameLine();
-                ImGui::RadioButton("Admin", &card_id, SC_ADMIN_ID);
-                if (card_id == SC_REGULAR_ID) {
-                    ImGui::Text("New value:");
+            // one consistent copy of the card state per frame
+            static scard_status_t status;
+            scard_get_status(&status);
+
+            if (scard_audit_enabled()) {
+                scard_audit_stats_t audit;
+                scard_audit_get_stats(&audit);
+                ImGui::Text("Audit: %lu cards, %.1f per min", audit.cards, audit.cards_per_min);
+                if (audit.errors) {
                     ImGui::SameLine();
-                    ImGui::InputScalar("", ImGuiDataType_U8, &new_value, &u8_one, NULL, "%u");
+                    ImGui::Text("(%lu not exported)", audit.errors);
                 }
-                if (ImGui::Button("Update card")) {
-                    // perform the card update according to users wishes
-                    update_card((uint32_t)new_value, (uint32_t)card_id);
+            }
+            bool provisioning = scard_provisioning();
+            if (ImGui::Checkbox("Provision blank cards", &provisioning)) {
+                scard_set_provisioning(provisioning);
+            }
+            if (provisioning) {
+                ImGui::SameLine();
+                if (ImGui::Button("Report")) {
+                    scard_provision_report(stdout);
                 }
             }
 
-            ready_changed = false;
+            bool any_reader = false;
+            for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+                const scard_reader_status_t *reader = &status.readers[slot];
+                if (! reader->active) {
+                    ready[slot] = false;
+                    continue;
+                }
+                any_reader = true;
+
+                if (ready[slot] != reader->card_ready) {
+                    ready[slot] = reader->card_ready;
+                    ready_changed[slot] = true;
+                }
+
+                ImGui::PushID(slot);
+                ImGui::Separator();
+                ImGui::Text("Reader attached: YES (%s)", reader->name);
+                ImGui::Text("Card inserted: %s", reader->card_present ? "YES" : "NO");
+                ImGui::Text("Card state: %s", scard_state_name(reader->state));
+                if (reader->error_class != SC_ERROR_NONE) {
+                    ImGui::Text("Card error: %s", scard_error_class_name(reader->error_class));
+                }
+                if (reader->card_present) {
+                    ImGui::Text("Card chip: %s", scard_card_class_name((scard_card_class_t)reader->card_class));
+                }
+                ImGui::Text("Card pin retries: %u", reader->pin_retries);
+                scard_provision_stats_t provision;
+                if (provisioning && scard_get_provision_stats(slot, &provision)) {
+                    ImGui::Text("Provisioned: %lu (%.1f per min), failed %lu, skipped %lu", provision.provisioned,
+                        scard_provision_rate(&provision), provision.failed, provision.skipped);
+                }
+
+                ImGui::Text("User info:");
+                ImGui::Text(" Magic: %u", reader->user_magic);
+                ImGui::Text("    ID: %u", reader->user_id);
+                ImGui::Text(" Value: %u", reader->user_value);
+                ImGui::Text(" Total: %u", reader->user_total);
+                if (reader->card_known) {
+                    char seen[32];
+                    time_t seen_s = reader->card_last_seen_ns / 1000000000ULL;
+                    struct tm tm;
+                    strftime(seen, sizeof(seen), "%Y-%m-%d %H:%M:%S", localtime_r(&seen_s, &tm));
+                    ImGui::Text("Top-ups: %u, last seen %s", reader->card_topups, seen);
+                } else if (reader->card_topups) {
+                    ImGui::Text("Top-ups: %u, first visit", reader->card_topups);
+                }
+
+                if (ready[slot]) {
+                    // if ready change was detected and we card is present set the initial card ID
+                    // and reset the new user initial value to default
+                    if (ready_changed[slot]) {
+                        card_id[slot] = reader->user_id;
+                        new_value[slot] = 2;
+                    }
+                    ImGui::Text("Card type:"); ImGui::SameLine();
+                    ImGui::RadioButton("Regular", &card_id[slot], SC_REGULAR_ID); ImGui::SameLine();
+                    ImGui::RadioButton("Admin", &card_id[slot], SC_ADMIN_ID);
+                    if (card_id[slot] == SC_REGULAR_ID) {
+                        ImGui::Text("New value:");
+                        ImGui::SameLine();
+                        ImGui::InputScalar("", ImGuiDataType_U8, &new_value[slot], &u8_one, NULL, "%u");
+                    }
+                    if (ImGui::Button("Update card")) {
+                        // perform the card update according to users wishes; clicks made
+                        // while earlier ones are in flight are queued too and the session
+                        // merges them into one card write
+                        scard_command_t command;
+                        if (card_id[slot] == SC_REGULAR_ID) {
+                            command.type = SC_CMD_TOPUP;
+                            command.arg = new_value[slot];
+                        } else {
+                            command.type = SC_CMD_SET_TYPE;
+                            command.arg = card_id[slot];
+                        }
+                        scard_completion_t *c = &completion[slot][completion_next[slot] % SC_COMMAND_QUEUE_LEN];
+                        if (! scard_command_done(c) && scard_command_status(c) != SC_CMD_IDLE) {
+                            // every completion is in flight, submit the click untracked
+                            c = NULL;
+                        } else {
+                            completion_next[slot]++;
+                            completion_last[slot] = c;
+                        }
+                        scard_submit(slot, &command, c);
+                    }
+                }
+                unsigned in_flight = 0;
+                for (unsigned i = 0; i < SC_COMMAND_QUEUE_LEN; i++) {
+                    if (! scard_command_done(&completion[slot][i]) && scard_command_status(&completion[slot][i]) != SC_CMD_IDLE) {
+                        in_flight++;
+                    }
+                }
+                scard_completion_t *last = completion_last[slot];
+                unsigned cmd_status = last ? scard_command_status(last) : SC_CMD_IDLE;
+                if (cmd_status != SC_CMD_IDLE) {
+                    if (scard_command_done(last)) {
+                        ImGui::Text("Last command: %s %s (%.1f ms)", scard_command_name(last->command.type),
+                            scard_command_status_name(cmd_status), (last->done_ns - last->submit_ns) / 1e6);
+                    } else {
+                        ImGui::Text("Last command: %s %s", scard_command_name(last->command.type),
+                            scard_command_status_name(cmd_status));
+                    }
+                }
+                if (in_flight > 1) {
+                    ImGui::Text("Commands in flight: %u", in_flight);
+                }
+
+                scard_fsm_stats_t fsm;
+                if (ImGui::TreeNode("State machine")) {
+                    if (scard_get_fsm_stats(slot, &fsm)) {
+                        uint64_t now = scard_now_ns();
+                        for (unsigned state = 0; state < SC_FSM_MAX_STATES; state++) {
+                            uint64_t time_ns = fsm.time_ns[state];
+                            if (state == fsm.state) {
+                                time_ns += now - fsm.entered_ns;
+                            }
+                            if (fsm.entries[state]) {
+                                ImGui::Text("%-12s entered %4lu, %10.3f ms", scard_state_name(state), fsm.entries[state], time_ns / 1e6);
+                            }
+                        }
+                        // last few transitions, newest first
+                        unsigned long count = fsm.transitions < 8 ? fsm.transitions : 8;
+                        for (unsigned long i = 0; i < count; i++) {
+                            const scard_fsm_step_t *step = &fsm.history[(fsm.transitions - 1 - i) % SC_FSM_HISTORY_LEN];
+                            ImGui::Text("%s -> %s after %.3f ms", scard_state_name(step->from), scard_state_name(step->to), step->time_ns / 1e6);
+                        }
+                    }
+                    ImGui::TreePop();
+                }
+
+                ready_changed[slot] = false;
+                ImGui::PopID();
+            }
+            if (! any_reader) {
+                ImGui::Text("Reader attached: NO");
+            }
+
+            scard_ledger_summary_t ledger;
+            scard_ledger_get_summary(&ledger);
+            if (ledger.cards) {
+                ImGui::Separator();
+                ImGui::Text("Ledger: %lu cards, %lu top-ups, value %lu", ledger.cards, ledger.topups, (unsigned long)ledger.value);
+            }
+
             ImGui::End();
         }
 
@@ -248,7 +441,18 @@ int main(int, char**)
         glfwSwapBuffers(window);
     }
 
+    scard_exporter_stop();
+    scard_ipc_stop();
     scard_user_thread_stop();
+    if (scard_provisioning()) {
+        scard_provision_report(stdout);
+    }
+    scard_audit_close();
+    scard_journal_close();
+    scard_ledger_close();
+    scard_shm_close();
+    scard_metrics_set_dump_interval(0);
+    scard_trace_close();
 
     // Cleanup
     ImGui_ImplOpenGL3_Shutdown();
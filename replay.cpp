@@ -0,0 +1,116 @@
+/**
+ *
+ */
+
+// scard_replay: runs the card FSM against a recorded APDU trace
+//
+//   SCUI_TRACE=trace.bin ./scui        record
+//   ./scard_replay [-r] trace.bin      replay, -r keeps the recorded pace
+
+#include "scard.h"
+#include "scard_trace.h"
+
+#include <getopt.h>
+
+// give up on a record when the FSM did not ask for it for this long
+#define REPLAY_STALL_NS                 2000000000ULL
+#define REPLAY_POLL_US                  1000
+
+static int find_slot(const scard_status_t *status, const char *name)
+{
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        if (status->readers[i].active && strcmp(status->readers[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r] <trace file>\n", prog);
+    fprintf(stderr, "  -r  replay at the recorded pace instead of full speed\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool realtime = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "rh")) != -1) {
+        switch (opt) {
+        case 'r':
+            realtime = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (! scard_replay_load(argv[optind], realtime)) {
+        return 1;
+    }
+    scard_set_transport(&scard_replay_transport);
+
+    uint64_t start_ns = scard_now_ns();
+    if (! scard_user_thread_start()) {
+        return 1;
+    }
+
+    unsigned long progress = 0;
+    uint64_t progress_ns = start_ns;
+    while (! scard_replay_done()) {
+        scard_status_t status;
+        scard_get_status(&status);
+        for (unsigned r = 0; r < scard_replay_readers(); r++) {
+            const char *name = scard_replay_reader_name(r);
+            if (! name) {
+                continue;
+            }
+            scard_command_t command;
+            int slot = find_slot(&status, name);
+            if (slot >= 0 && scard_replay_take_command(r, &command)) {
+                // user submitted the command at this point of the recording
+                scard_submit(slot, &command, NULL);
+            }
+        }
+
+        uint64_t now = scard_now_ns();
+        unsigned long cur = scard_replay_progress();
+        if (cur != progress) {
+            progress = cur;
+            progress_ns = now;
+        } else if (now - progress_ns > REPLAY_STALL_NS) {
+            // FSM took another path, skip what it is not going to ask for
+            ERR("replay stalled, skipping records\n");
+            for (unsigned r = 0; r < scard_replay_readers(); r++) {
+                if (scard_replay_reader_name(r)) {
+                    scard_replay_skip(r);
+                }
+            }
+            progress_ns = now;
+        }
+        usleep(REPLAY_POLL_US);
+    }
+    uint64_t elapsed_ns = scard_now_ns() - start_ns;
+    scard_user_thread_stop();
+    scard_log_flush();
+
+    scard_replay_stats_t stats;
+    scard_replay_get_stats(&stats);
+    printf("records     %lu\n", stats.records);
+    printf("apdus       %lu\n", stats.apdus);
+    printf("mismatches  %lu\n", stats.mismatches);
+    printf("skipped     %lu\n", stats.skipped);
+    printf("elapsed     %.3f ms\n", elapsed_ns / 1e6);
+    printf("recorded    %.3f ms in APDUs\n", stats.recorded_ns / 1e6);
+    if (! realtime && stats.apdus) {
+        // at full speed the elapsed time is spent in the FSM alone
+        printf("fsm         %.3f us per APDU\n", elapsed_ns / 1e3 / stats.apdus);
+    }
+    return (stats.mismatches || stats.skipped) ? 2 : 0;
+}
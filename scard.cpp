@@ -4,6 +4,8 @@
 
 
 #include "scard.h"
+#include "scard_metrics.h"
+#include "scard_trace.h"
 
 
 #ifdef WIN32
@@ -15,30 +17,27 @@ const char *pcsc_stringify_error(const LONG rv)
 }
 #endif
 
-static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
-static char _reader_name[SC_MAX_READERNAME_LEN+1];
-static char _reader_firmware[SC_MAX_FIRMWARE_LEN+1];
-static BYTE _reader_max_send;
-static BYTE _reader_max_recv;
-static USHORT _reader_card_types;
-static BYTE _reader_selected_card;
-static BYTE _reader_card_status;
-static LONG _reader_state;
-static PSCARD_IO_REQUEST _card_protocol;
+static const scard_transport_t *_transport = &scard_pcsc_transport;
+
+void scard_set_transport(const scard_transport_t *transport)
+{
+    _transport = transport;
+    DBG("using %s transport\n", _transport->name);
+}
+
+const scard_transport_t *scard_get_transport()
+{
+    return _transport;
+}
 
 bool scard_create_context(PSCARDCONTEXT context)
 {
     // establish PC/SC Connection
-    LONG rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, context);
+    LONG rv = _transport->establish_context(context);
     CHECK("SCardEstablishContext", rv);
     if (rv != SCARD_S_SUCCESS) {
         return false;
     }
-    rv = SCardIsValidContext(*context);
-    CHECK("SCardIsValidContext", rv);
-    if (rv != SCARD_S_SUCCESS) {
-        return false;
-    }
 
     return true;
 }
@@ -46,119 +45,188 @@ bool scard_create_context(PSCARDCONTEXT context)
 void scard_destroy_context(PSCARDCONTEXT context)
 {
     if (*context) {
-        LONG rv = SCardReleaseContext(*context);
+        LONG rv = _transport->release_context(*context);
         CHECK("SCardReleaseContext", rv);
         *context = 0;
     }
 }
 
-void scard_detect_reader(const SCARDCONTEXT context)
+void scard_reader_init(scard_reader_t *reader, LPCSTR name)
 {
-    DWORD dwReaders = SC_MAX_READERNAME_LEN;
-    BYTE mszReaders[SC_MAX_READERNAME_LEN] = {0};
-    LPSTR mszGroups = nullptr;
-
-    LONG rv = SCardListReaders(context, mszGroups, (LPSTR)&mszReaders, &dwReaders);
-    CHECK("SCardListReaders", rv);
-    // save reader name (NULL if not detected)
-    pthread_mutex_lock(&_mutex);
-    strncpy(_reader_name, (LPCSTR)mszReaders, SC_MAX_READERNAME_LEN);
-    pthread_mutex_unlock(&_mutex);
+    memset(reader, 0, sizeof(scard_reader_t));
+    pthread_mutex_init(&reader->mutex, NULL);
+    strncpy(reader->name, name, SC_MAX_READERNAME_LEN);
 }
 
-void scard_wait_for_reader(const SCARDCONTEXT context, const ULONG timeout)
+void scard_reader_destroy(scard_reader_t *reader)
 {
-    SCARD_READERSTATE rgReaderStates[1];
+    pthread_mutex_destroy(&reader->mutex);
+}
 
-    rgReaderStates[0].szReader = "\\\\?PnP?\\Notification";
-    rgReaderStates[0].dwCurrentState = SCARD_STATE_UNAWARE;
-    rgReaderStates[0].dwEventState = SCARD_STATE_UNAWARE;
+unsigned scard_list_readers(const SCARDCONTEXT context, char (*names)[SC_MAX_READERNAME_LEN+1], unsigned max)
+{
+    // ask for the size of the reader list first, it grows with each reader
+    DWORD dwReaders = 0;
+    LPSTR mszReaders = nullptr;
+    LONG rv;
+    do {
+        free(mszReaders);
+        mszReaders = nullptr;
+        rv = _transport->list_readers(context, NULL, &dwReaders);
+        if (rv != SCARD_S_SUCCESS) {
+            break;
+        }
+        mszReaders = (LPSTR)calloc(dwReaders, 1);
+        assert(mszReaders != nullptr);
+        rv = _transport->list_readers(context, mszReaders, &dwReaders);
+        // a reader may attach between the two calls
+    } while (rv == SCARD_E_INSUFFICIENT_BUFFER);
+    if (rv != SCARD_E_NO_READERS_AVAILABLE) {
+        CHECK("SCardListReaders", rv);
+    }
 
-    DBG("enter SCardGetStatusChange: timeout=%ld dwEventState=0x%08lX dwCurrentState=0x%08lX\n",
-        timeout, rgReaderStates[0].dwEventState, rgReaderStates[0].dwCurrentState);
+    // multi-string, each name is NUL terminated, list ends with an empty name
+    unsigned count = 0;
+    if (rv == SCARD_S_SUCCESS) {
+        for (LPCSTR name = mszReaders; *name && count < max; name += strlen(name) + 1) {
+            strncpy(names[count], name, SC_MAX_READERNAME_LEN);
+            names[count][SC_MAX_READERNAME_LEN] = 0;
+            count++;
+        }
+    }
+    free(mszReaders);
+    DBG("found %u readers\n", count);
+    return count;
+}
 
-    LONG rv = SCardGetStatusChange(context, timeout, rgReaderStates, 1);
-    CHECK("SCardGetStatusChange", rv);
-    DBG("leave SCardGetStatusChange: rv=0x%08lX dwEventState=0x%08lX dwCurrentState=0x%08lX\n",
-        rv, rgReaderStates[0].dwEventState, rgReaderStates[0].dwCurrentState);
+uint64_t scard_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void scard_wait_for_card(const SCARDCONTEXT context, const ULONG timeout)
+uint64_t scard_wall_ns()
 {
-    pthread_mutex_lock(&_mutex);
-    char reader_name[SC_MAX_READERNAME_LEN] = {0};
-    strncpy(reader_name, _reader_name, SC_MAX_READERNAME_LEN);
-    LONG reader_state = _reader_state;
-    pthread_mutex_unlock(&_mutex);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    SCARD_READERSTATE rgReaderStates[1];
-    rgReaderStates[0].szReader = reader_name;
-    rgReaderStates[0].dwCurrentState = reader_state;
-    rgReaderStates[0].dwEventState = SCARD_STATE_UNAWARE;
+uint32_t scard_crc32(const void *data, size_t len)
+{
+    static uint32_t table[256];
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    });
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
 
-    DBG("enter SCardGetStatusChange: timeout=%ld reader_state=0x%08lX\n", timeout, reader_state);
-    LONG rv = SCardGetStatusChange(context, timeout, rgReaderStates, 1);
-    CHECK("SCardGetStatusChange", rv);
-    
-    if (rv == SCARD_S_SUCCESS) {
-        pthread_mutex_lock(&_mutex);
-        _reader_state = rgReaderStates[0].dwEventState;
-        pthread_mutex_unlock(&_mutex);
+LONG scard_wait_for_change(const SCARDCONTEXT context, SCARD_READERSTATE *states, DWORD count, const ULONG timeout)
+{
+    DBG("enter SCardGetStatusChange: timeout=%ld readers=%lu\n", timeout, count);
+    LONG rv = _transport->get_status_change(context, timeout, states, count);
+    if (rv != SCARD_E_TIMEOUT && rv != SCARD_E_CANCELLED) {
+        CHECK("SCardGetStatusChange", rv);
     }
-    DBG("leave SCardGetStatusChange: reader_state=0x%08lX\n", _reader_state);
+    DBG("leave SCardGetStatusChange: rv=0x%08lX\n", rv);
+    return rv;
 }
 
-bool scard_reader_presence()
+LONG scard_get_reader_state(scard_reader_t *reader)
 {
-    pthread_mutex_lock(&_mutex);
-    bool rv = (_reader_name[0] != 0) ? true : false;
-    pthread_mutex_unlock(&_mutex);
+    pthread_mutex_lock(&reader->mutex);
+    LONG rv = reader->state;
+    pthread_mutex_unlock(&reader->mutex);
     return rv;
 }
 
-bool scard_card_presence()
+void scard_set_reader_state(scard_reader_t *reader, LONG state)
+{
+    pthread_mutex_lock(&reader->mutex);
+    reader->state = state;
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+bool scard_reader_presence(scard_reader_t *reader)
 {
-    pthread_mutex_lock(&_mutex);
-    bool rv = (_reader_state & SCARD_STATE_PRESENT) ? true : false;
-    pthread_mutex_unlock(&_mutex);
+    pthread_mutex_lock(&reader->mutex);
+    bool rv = (reader->state & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE)) ? false : true;
+    pthread_mutex_unlock(&reader->mutex);
     return rv;
 }
 
-char *scard_reader_name()
+bool scard_card_presence(scard_reader_t *reader)
 {
-    // caller should lock the access to reader_name
-    // and copy the contents to local buffer (variable)
-    return _reader_name;
+    pthread_mutex_lock(&reader->mutex);
+    bool rv = (reader->state & SCARD_STATE_PRESENT) ? true : false;
+    pthread_mutex_unlock(&reader->mutex);
+    return rv;
 }
 
-void scard_reset_reader_state()
+void scard_reader_name(scard_reader_t *reader, char *name, size_t len)
+{
+    pthread_mutex_lock(&reader->mutex);
+    strncpy(name, reader->name, len - 1);
+    name[len - 1] = 0;
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+void scard_reset_reader_state(scard_reader_t *reader)
 {
     TRC("clearing reader state..\n");
-    memset(_reader_name, 0, SC_MAX_READERNAME_LEN);
-    memset(_reader_firmware, 0, SC_MAX_FIRMWARE_LEN);
-    _reader_max_send = 0;
-    _reader_max_recv = 0;
-    _reader_card_types = 0;
-    _reader_selected_card = 0;
-    _reader_card_status = 0;
-    _reader_state = 0;
+    pthread_mutex_lock(&reader->mutex);
+    memset(reader->firmware, 0, SC_MAX_FIRMWARE_LEN);
+    reader->max_send = 0;
+    reader->max_recv = 0;
+    reader->card_types = 0;
+    reader->selected_card = 0;
+    reader->card_status = 0;
+    reader->state = 0;
+    pthread_mutex_unlock(&reader->mutex);
 }
 
-void scard_reset_card_state()
+void scard_reset_card_state(scard_reader_t *reader)
 {
     TRC("clearing card state..\n");
-    _card_protocol = 0;
+    pthread_mutex_lock(&reader->mutex);
+    reader->card_protocol = 0;
+    memset(reader->atr, 0, sizeof(reader->atr));
+    reader->atr_len = 0;
+    reader->card_class = SC_CARD_UNKNOWN;
+    reader->last_rv = SCARD_S_SUCCESS;
+    reader->last_ins = 0;
+    memset(reader->last_sw, 0, sizeof(reader->last_sw));
+    memset(&reader->card_image, 0, sizeof(reader->card_image));
+    pthread_mutex_unlock(&reader->mutex);
 }
 
-bool scard_connect_card(const SCARDCONTEXT context, PSCARDHANDLE handle)
+// only the session thread looks at these, no lock
+static void set_last_result(scard_reader_t *reader, LONG rv, BYTE ins, const BYTE *sw)
+{
+    reader->last_rv = rv;
+    reader->last_ins = ins;
+    reader->last_sw[0] = sw ? sw[0] : 0;
+    reader->last_sw[1] = sw ? sw[1] : 0;
+}
+
+bool scard_connect_card(const SCARDCONTEXT context, scard_reader_t *reader, PSCARDHANDLE handle)
 {
     DWORD dwActiveProtocol;
-    pthread_mutex_lock(&_mutex);
-    char reader_name[SC_MAX_READERNAME_LEN] = {0};
-    strncpy(reader_name, _reader_name, SC_MAX_READERNAME_LEN);
-    pthread_mutex_unlock(&_mutex);
-    LONG rv = SCardConnect(context, reader_name, SCARD_SHARE_SHARED,
-        SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, handle, &dwActiveProtocol);
+    LONG rv = _transport->connect(context, reader->name, handle, &dwActiveProtocol);
+    set_last_result(reader, rv, 0, NULL);
     CHECK("SCardConnect", rv);
     if (rv != SCARD_S_SUCCESS) {
         return false;
@@ -177,57 +245,159 @@ bool scard_connect_card(const SCARDCONTEXT context, PSCARDHANDLE handle)
         break;
     default:
         ERR("failed to get proper protocol\n");
+        set_last_result(reader, SCARD_E_PROTO_MISMATCH, 0, NULL);
         return false;
     }
 
-    pthread_mutex_lock(&_mutex);
-    _card_protocol = card_protocol;
-    pthread_mutex_unlock(&_mutex);
+    pthread_mutex_lock(&reader->mutex);
+    reader->card_protocol = card_protocol;
+    pthread_mutex_unlock(&reader->mutex);
 
     DBG("connected to card!\n");
     return true;
 }
 
-void scard_disconnect_card(PSCARDHANDLE handle)
+void scard_disconnect_card(scard_reader_t *reader, PSCARDHANDLE handle)
 {
-    LONG rv = SCardDisconnect(*handle, SCARD_UNPOWER_CARD);
-    CHECK("SCardDisconnect", rv);
-    // ignore return status
-    pthread_mutex_lock(&_mutex);
-    _card_protocol = 0;
-    pthread_mutex_unlock(&_mutex);
+    if (*handle) {
+        LONG rv = _transport->disconnect(*handle, SCARD_UNPOWER_CARD);
+        CHECK("SCardDisconnect", rv);
+        // ignore return status
+    }
+    pthread_mutex_lock(&reader->mutex);
+    reader->card_protocol = 0;
+    reader->card_image.valid = false;
+    pthread_mutex_unlock(&reader->mutex);
     *handle = 0;
     DBG("disconnected from card!\n");
 }
 
-static char s_hexbuf[3*SC_MAX_REQUEST_LEN] = {0};
-static void to_hex(LPBYTE data, ULONG len)
+// memory card ATR is the 4 byte header (H1..H4) defined by ISO 7816-10;
+// PC/SC readers report it as the historical bytes of an ISO 7816-3 ATR
+// behind TS 3B and T0 04 (no interface bytes, 4 historical bytes)
+#define ATR_PREFIX_LEN          2
+static const BYTE atr_prefix[ATR_PREFIX_LEN] = {0x3B, 0x04};
+
+typedef struct {
+    scard_card_class_t card_class;
+    const char *name;
+    BYTE atr[4];
+    BYTE mask[4];
+    bool supported;
+} card_type_t;
+
+static const card_type_t card_types[] = {
+    // H1 2-wire protocol, H2 256 x 8 bit, H3 H4 from the SLE4442 datasheet
+    { SC_CARD_SLE4442, "SLE4442", {0xA2, 0x13, 0x10, 0x91}, {0xFF, 0xFF, 0xFF, 0xFF}, true },
+    // H1 3-wire protocol, H2 1024 x 8 bit
+    { SC_CARD_SLE4428, "SLE4428", {0x92, 0x23, 0x10, 0x91}, {0xFF, 0xFF, 0xFF, 0xFF}, false },
+};
+
+static const card_type_t *find_card_type(scard_card_class_t card_class)
+{
+    for (unsigned i = 0; i < sizeof(card_types) / sizeof(card_types[0]); i++) {
+        if (card_types[i].card_class == card_class) {
+            return &card_types[i];
+        }
+    }
+    return nullptr;
+}
+
+scard_card_class_t scard_classify_atr(const BYTE *atr, DWORD atr_len)
 {
-    int off = 0;
-    memset(s_hexbuf, 0, 3*SC_MAX_REQUEST_LEN);
-    for (ULONG i = 0; i < len; i++) {
-        off += sprintf(s_hexbuf + off, "%02X ", data[i]);
+    if (atr_len == ATR_PREFIX_LEN + 4 && memcmp(atr, atr_prefix, ATR_PREFIX_LEN) == 0) {
+        atr += ATR_PREFIX_LEN;
+        atr_len -= ATR_PREFIX_LEN;
+    }
+    if (atr_len != 4) {
+        return SC_CARD_UNKNOWN;
+    }
+    for (unsigned i = 0; i < sizeof(card_types) / sizeof(card_types[0]); i++) {
+        const card_type_t *type = &card_types[i];
+        bool match = true;
+        for (unsigned n = 0; n < 4; n++) {
+            match &= ((atr[n] & type->mask[n]) == type->atr[n]);
+        }
+        if (match) {
+            return type->card_class;
+        }
     }
+    return SC_CARD_UNKNOWN;
 }
 
-static bool do_xfer(const SCARDHANDLE handle, const LPBYTE send_data, const ULONG send_len, LPBYTE recv_data, ULONG *recv_len, LPBYTE sw_data)
+const char *scard_card_class_name(scard_card_class_t card_class)
+{
+    const card_type_t *type = find_card_type(card_class);
+    return type ? type->name : "unknown";
+}
+
+bool scard_card_class_supported(scard_card_class_t card_class)
+{
+    const card_type_t *type = find_card_type(card_class);
+    return type ? type->supported : false;
+}
+
+bool scard_read_atr(scard_reader_t *reader, const SCARDHANDLE handle)
+{
+    BYTE atr[MAX_ATR_SIZE];
+    DWORD atr_len = sizeof(atr);
+    DWORD state = 0;
+    DWORD protocol = 0;
+    LONG rv = _transport->status(handle, NULL, NULL, &state, &protocol, atr, &atr_len);
+    set_last_result(reader, rv, 0, NULL);
+    CHECK("SCardStatus", rv);
+    if (rv != SCARD_S_SUCCESS) {
+        return false;
+    }
+    scard_trace_event(reader->id, SC_TRACE_ATR, atr, atr_len);
+    DBG_HEX("ATR", atr, atr_len);
+
+    scard_card_class_t card_class = scard_classify_atr(atr, atr_len);
+    pthread_mutex_lock(&reader->mutex);
+    memcpy(reader->atr, atr, atr_len);
+    reader->atr_len = atr_len;
+    reader->card_class = card_class;
+    pthread_mutex_unlock(&reader->mutex);
+    DBG("card is %s\n", scard_card_class_name(card_class));
+    return true;
+}
+
+static bool do_xfer(scard_reader_t *reader, const SCARDHANDLE handle, const LPBYTE send_data, const ULONG send_len, LPBYTE recv_data, ULONG *recv_len, LPBYTE sw_data)
 {
     // dump request
-    to_hex(send_data, send_len);
-    DBG("SEND: [%lu]: %s\n", send_len, s_hexbuf);
-
-    BYTE tmp_buf[SC_MAX_REQUEST_LEN+1];
-    // SW1 and SW2 will be added at the end of the response
-    ULONG tmp_len = *recv_len + 2;
-    assert(_card_protocol != 0);
-    ULONG rv = SCardTransmit(handle, _card_protocol, send_data, send_len, NULL, tmp_buf, &tmp_len);
+    DBG_HEX("SEND", send_data, send_len);
+
+    // largest response buffer of the callers, plus SW1 and SW2
+    BYTE tmp_buf[SC_MAX_REQUEST_LEN+1+2];
+    // SW1 and SW2 will be added at the end of the response; the transport
+    // must never be told there is more room than tmp_buf has
+    DWORD tmp_len = *recv_len + 2;
+    if (tmp_len > sizeof(tmp_buf)) {
+        tmp_len = sizeof(tmp_buf);
+    }
+    assert(reader->card_protocol != 0);
+    uint64_t start_ns = scard_now_ns();
+    LONG rv = _transport->transmit(handle, reader->card_protocol, send_data, send_len, tmp_buf, &tmp_len);
+    uint64_t duration_ns = scard_now_ns() - start_ns;
+    scard_metrics_apdu(send_data[1], duration_ns);
+    if (scard_trace_enabled()) {
+        scard_trace_apdu(reader->id, start_ns, duration_ns, rv,
+            send_data, send_len, tmp_buf, (rv == SCARD_S_SUCCESS) ? tmp_len : 0);
+    }
     CHECK("SCardTransmit", rv);
     if (rv != SCARD_S_SUCCESS) {
+        scard_metrics_apdu_status(send_data[1], 0);
+        set_last_result(reader, rv, send_data[1], NULL);
         return false;
     }
     // dump response
-    to_hex(tmp_buf, tmp_len);
-    DBG("RECV: [%lu]: %s\n", tmp_len, s_hexbuf);
+    DBG_HEX("RECV", tmp_buf, tmp_len);
+    if (tmp_len < 2) {
+        ERR("response of %lu bytes has no status word\n", (unsigned long)tmp_len);
+        scard_metrics_apdu_status(send_data[1], 0);
+        set_last_result(reader, SCARD_E_NOT_TRANSACTED, send_data[1], NULL);
+        return false;
+    }
 
     // SW1 and SW2 are at the end of response
     tmp_len -= 2;
@@ -235,10 +405,68 @@ static bool do_xfer(const SCARDHANDLE handle, const LPBYTE send_data, const ULON
     memcpy(recv_data, tmp_buf, tmp_len);
     memcpy(sw_data, tmp_buf + tmp_len, 2);
     *recv_len = tmp_len;
+    scard_metrics_apdu_status(send_data[1], sw_data[0] << 8 | sw_data[1]);
+    set_last_result(reader, rv, send_data[1], sw_data);
+    if (sw_data[0] == 0x6A && sw_data[1] == 0x81) {
+        // card type is not selected (anymore), select it again on next identify
+        pthread_mutex_lock(&reader->mutex);
+        reader->selected_card = 0;
+        pthread_mutex_unlock(&reader->mutex);
+    }
 
     return true;
 }
 
+static const char *error_class_names[SC_NUM_ERRORS] = {
+    "none",
+    "transient",
+    "removed",
+    "status word",
+    "PIN",
+    "reader"
+};
+
+scard_error_class_t scard_classify_error(const scard_reader_t *reader)
+{
+    switch (reader->last_rv) {
+    case SCARD_S_SUCCESS:
+        break;
+    case SCARD_W_REMOVED_CARD:
+    case SCARD_E_NO_SMARTCARD:
+        return SC_ERROR_REMOVED;
+    case SCARD_E_READER_UNAVAILABLE:
+    case SCARD_E_UNKNOWN_READER:
+    case SCARD_E_NO_READERS_AVAILABLE:
+    case SCARD_E_NO_SERVICE:
+    case SCARD_E_SERVICE_STOPPED:
+        return SC_ERROR_READER;
+    default:
+        // timeouts, lost or garbled data, a reset by another application
+        return SC_ERROR_TRANSIENT;
+    }
+
+    if (reader->last_ins == 0x20) {
+        // PRESENT_CODE answers 90 07 when the PIN is accepted, the
+        // remaining attempts otherwise
+        if (reader->last_sw[0] == 0x90 && reader->last_sw[1] == 0x07) {
+            return SC_ERROR_NONE;
+        }
+        return (reader->last_sw[0] == 0x90) ? SC_ERROR_PIN : SC_ERROR_SW;
+    }
+    if (reader->last_ins && ! (reader->last_sw[0] == 0x90 && reader->last_sw[1] == 0x00)) {
+        return SC_ERROR_SW;
+    }
+    return SC_ERROR_NONE;
+}
+
+const char *scard_error_class_name(unsigned error_class)
+{
+    if (error_class >= SC_NUM_ERRORS) {
+        return "?";
+    }
+    return error_class_names[error_class];
+}
+
 static bool check_sw(const LPBYTE sw_data, const BYTE sw1, const BYTE sw2)
 {
     if ((sw_data[0] == sw1) && (sw_data[1] == sw2)) {
@@ -252,7 +480,7 @@ static bool check_sw(const LPBYTE sw_data, const BYTE sw1, const BYTE sw2)
     return false;
 }
 
-bool scard_get_reader_info(const SCARDHANDLE handle)
+bool scard_get_reader_info(scard_reader_t *reader, const SCARDHANDLE handle)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.4.1. GET_READER_INFORMATION
     BYTE send_data[] = {0xFF, 0x09, 0x00, 0x00, 0x10};
@@ -260,7 +488,7 @@ bool scard_get_reader_info(const SCARDHANDLE handle)
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -270,26 +498,29 @@ bool scard_get_reader_info(const SCARDHANDLE handle)
         return false;
     }
     // response is 16 bytes long
-    assert(recv_len == 16);
+    if (recv_len != 16) {
+        ERR("reader info is %lu bytes, expected 16\n", (unsigned long)recv_len);
+        return false;
+    }
     // 10 bytes of firmware version
-    pthread_mutex_lock(&_mutex);
-    memcpy(_reader_firmware, recv_data, SC_MAX_FIRMWARE_LEN);
-    _reader_max_send = recv_data[10];
-    _reader_max_recv = recv_data[11];
-    _reader_card_types = (recv_data[12] << 8) | recv_data[13];
-    _reader_selected_card = recv_data[14];
-    _reader_card_status = recv_data[15];
-    pthread_mutex_unlock(&_mutex);
-    DBG("firmware: %s\n", _reader_firmware);
-    DBG("send max %d bytes\n", _reader_max_send);
-    DBG("recv max %d bytes\n", _reader_max_recv);
-    DBG("card types 0x%04X\n", _reader_card_types);
-    DBG("selected card 0x%02X\n", _reader_selected_card);
-    DBG("card status %d\n", _reader_card_status);
+    pthread_mutex_lock(&reader->mutex);
+    memcpy(reader->firmware, recv_data, SC_MAX_FIRMWARE_LEN);
+    reader->max_send = recv_data[10];
+    reader->max_recv = recv_data[11];
+    reader->card_types = (recv_data[12] << 8) | recv_data[13];
+    reader->selected_card = recv_data[14];
+    reader->card_status = recv_data[15];
+    pthread_mutex_unlock(&reader->mutex);
+    DBG("firmware: %s\n", reader->firmware);
+    DBG("send max %d bytes\n", reader->max_send);
+    DBG("recv max %d bytes\n", reader->max_recv);
+    DBG("card types 0x%04X\n", reader->card_types);
+    DBG("selected card 0x%02X\n", reader->selected_card);
+    DBG("card status %d\n", reader->card_status);
     return true;
 }
 
-bool scard_select_memory_card(const SCARDHANDLE handle)
+bool scard_select_memory_card(scard_reader_t *reader, const SCARDHANDLE handle)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.1. SELECT_CARD_TYPE
     // working with memory cards of type SLE 4432, SLE 4442, SLE 5532, SLE 5542
@@ -298,7 +529,7 @@ bool scard_select_memory_card(const SCARDHANDLE handle)
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -308,11 +539,66 @@ bool scard_select_memory_card(const SCARDHANDLE handle)
         return false;
     }
     // response is 0 bytes long
+    pthread_mutex_lock(&reader->mutex);
+    reader->selected_card = 0x06;
+    pthread_mutex_unlock(&reader->mutex);
     DBG("card selected!\n");
     return true;
 }
 
-bool scard_get_error_counter(const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2, LPBYTE pin3, LPBYTE pin_retries)
+bool scard_identify_reader(scard_reader_t *reader, const SCARDHANDLE handle)
+{
+    scard_reader_caps_t caps;
+    bool cached = scard_reader_cache_lookup(reader->name, &caps);
+    if (cached) {
+        pthread_mutex_lock(&reader->mutex);
+        memcpy(reader->firmware, caps.firmware, SC_MAX_FIRMWARE_LEN);
+        reader->max_send = caps.max_send;
+        reader->max_recv = caps.max_recv;
+        reader->card_types = caps.card_types;
+        pthread_mutex_unlock(&reader->mutex);
+        DBG("reader info from cache, firmware: %s\n", reader->firmware);
+        if (scard_trace_enabled()) {
+            // no GET_READER_INFORMATION in the trace, replay seeds its cache from this
+            BYTE info[SC_TRACE_CAPS_LEN];
+            memcpy(info, caps.firmware, SC_MAX_FIRMWARE_LEN);
+            info[10] = caps.max_send;
+            info[11] = caps.max_recv;
+            info[12] = caps.card_types >> 8;
+            info[13] = caps.card_types & 0xFF;
+            scard_trace_event(reader->id, SC_TRACE_CAPS, info, sizeof(info));
+        }
+    } else {
+        if (! scard_get_reader_info(reader, handle)) {
+            return false;
+        }
+        memset(&caps, 0, sizeof(caps));
+        pthread_mutex_lock(&reader->mutex);
+        strncpy(caps.name, reader->name, SC_MAX_READERNAME_LEN);
+        memcpy(caps.firmware, reader->firmware, SC_MAX_FIRMWARE_LEN);
+        caps.max_send = reader->max_send;
+        caps.max_recv = reader->max_recv;
+        caps.card_types = reader->card_types;
+        pthread_mutex_unlock(&reader->mutex);
+        scard_reader_cache_store(&caps);
+    }
+
+    // the reader keeps the selected card type between cards
+    if (reader->selected_card == 0x06) {
+        DBG("memory card type already selected\n");
+        return true;
+    }
+    if (! scard_select_memory_card(reader, handle)) {
+        if (cached) {
+            // may be a different reader under the same name, ask it next time
+            scard_reader_cache_forget(reader->name);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool scard_get_error_counter(scard_reader_t *reader, const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2, LPBYTE pin3, LPBYTE pin_retries)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.3. READ_PRESENTATION_ERROR_COUNTER_MEMORY_CARD
     // for SLE 4442 and SLE 5542 memory cards
@@ -321,7 +607,7 @@ bool scard_get_error_counter(const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2,
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -331,7 +617,10 @@ bool scard_get_error_counter(const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2,
         return false;
     }
     // response is 4 bytes long
-    assert(recv_len == 4);
+    if (recv_len != 4) {
+        ERR("error counter is %lu bytes, expected 4\n", (unsigned long)recv_len);
+        return false;
+    }
     *pin_retries = recv_data[0];
     *pin1 = recv_data[1];
     *pin2 = recv_data[2];
@@ -344,7 +633,7 @@ bool scard_get_error_counter(const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2,
     return true;
 }
 
-bool scard_read_user_data(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len)
+static bool read_memory(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.2.READ_MEMORY_CARD
     BYTE send_data[] = {0xFF, 0xB0, 0x00, address, len};
@@ -352,7 +641,7 @@ bool scard_read_user_data(const SCARDHANDLE handle, BYTE address, LPBYTE data, B
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -361,14 +650,115 @@ bool scard_read_user_data(const SCARDHANDLE handle, BYTE address, LPBYTE data, B
     if (! rv) {
         return false;
     }
-    // response is recv_len bytes long
-    assert(recv_len == len);
+    // response is len bytes long
+    if (recv_len != len) {
+        ERR("read %lu bytes at %u, expected %u\n", (unsigned long)recv_len, address, len);
+        return false;
+    }
     memcpy(data, recv_data, len);
 
     return true;
 }
 
-bool scard_present_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3, LPBYTE pin_retries)
+static bool read_protection(scard_reader_t *reader, const SCARDHANDLE handle, LPBYTE data)
+{
+    // REF-ACR38x-CCID-6.05.pdf, 9.3.6.4. READ_PROTECTION_BITS
+    // for SLE 4442 and SLE 5542 memory cards
+    BYTE send_data[] = {0xFF, 0xB2, 0x00, 0x00, SC_CARD_PROTECTION_LEN};
+    ULONG send_len = sizeof(send_data);
+    BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
+    ULONG recv_len = sizeof(recv_data);
+    BYTE sw_data[2+1] = {0};
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    if (! rv) {
+        return false;
+    }
+    // success is 90 00
+    rv = check_sw(sw_data, 0x90, 0x00);
+    if (! rv) {
+        return false;
+    }
+    // response is 4 bytes long
+    if (recv_len != SC_CARD_PROTECTION_LEN) {
+        ERR("protection bits are %lu bytes, expected %u\n", (unsigned long)recv_len, SC_CARD_PROTECTION_LEN);
+        return false;
+    }
+    memcpy(data, recv_data, SC_CARD_PROTECTION_LEN);
+
+    return true;
+}
+
+bool scard_read_card_image(scard_reader_t *reader, const SCARDHANDLE handle)
+{
+    // read the whole main memory in as few chunks as the reader allows
+    BYTE chunk = reader->max_recv;
+    if (chunk == 0) {
+        chunk = SC_MAX_REQUEST_LEN;
+    }
+    scard_card_image_t image;
+    memset(&image, 0, sizeof(image));
+    unsigned address = 0;
+    while (address < SC_CARD_MEMORY_LEN) {
+        BYTE len = chunk;
+        if (address + len > SC_CARD_MEMORY_LEN) {
+            len = SC_CARD_MEMORY_LEN - address;
+        }
+        if (! read_memory(reader, handle, address, image.memory + address, len)) {
+            return false;
+        }
+        address += len;
+    }
+    if (! read_protection(reader, handle, image.protection)) {
+        return false;
+    }
+    image.valid = true;
+
+    pthread_mutex_lock(&reader->mutex);
+    reader->card_image = image;
+    pthread_mutex_unlock(&reader->mutex);
+    DBG("card image read in %u byte chunks\n", chunk);
+    return true;
+}
+
+bool scard_get_card_image(scard_reader_t *reader, scard_card_image_t *image)
+{
+    pthread_mutex_lock(&reader->mutex);
+    *image = reader->card_image;
+    pthread_mutex_unlock(&reader->mutex);
+    return image->valid;
+}
+
+uint32_t scard_card_hash(scard_reader_t *reader)
+{
+    uint32_t hash = 0;
+    pthread_mutex_lock(&reader->mutex);
+    if (reader->card_image.valid) {
+        hash = 2166136261u;
+        for (unsigned i = 0; i < 32; i++) {
+            hash = (hash ^ reader->card_image.memory[i]) * 16777619u;
+        }
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return hash;
+}
+
+bool scard_read_user_data(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len)
+{
+    // serve from the card image if we have it
+    pthread_mutex_lock(&reader->mutex);
+    bool cached = reader->card_image.valid && (address + len <= SC_CARD_MEMORY_LEN);
+    if (cached) {
+        memcpy(data, reader->card_image.memory + address, len);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    if (cached) {
+        return true;
+    }
+
+    return read_memory(reader, handle, address, data, len);
+}
+
+bool scard_present_pin(scard_reader_t *reader, const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3, LPBYTE pin_retries)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.7. PRESENT_CODE_MEMORY_CARD
     // for SLE 4442 and SLE 5542 memory cards
@@ -377,7 +767,7 @@ bool scard_present_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -396,7 +786,7 @@ bool scard_present_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3
     return true;
 }
 
-bool scard_change_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3)
+bool scard_change_pin(scard_reader_t *reader, const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.8. CHANGE_CODE_MEMORY_CARD
     // for SLE 4442 and SLE 5542 memory cards
@@ -405,7 +795,7 @@ bool scard_change_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3)
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -420,7 +810,7 @@ bool scard_change_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3)
     return true;
 }
 
-bool scard_write_card(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len)
+static bool write_memory(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, const BYTE *data, BYTE len)
 {
     // REF-ACR38x-CCID-6.05.pdf, 9.3.6.5. WRITE_MEMORY_CARD
     BYTE send_data[SC_MAX_REQUEST_LEN+1];
@@ -435,7 +825,7 @@ bool scard_write_card(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE
     BYTE recv_data[SC_MAX_REQUEST_LEN+1] = {0};
     ULONG recv_len = sizeof(recv_data);
     BYTE sw_data[2+1] = {0};
-    bool rv = do_xfer(handle, send_data, send_len, recv_data, &recv_len, sw_data);
+    bool rv = do_xfer(reader, handle, send_data, send_len, recv_data, &recv_len, sw_data);
     if (! rv) {
         return false;
     }
@@ -448,3 +838,143 @@ bool scard_write_card(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE
     // assert(recv_len == 0);
     return true;
 }
+
+static void plan_add(scard_write_plan_t *plan, unsigned address, unsigned len, BYTE max_payload)
+{
+    // split ranges that do not fit in one command
+    while (len > 0) {
+        unsigned n = (len > max_payload) ? max_payload : len;
+        assert(plan->count < SC_CARD_MEMORY_LEN);
+        plan->ranges[plan->count].address = address;
+        plan->ranges[plan->count].len = n;
+        plan->count++;
+        address += n;
+        len -= n;
+    }
+}
+
+void scard_plan_write(const BYTE *current, BYTE address, const BYTE *data, BYTE len, BYTE max_payload, scard_write_plan_t *plan)
+{
+    plan->count = 0;
+    assert(max_payload > 0);
+    if (! current) {
+        // nothing known about the card contents, write it all
+        plan_add(plan, address, len, max_payload);
+        return;
+    }
+
+    // largest clean gap that is cheaper to rewrite than to skip with a new APDU
+    unsigned max_gap = SC_WRITE_APDU_COST_US / SC_WRITE_BYTE_COST_US;
+    int start = -1;
+    int end = -1;
+    for (unsigned i = 0; i < len; i++) {
+        if (data[i] == current[i]) {
+            continue;
+        }
+        if (start < 0) {
+            start = end = i;
+        } else if (i - end - 1 <= max_gap && i - start < max_payload) {
+            end = i;
+        } else {
+            plan_add(plan, address + start, end - start + 1, max_payload);
+            start = end = i;
+        }
+    }
+    if (start >= 0) {
+        plan_add(plan, address + start, end - start + 1, max_payload);
+    }
+}
+
+bool scard_write_card(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len)
+{
+    // command header takes 5 bytes of what the reader accepts
+    BYTE max_payload = SC_MAX_REQUEST_LEN - 5;
+    if (reader->max_send > 5) {
+        max_payload = reader->max_send - 5;
+    }
+
+    // diff against the card image, if we have one
+    BYTE current[SC_CARD_MEMORY_LEN];
+    pthread_mutex_lock(&reader->mutex);
+    bool cached = reader->card_image.valid && (address + len <= SC_CARD_MEMORY_LEN);
+    if (cached) {
+        memcpy(current, reader->card_image.memory + address, len);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+
+    scard_write_plan_t plan;
+    scard_plan_write(cached ? current : NULL, address, data, len, max_payload, &plan);
+
+    scard_write_stats_t stats;
+    stats.bytes_requested = len;
+    stats.bytes_written = 0;
+    stats.apdus = 0;
+    bool rv = true;
+    for (unsigned i = 0; i < plan.count; i++) {
+        const scard_write_range_t *range = &plan.ranges[i];
+        rv = write_memory(reader, handle, range->address, data + (range->address - address), range->len);
+        if (! rv) {
+            break;
+        }
+        stats.bytes_written += range->len;
+        stats.apdus++;
+        // keep the card image in sync with what is on the card
+        pthread_mutex_lock(&reader->mutex);
+        if (reader->card_image.valid) {
+            memcpy(reader->card_image.memory + range->address, data + (range->address - address), range->len);
+        }
+        pthread_mutex_unlock(&reader->mutex);
+    }
+
+    pthread_mutex_lock(&reader->mutex);
+    reader->write_stats = stats;
+    pthread_mutex_unlock(&reader->mutex);
+    DBG("wrote %u of %u bytes in %u APDUs\n", stats.bytes_written, stats.bytes_requested, stats.apdus);
+    return rv;
+}
+
+bool scard_verify_card(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, BYTE len)
+{
+    // read back only the given range and check it against the card image
+    BYTE chunk = reader->max_recv;
+    if (chunk == 0) {
+        chunk = SC_MAX_REQUEST_LEN;
+    }
+    if (address + len > SC_CARD_MEMORY_LEN) {
+        return false;
+    }
+    BYTE card[SC_CARD_MEMORY_LEN];
+    unsigned done = 0;
+    while (done < len) {
+        BYTE n = chunk;
+        if (done + n > len) {
+            n = len - done;
+        }
+        if (! read_memory(reader, handle, address + done, card + done, n)) {
+            return false;
+        }
+        done += n;
+    }
+
+    pthread_mutex_lock(&reader->mutex);
+    bool rv = reader->card_image.valid;
+    if (rv && memcmp(reader->card_image.memory + address, card, len) != 0) {
+        // the card has the final say, keep the image honest
+        memcpy(reader->card_image.memory + address, card, len);
+        rv = false;
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    if (! rv) {
+        ERR("card content at %u (%u bytes) does not match what was written\n", address, len);
+        return false;
+    }
+    DBG("verified %u bytes at %u\n", len, address);
+    return true;
+}
+
+void scard_get_write_stats(scard_reader_t *reader, scard_write_stats_t *stats)
+{
+    pthread_mutex_lock(&reader->mutex);
+    *stats = reader->write_stats;
+    pthread_mutex_unlock(&reader->mutex);
+}
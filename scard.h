@@ -12,49 +12,33 @@
 #endif
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
-// PC/SC lite
-#ifdef __APPLE__
-#include <PCSC/winscard.h>
-#include <PCSC/wintypes.h>
-#else
-#include <winscard.h>
-#endif
+#include "scard_fsm.h"
+#include "scard_log.h"
+#include "scard_transport.h"
 
 #define _UNUSED(arg) (void)arg;
 
-// formated logging
-#define _LOG(x, ...) { \
-    fprintf(stderr, "[%s] %s():%d : ", x, __func__, __LINE__); \
-    fprintf(stderr, __VA_ARGS__); \
-    }
-#define TRC(...) { _LOG("TRC", __VA_ARGS__) }
-#define DBG(...) { _LOG("DBG", __VA_ARGS__) }
-#define INF(...) { _LOG("INF", __VA_ARGS__) }
-#define ERR(...) { _LOG("ERR", __VA_ARGS__) }
-
 // check status and print error if any
 #define CHECK(f, rv) \
     if (SCARD_S_SUCCESS != rv) \
     { \
-        static char out[100]; \
-        sprintf(out, "%s() failed with: '%s'", f, pcsc_stringify_error(rv)); \
-        ERR("%s\n", out); \
+        ERR("%s() failed with: '%s'\n", f, pcsc_stringify_error(rv)); \
     }
 
 // check status, print error if any and then return
 #define RETURN(f, rv) \
     if (SCARD_S_SUCCESS != rv) \
     { \
-        static char out[100]; \
-        sprintf(out, "%s() failed with: '%s'", f, pcsc_stringify_error(rv)); \
-        ERR("%s\n", out); \
+        ERR("%s() failed with: '%s'\n", f, pcsc_stringify_error(rv)); \
         TRC("Leave %ld\n", rv); \
         return rv; \
     }
@@ -62,6 +46,16 @@
 #define SC_MAX_READERNAME_LEN           128
 #define SC_MAX_REQUEST_LEN              255
 #define SC_MAX_FIRMWARE_LEN             10
+#define SC_MAX_READERS                  8
+
+// SLE4442 main memory and the protection bits of its first 32 bytes
+#define SC_CARD_MEMORY_LEN              256
+#define SC_CARD_PROTECTION_LEN          4
+
+// write planner cost model in microseconds; a clean gap between two dirty
+// ranges is rewritten when that is cheaper than another APDU round trip
+#define SC_WRITE_APDU_COST_US           3000
+#define SC_WRITE_BYTE_COST_US           2500
 
 #define SC_MAGIC_VALUE                  6970
 
@@ -72,38 +66,302 @@
 #define SC_PIN_CODE_BYTE_2              0xDE
 #define SC_PIN_CODE_BYTE_3              0xA5
 
+// card families told apart by the ATR
+typedef enum {
+    SC_CARD_UNKNOWN,
+    // 2-wire, 256 bytes with a 3 byte PSC; also SLE5542
+    SC_CARD_SLE4442,
+    // 3-wire, 1K with a 2 byte PSC; also SLE5528
+    SC_CARD_SLE4428,
+    SC_NUM_CARD_CLASSES
+} scard_card_class_t;
+
+// card memory read on connect, card reads are served from it
+typedef struct {
+    BYTE memory[SC_CARD_MEMORY_LEN];
+    BYTE protection[SC_CARD_PROTECTION_LEN];
+    bool valid;
+} scard_card_image_t;
+
+// minimal set of WRITE_MEMORY_CARD commands for an update
+typedef struct {
+    BYTE address;
+    BYTE len;
+} scard_write_range_t;
+
+typedef struct {
+    unsigned count;
+    scard_write_range_t ranges[SC_CARD_MEMORY_LEN];
+} scard_write_plan_t;
+
+// outcome of the last scard_write_card()
+typedef struct {
+    unsigned bytes_requested;
+    unsigned bytes_written;
+    unsigned apdus;
+} scard_write_stats_t;
+
+// what GET_READER_INFORMATION reports that does not depend on the card
+typedef struct {
+    char name[SC_MAX_READERNAME_LEN+1];
+    char firmware[SC_MAX_FIRMWARE_LEN+1];
+    BYTE max_send;
+    BYTE max_recv;
+    USHORT card_types;
+} scard_reader_caps_t;
+
+// reader and card state, one per attached reader
+typedef struct {
+    pthread_mutex_t mutex;
+    // session slot, tags the trace records
+    unsigned id;
+    char name[SC_MAX_READERNAME_LEN+1];
+    char firmware[SC_MAX_FIRMWARE_LEN+1];
+    BYTE max_send;
+    BYTE max_recv;
+    USHORT card_types;
+    BYTE selected_card;
+    BYTE card_status;
+    LONG state;
+    PSCARD_IO_REQUEST card_protocol;
+    BYTE atr[MAX_ATR_SIZE];
+    DWORD atr_len;
+    scard_card_class_t card_class;
+    scard_card_image_t card_image;
+    scard_write_stats_t write_stats;
+    // outcome of the last card operation, see scard_classify_error()
+    LONG last_rv;
+    BYTE last_ins;
+    BYTE last_sw[2];
+} scard_reader_t;
+
+// why the last card operation failed, picks the recovery
+typedef enum {
+    // no PC/SC or SW error, e.g. the read back data did not match
+    SC_ERROR_NONE,
+    // timeout, lost data, card reset by someone else; worth another try
+    SC_ERROR_TRANSIENT,
+    // card was pulled
+    SC_ERROR_REMOVED,
+    // card answered with an unexpected status word
+    SC_ERROR_SW,
+    // PIN was not accepted or the card is locked, retrying burns attempts
+    SC_ERROR_PIN,
+    // reader or the PC/SC service went away
+    SC_ERROR_READER,
+    SC_NUM_ERRORS } scard_error_class_t;
+
+// reader and card events from the monitor
+typedef enum {
+    SC_EVENT_DETACH,
+    SC_EVENT_REMOVE,
+    SC_EVENT_ATTACH,
+    SC_EVENT_INSERT,
+    // command queued for the session
+    SC_EVENT_COMMAND,
+    SC_NUM_EVENTS } scard_event_t;
+
+typedef struct {
+    // returns from the single status change wait
+    unsigned long wakeups;
+    unsigned long events[SC_NUM_EVENTS];
+    // time from the insert event to a connected card
+    unsigned long connects;
+    uint64_t insert_to_connect_ns;
+    uint64_t insert_to_connect_max_ns;
+} scard_monitor_stats_t;
+
+// reader and card status as seen by the UI, one per reader slot
+typedef struct {
+    bool active;
+    char name[SC_MAX_READERNAME_LEN+1];
+    bool card_present;
+    bool card_ready;
+    // scard_card_class_t, see scard_card_class_name()
+    unsigned card_class;
+    // scard_error_class_t of the last failure, see scard_error_class_name()
+    unsigned error_class;
+    // session FSM state, see scard_state_name()
+    unsigned state;
+    unsigned pin_retries;
+    uint32_t user_magic;
+    uint32_t user_id;
+    uint32_t user_total;
+    uint32_t user_value;
+    // ledger entry of the card, see scard_ledger.h
+    bool card_known;
+    uint32_t card_topups;
+    // CLOCK_REALTIME of the previous visit
+    uint64_t card_last_seen_ns;
+} scard_reader_status_t;
+
+// provisioning counters of one reader slot, kept until provisioning restarts
+typedef struct {
+    char name[SC_MAX_READERNAME_LEN+1];
+    // blank cards set up and read back
+    unsigned long provisioned;
+    // attempts that did not get that far
+    unsigned long failed;
+    // cards that were set up already
+    unsigned long skipped;
+    // set PIN until the read back matched, summed over the provisioned cards
+    uint64_t time_ns;
+    uint64_t time_max_ns;
+    // provisioning enabled and the end of the last provisioned card
+    uint64_t start_ns;
+    uint64_t last_ns;
+} scard_provision_stats_t;
+
+// consistent copy of all the readers, version is bumped on every change
+typedef struct {
+    uint32_t version;
+    scard_reader_status_t readers[SC_MAX_READERS];
+} scard_status_t;
+
+// work for a card session, any thread may queue it with scard_submit()
+typedef enum {
+    // adds the value to the remaining value, the card becomes a regular one
+    SC_CMD_TOPUP,
+    // changes the card ID, only a regular card keeps its value
+    SC_CMD_SET_TYPE,
+    // reads the user data back from the card
+    SC_CMD_READ,
+    // resets the user data to the one of a fresh regular card
+    SC_CMD_FORMAT,
+    SC_NUM_CMDS } scard_command_type_t;
+
+typedef struct {
+    scard_command_type_t type;
+    // value for TOPUP, card ID for SET_TYPE, unused otherwise
+    uint32_t arg;
+} scard_command_t;
+
+typedef enum {
+    // never submitted
+    SC_CMD_IDLE,
+    SC_CMD_QUEUED,
+    SC_CMD_RUNNING,
+    // final states from here on
+    SC_CMD_DONE,
+    SC_CMD_FAILED,
+    // no usable card in the reader
+    SC_CMD_NO_CARD,
+    // not possible with the card data, e.g. the value would overflow
+    SC_CMD_INVALID,
+    // session queue was full
+    SC_CMD_BUSY,
+    // reader went away before the command ran
+    SC_CMD_CANCELLED,
+    SC_NUM_CMD_STATUS } scard_command_status_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t total;
+    uint32_t value;
+} scard_user_record_t;
+
+// completion handle, owned by the caller and filled in by the session;
+// it must stay valid until the status is final
+typedef struct {
+    // scard_command_status_t, read it with scard_command_status()
+    unsigned status;
+    scard_command_t command;
+    // user data on the card after a DONE command
+    scard_user_record_t record;
+    uint64_t submit_ns;
+    uint64_t start_ns;
+    uint64_t done_ns;
+} scard_completion_t;
+
+// commands a session holds before scard_submit() reports BUSY
+#define SC_COMMAND_QUEUE_LEN            16
+
 // low level
 bool scard_create_context(PSCARDCONTEXT context);
 void scard_destroy_context(PSCARDCONTEXT context);
-void scard_detect_reader(const SCARDCONTEXT context);
-void scard_wait_for_reader(const SCARDCONTEXT context, const ULONG timeout);
-void scard_wait_for_card(const SCARDCONTEXT context, const ULONG timeout);
-bool scard_reader_presence();
-bool scard_card_presence();
-char *scard_reader_name();
-void scard_reset_reader_state();
-void scard_reset_card_state();
-bool scard_connect_card(const SCARDCONTEXT context, PSCARDHANDLE handle);
-void scard_disconnect_card(PSCARDHANDLE handle);
-bool scard_get_reader_info(const SCARDHANDLE handle);
-bool scard_select_memory_card(const SCARDHANDLE handle);
-bool scard_get_error_counter(const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2, LPBYTE pin3, LPBYTE pin_retries);
-bool scard_read_user_data(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len);
-bool scard_present_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3, LPBYTE pin_retries);
-bool scard_change_pin(const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3);
-bool scard_write_card(const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len);
+void scard_reader_init(scard_reader_t *reader, LPCSTR name);
+void scard_reader_destroy(scard_reader_t *reader);
+unsigned scard_list_readers(const SCARDCONTEXT context, char (*names)[SC_MAX_READERNAME_LEN+1], unsigned max);
+uint64_t scard_now_ns();
+// CLOCK_REALTIME, for records that outlive the process
+uint64_t scard_wall_ns();
+// CRC-32 (IEEE) of the on-disk records
+uint32_t scard_crc32(const void *data, size_t len);
+LONG scard_wait_for_change(const SCARDCONTEXT context, SCARD_READERSTATE *states, DWORD count, const ULONG timeout);
+LONG scard_get_reader_state(scard_reader_t *reader);
+void scard_set_reader_state(scard_reader_t *reader, LONG state);
+bool scard_reader_presence(scard_reader_t *reader);
+bool scard_card_presence(scard_reader_t *reader);
+void scard_reader_name(scard_reader_t *reader, char *name, size_t len);
+void scard_reset_reader_state(scard_reader_t *reader);
+void scard_reset_card_state(scard_reader_t *reader);
+bool scard_connect_card(const SCARDCONTEXT context, scard_reader_t *reader, PSCARDHANDLE handle);
+void scard_disconnect_card(scard_reader_t *reader, PSCARDHANDLE handle);
+// ATR of the connected card and its class, no APDU is sent
+bool scard_read_atr(scard_reader_t *reader, const SCARDHANDLE handle);
+scard_card_class_t scard_classify_atr(const BYTE *atr, DWORD atr_len);
+const char *scard_card_class_name(scard_card_class_t card_class);
+// only SLE4442 family cards are handled by the FSM
+bool scard_card_class_supported(scard_card_class_t card_class);
+scard_error_class_t scard_classify_error(const scard_reader_t *reader);
+const char *scard_error_class_name(unsigned error_class);
+bool scard_get_reader_info(scard_reader_t *reader, const SCARDHANDLE handle);
+bool scard_select_memory_card(scard_reader_t *reader, const SCARDHANDLE handle);
+// reader info from the capability cache if known, memory card type selected if not already
+bool scard_identify_reader(scard_reader_t *reader, const SCARDHANDLE handle);
+// reader capability cache, in memory and optionally persisted to a file
+bool scard_reader_cache_open(const char *path);
+bool scard_reader_cache_lookup(const char *name, scard_reader_caps_t *caps);
+void scard_reader_cache_store(const scard_reader_caps_t *caps);
+void scard_reader_cache_forget(const char *name);
+bool scard_get_error_counter(scard_reader_t *reader, const SCARDHANDLE handle, LPBYTE pin1, LPBYTE pin2, LPBYTE pin3, LPBYTE pin_retries);
+bool scard_read_card_image(scard_reader_t *reader, const SCARDHANDLE handle);
+bool scard_get_card_image(scard_reader_t *reader, scard_card_image_t *image);
+// FNV-1a of the first 32 bytes of the card image, they do not change with
+// user writes; 0 if there is no image
+uint32_t scard_card_hash(scard_reader_t *reader);
+bool scard_read_user_data(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len);
+bool scard_present_pin(scard_reader_t *reader, const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3, LPBYTE pin_retries);
+bool scard_change_pin(scard_reader_t *reader, const SCARDHANDLE handle, BYTE pin1, BYTE pin2, BYTE pin3);
+void scard_plan_write(const BYTE *current, BYTE address, const BYTE *data, BYTE len, BYTE max_payload, scard_write_plan_t *plan);
+bool scard_write_card(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, LPBYTE data, BYTE len);
+// reads the range back from the card and compares it with the card image
+bool scard_verify_card(scard_reader_t *reader, const SCARDHANDLE handle, BYTE address, BYTE len);
+void scard_get_write_stats(scard_reader_t *reader, scard_write_stats_t *stats);
 void scard_cancel_wait(const SCARDCONTEXT context);
 
-// user
+// user, one session per attached reader, addressed by slot 0..SC_MAX_READERS-1
 bool scard_user_thread_start();
 void scard_user_thread_stop();
-unsigned scard_get_pin_retries();
-unsigned scard_get_pin_user_magic();
-unsigned scard_get_pin_user_id();
-unsigned scard_get_pin_user_total();
-unsigned scard_get_pin_user_value();
-void update_card(uint32_t value, uint32_t id);
-
-bool is_card_ready();
+void scard_get_monitor_stats(scard_monitor_stats_t *stats);
+// state counters and the last transitions of the session, false if the slot is empty
+bool scard_get_fsm_stats(unsigned slot, scard_fsm_stats_t *stats);
+// blank cards are set up as they are inserted, on every reader at once;
+// enabling clears the counters
+void scard_set_provisioning(bool enable);
+bool scard_provisioning();
+// false if the slot never provisioned anything
+bool scard_get_provision_stats(unsigned slot, scard_provision_stats_t *stats);
+// cards per minute since provisioning was enabled
+double scard_provision_rate(const scard_provision_stats_t *stats);
+// per reader and total counters, one line each
+void scard_provision_report(FILE *file);
+// lock free, safe to call every frame
+void scard_get_status(scard_status_t *status);
+// called on a session thread after the status changed or a command completed,
+// it must not block; one listener, NULL removes it
+typedef void (*scard_notify_fn)(void *arg);
+void scard_set_notify(scard_notify_fn fn, void *arg);
+const char *scard_state_name(unsigned state);
+// queues the command without a lock, never waits for the session or the
+// monitor; completion may be NULL
+bool scard_submit(unsigned slot, const scard_command_t *command, scard_completion_t *completion);
+scard_command_status_t scard_command_status(const scard_completion_t *completion);
+bool scard_command_done(const scard_completion_t *completion);
+// true if the command finished within the timeout
+bool scard_command_wait(const scard_completion_t *completion, unsigned timeout_ms);
+const char *scard_command_name(unsigned type);
+const char *scard_command_status_name(unsigned status);
 
 #endif // SCARD_H_
@@ -0,0 +1,191 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_audit.h"
+
+#include <atomic>
+#include <errno.h>
+
+static_assert(sizeof(scard_audit_record_t) == 296, "audit record size");
+
+// guards the files and the counters; sessions only format into the stdio
+// buffers here, the disk sees one write per buffer
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> _enabled(false);
+static FILE *_csv = nullptr;
+static FILE *_bin = nullptr;
+static char *_csv_buffer = nullptr;
+static char *_bin_buffer = nullptr;
+static scard_audit_stats_t _stats;
+// export times of the last cards, for the live rate
+static uint64_t _window[SC_AUDIT_RATE_WINDOW];
+
+static FILE *open_export(const char *path, char **buffer)
+{
+    FILE *file = fopen(path, "w");
+    if (! file) {
+        ERR("failed to create %s: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    *buffer = (char *)malloc(SC_AUDIT_BUFFER_LEN);
+    if (*buffer) {
+        setvbuf(file, *buffer, _IOFBF, SC_AUDIT_BUFFER_LEN);
+    }
+    return file;
+}
+
+static void close_export(FILE **file, char **buffer)
+{
+    if (*file) {
+        if (fclose(*file) != 0) {
+            ERR("failed to close audit export: %s\n", strerror(errno));
+        }
+        *file = nullptr;
+    }
+    free(*buffer);
+    *buffer = nullptr;
+}
+
+bool scard_audit_open(const char *csv_path, const char *bin_path)
+{
+    scard_audit_close();
+
+    pthread_mutex_lock(&_mutex);
+    bool rv = true;
+    if (csv_path) {
+        _csv = open_export(csv_path, &_csv_buffer);
+        if (_csv) {
+            fprintf(_csv, "time,reader,card_hash,card_class,pin_retries,magic,id,value,total,protection,memory\n");
+        }
+        rv = (_csv != nullptr);
+    }
+    if (rv && bin_path) {
+        _bin = open_export(bin_path, &_bin_buffer);
+        if (_bin) {
+            scard_audit_header_t header;
+            memset(&header, 0, sizeof(header));
+            header.magic = SC_AUDIT_MAGIC;
+            header.version = SC_AUDIT_VERSION;
+            header.record_size = sizeof(scard_audit_record_t);
+            fwrite(&header, sizeof(header), 1, _bin);
+        }
+        rv = (_bin != nullptr);
+    }
+    if (! rv) {
+        close_export(&_csv, &_csv_buffer);
+        close_export(&_bin, &_bin_buffer);
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.start_ns = scard_now_ns();
+    _enabled.store(true, std::memory_order_release);
+    pthread_mutex_unlock(&_mutex);
+    INF("audit mode, exporting to %s %s\n", csv_path ? csv_path : "-", bin_path ? bin_path : "-");
+    return true;
+}
+
+void scard_audit_close()
+{
+    pthread_mutex_lock(&_mutex);
+    bool enabled = _enabled.exchange(false);
+    close_export(&_csv, &_csv_buffer);
+    close_export(&_bin, &_bin_buffer);
+    pthread_mutex_unlock(&_mutex);
+    if (enabled) {
+        INF("audit mode done, %lu cards exported\n", _stats.cards);
+    }
+}
+
+bool scard_audit_enabled()
+{
+    return _enabled.load(std::memory_order_acquire);
+}
+
+static void write_csv(const scard_audit_record_t *record)
+{
+    char time[32];
+    time_t seconds = record->ts_ns / 1000000000ULL;
+    struct tm tm;
+    strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", localtime_r(&seconds, &tm));
+
+    // hex by hand, fprintf per byte would dominate the export
+    static const char digits[] = "0123456789ABCDEF";
+    char protection[SC_CARD_PROTECTION_LEN * 2 + 1];
+    for (unsigned i = 0; i < SC_CARD_PROTECTION_LEN; i++) {
+        protection[i * 2] = digits[record->protection[i] >> 4];
+        protection[i * 2 + 1] = digits[record->protection[i] & 0x0F];
+    }
+    protection[SC_CARD_PROTECTION_LEN * 2] = 0;
+    char memory[SC_CARD_MEMORY_LEN * 2 + 1];
+    for (unsigned i = 0; i < SC_CARD_MEMORY_LEN; i++) {
+        memory[i * 2] = digits[record->memory[i] >> 4];
+        memory[i * 2 + 1] = digits[record->memory[i] & 0x0F];
+    }
+    memory[SC_CARD_MEMORY_LEN * 2] = 0;
+
+    fprintf(_csv, "%s.%03u,%u,%08X,%s,%u,%08X,%u,%u,%u,%s,%s\n", time, (unsigned)(record->ts_ns / 1000000 % 1000),
+        record->reader, record->card_hash, scard_card_class_name((scard_card_class_t)record->card_class),
+        record->pin_retries, record->user_magic, record->user_id, record->user_value, record->user_total,
+        protection, memory);
+}
+
+void scard_audit_export(const scard_audit_record_t *record)
+{
+    uint64_t now = scard_now_ns();
+    pthread_mutex_lock(&_mutex);
+    if (! _enabled.load(std::memory_order_relaxed)) {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    bool ok = true;
+    if (_csv) {
+        write_csv(record);
+        ok = ! ferror(_csv);
+    }
+    if (_bin) {
+        ok = (fwrite(record, sizeof(scard_audit_record_t), 1, _bin) == 1) && ok;
+    }
+    if (! ok) {
+        _stats.errors++;
+    }
+    _window[_stats.cards % SC_AUDIT_RATE_WINDOW] = now;
+    _stats.cards++;
+    _stats.last_ns = now;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_audit_flush()
+{
+    pthread_mutex_lock(&_mutex);
+    if (_csv) {
+        fflush(_csv);
+    }
+    if (_bin) {
+        fflush(_bin);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_audit_get_stats(scard_audit_stats_t *stats)
+{
+    pthread_mutex_lock(&_mutex);
+    *stats = _stats;
+    unsigned long count = _stats.cards < SC_AUDIT_RATE_WINDOW ? _stats.cards : SC_AUDIT_RATE_WINDOW;
+    if (count >= 2) {
+        uint64_t newest = _window[(_stats.cards - 1) % SC_AUDIT_RATE_WINDOW];
+        uint64_t oldest = _window[(_stats.cards - count) % SC_AUDIT_RATE_WINDOW];
+        // a pause since the last card drags the rate down as it goes on
+        uint64_t now = scard_now_ns();
+        uint64_t idle = now - newest;
+        uint64_t span = newest - oldest;
+        if (idle > span / (count - 1)) {
+            span += idle;
+        }
+        stats->cards_per_min = span ? (count - 1) * 60e9 / span : 0;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
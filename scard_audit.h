@@ -0,0 +1,66 @@
+/**
+ *
+ */
+
+#ifndef SCARD_AUDIT_H_
+#define SCARD_AUDIT_H_
+
+#include "scard.h"
+
+// audit mode: every inserted card is read once, without presenting the PIN
+// or writing, and exported as a CSV line and a binary record
+#define SC_AUDIT_MAGIC                  0x55414353      // "SCAU"
+#define SC_AUDIT_VERSION                1
+// export files are written through buffers this large
+#define SC_AUDIT_BUFFER_LEN             (256 * 1024)
+// the live rate is taken over the last this many cards
+#define SC_AUDIT_RATE_WINDOW            32
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+} scard_audit_header_t;
+
+typedef struct {
+    // CLOCK_REALTIME of the read
+    uint64_t ts_ns;
+    // see scard_card_hash()
+    uint32_t card_hash;
+    uint8_t reader;
+    // scard_card_class_t
+    uint8_t card_class;
+    uint8_t pin_retries;
+    uint8_t reserved;
+    uint32_t user_magic;
+    uint32_t user_id;
+    uint32_t user_total;
+    uint32_t user_value;
+    uint8_t protection[SC_CARD_PROTECTION_LEN];
+    uint8_t memory[SC_CARD_MEMORY_LEN];
+    uint8_t pad[4];
+} scard_audit_record_t;
+
+typedef struct {
+    unsigned long cards;
+    // records lost to a failed write
+    unsigned long errors;
+    // audit mode enabled and the last card exported
+    uint64_t start_ns;
+    uint64_t last_ns;
+    // over the last SC_AUDIT_RATE_WINDOW cards, 0 until there are two
+    double cards_per_min;
+} scard_audit_stats_t;
+
+// enables audit mode; either path may be NULL, the files are truncated
+bool scard_audit_open(const char *csv_path, const char *bin_path);
+// flushes the exports and leaves audit mode
+void scard_audit_close();
+bool scard_audit_enabled();
+void scard_audit_export(const scard_audit_record_t *record);
+// pushes buffered records to the files, sessions do it once their reader is idle
+void scard_audit_flush();
+void scard_audit_get_stats(scard_audit_stats_t *stats);
+
+#endif // SCARD_AUDIT_H_
@@ -0,0 +1,159 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+
+#include <errno.h>
+#include <limits.h>
+
+// reader capabilities do not change for a given reader, remember them
+// so that GET_READER_INFORMATION is sent once and not on every connect
+
+#define CACHE_MAX_ENTRIES               32
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static scard_reader_caps_t _entries[CACHE_MAX_ENTRIES];
+static unsigned _count = 0;
+static char *_path = nullptr;
+
+static int cache_find(const char *name)
+{
+    for (unsigned i = 0; i < _count; i++) {
+        if (strcmp(_entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool caps_equal(const scard_reader_caps_t *a, const scard_reader_caps_t *b)
+{
+    return strcmp(a->name, b->name) == 0
+        && memcmp(a->firmware, b->firmware, SC_MAX_FIRMWARE_LEN) == 0
+        && a->max_send == b->max_send
+        && a->max_recv == b->max_recv
+        && a->card_types == b->card_types;
+}
+
+static void cache_put(const scard_reader_caps_t *caps)
+{
+    int idx = cache_find(caps->name);
+    if (idx < 0) {
+        if (_count == CACHE_MAX_ENTRIES) {
+            // full, the oldest entry goes
+            memmove(&_entries[0], &_entries[1], (CACHE_MAX_ENTRIES - 1) * sizeof(scard_reader_caps_t));
+            _count--;
+        }
+        idx = _count++;
+    }
+    _entries[idx] = *caps;
+}
+
+// one reader per line: firmware (hex), max send, max recv, card types, name
+static void cache_save()
+{
+    if (! _path) {
+        return;
+    }
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", _path);
+    FILE *file = fopen(tmp, "w");
+    if (! file) {
+        ERR("failed to write reader cache %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    for (unsigned i = 0; i < _count; i++) {
+        const scard_reader_caps_t *caps = &_entries[i];
+        for (unsigned n = 0; n < SC_MAX_FIRMWARE_LEN; n++) {
+            fprintf(file, "%02X", (BYTE)caps->firmware[n]);
+        }
+        fprintf(file, " %u %u %04X %s\n", caps->max_send, caps->max_recv, caps->card_types, caps->name);
+    }
+    fclose(file);
+    // replace in one step, a crash never leaves a half written cache
+    if (rename(tmp, _path) != 0) {
+        ERR("failed to replace reader cache %s: %s\n", _path, strerror(errno));
+    }
+}
+
+bool scard_reader_cache_open(const char *path)
+{
+    pthread_mutex_lock(&_mutex);
+    free(_path);
+    _path = strdup(path);
+    FILE *file = fopen(path, "r");
+    if (! file) {
+        pthread_mutex_unlock(&_mutex);
+        // first run, created on the first store
+        return errno == ENOENT;
+    }
+    char line[SC_MAX_READERNAME_LEN + 64];
+    unsigned loaded = 0;
+    while (fgets(line, sizeof(line), file)) {
+        scard_reader_caps_t caps;
+        memset(&caps, 0, sizeof(caps));
+        char firmware[2 * SC_MAX_FIRMWARE_LEN + 1];
+        unsigned max_send, max_recv, card_types;
+        int off = 0;
+        if (sscanf(line, "%20s %u %u %x %n", firmware, &max_send, &max_recv, &card_types, &off) != 4 || off == 0
+            || strlen(firmware) != 2 * SC_MAX_FIRMWARE_LEN) {
+            continue;
+        }
+        for (unsigned n = 0; n < SC_MAX_FIRMWARE_LEN; n++) {
+            unsigned byte;
+            sscanf(firmware + 2 * n, "%2x", &byte);
+            caps.firmware[n] = byte;
+        }
+        strncpy(caps.name, line + off, SC_MAX_READERNAME_LEN);
+        caps.name[strcspn(caps.name, "\r\n")] = 0;
+        if (caps.name[0] == 0) {
+            continue;
+        }
+        caps.max_send = max_send;
+        caps.max_recv = max_recv;
+        caps.card_types = card_types;
+        cache_put(&caps);
+        loaded++;
+    }
+    fclose(file);
+    pthread_mutex_unlock(&_mutex);
+    DBG("loaded %u readers from cache %s\n", loaded, path);
+    return true;
+}
+
+bool scard_reader_cache_lookup(const char *name, scard_reader_caps_t *caps)
+{
+    pthread_mutex_lock(&_mutex);
+    int idx = cache_find(name);
+    if (idx >= 0) {
+        *caps = _entries[idx];
+    }
+    pthread_mutex_unlock(&_mutex);
+    return idx >= 0;
+}
+
+void scard_reader_cache_store(const scard_reader_caps_t *caps)
+{
+    pthread_mutex_lock(&_mutex);
+    int idx = cache_find(caps->name);
+    bool changed = (idx < 0) || ! caps_equal(&_entries[idx], caps);
+    if (changed) {
+        cache_put(caps);
+        cache_save();
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_reader_cache_forget(const char *name)
+{
+    pthread_mutex_lock(&_mutex);
+    int idx = cache_find(name);
+    if (idx >= 0) {
+        memmove(&_entries[idx], &_entries[idx + 1], (_count - idx - 1) * sizeof(scard_reader_caps_t));
+        _count--;
+        cache_save();
+    }
+    pthread_mutex_unlock(&_mutex);
+}
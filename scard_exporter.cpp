@@ -0,0 +1,237 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_exporter.h"
+#include "scard_metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static pthread_t _thread;
+static bool _running = false;
+static int _listen_fd = -1;
+// written to stop the thread, poll() watches it with the listening socket
+static int _stop_pipe[2] = { -1, -1 };
+static char _unix_path[108];
+
+static int listen_tcp(const char *addr)
+{
+    char host[64] = "127.0.0.1";
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    if (colon) {
+        size_t len = colon - addr;
+        if (len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, addr, len);
+        host[len] = 0;
+        port = colon + 1;
+    }
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+        ERR("not a numeric address: %s\n", host);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+    // a stale socket from a previous run
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        close(fd);
+        return -1;
+    }
+    strcpy(_unix_path, path);
+    return fd;
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // gone or too slow, the next scrape gets a fresh copy anyway
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void send_response(int fd, const char *status, const char *type, const char *body, size_t len)
+{
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+        status, type, (unsigned long)len);
+    send_all(fd, header, header_len);
+    send_all(fd, body, len);
+}
+
+static void serve(int fd)
+{
+    struct timeval tv;
+    tv.tv_sec = SC_EXPORTER_TIMEOUT_MS / 1000;
+    tv.tv_usec = (SC_EXPORTER_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // the request line and headers, the body of a GET is empty
+    char request[SC_EXPORTER_MAX_REQUEST];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        request[len] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[len] = 0;
+
+    if (strncmp(request, "GET /metrics ", 13) && strncmp(request, "GET /metrics?", 13)) {
+        static const char not_found[] = "only /metrics is served here\n";
+        send_response(fd, "404 Not Found", "text/plain", not_found, sizeof(not_found) - 1);
+        return;
+    }
+    char *body = nullptr;
+    size_t body_len = 0;
+    FILE *file = open_memstream(&body, &body_len);
+    if (! file) {
+        static const char failed[] = "out of memory\n";
+        send_response(fd, "500 Internal Server Error", "text/plain", failed, sizeof(failed) - 1);
+        return;
+    }
+    scard_metrics_write_prometheus(file);
+    fclose(file);
+    send_response(fd, "200 OK", "text/plain; version=0.0.4", body, body_len);
+    free(body);
+}
+
+static void *exporter_fnc(void *ptr)
+{
+    for (;;) {
+        struct pollfd fds[2];
+        fds[0].fd = _listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = _stop_pipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR("poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(_listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                serve(fd);
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+bool scard_exporter_start(const char *addr)
+{
+    if (_running) {
+        return false;
+    }
+    _unix_path[0] = 0;
+    _listen_fd = strchr(addr, '/') ? listen_unix(addr) : listen_tcp(addr);
+    if (_listen_fd < 0 || listen(_listen_fd, 8) != 0) {
+        ERR("failed to listen on %s: %s\n", addr, strerror(errno));
+        if (_listen_fd >= 0) {
+            close(_listen_fd);
+            _listen_fd = -1;
+        }
+        return false;
+    }
+    fcntl(_listen_fd, F_SETFD, FD_CLOEXEC);
+    if (pipe(_stop_pipe) != 0) {
+        ERR("failed to create pipe: %s\n", strerror(errno));
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+    int rv = pthread_create(&_thread, NULL, exporter_fnc, NULL);
+    if (rv) {
+        ERR("Error - pthread_create() return code: %d\n", rv);
+        close(_stop_pipe[0]);
+        close(_stop_pipe[1]);
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+    _running = true;
+    INF("serving metrics on %s\n", addr);
+    return true;
+}
+
+void scard_exporter_stop()
+{
+    if (! _running) {
+        return;
+    }
+    char stop = 0;
+    ssize_t rv = write(_stop_pipe[1], &stop, 1);
+    _UNUSED(rv);
+    pthread_join(_thread, NULL);
+    close(_stop_pipe[0]);
+    close(_stop_pipe[1]);
+    close(_listen_fd);
+    _listen_fd = -1;
+    if (_unix_path[0]) {
+        unlink(_unix_path);
+    }
+    _running = false;
+}
@@ -0,0 +1,19 @@
+/**
+ *
+ */
+
+#ifndef SCARD_EXPORTER_H_
+#define SCARD_EXPORTER_H_
+
+// serves scard_metrics_write_prometheus() over plain HTTP for a Prometheus
+// scrape; "GET /metrics" is all it answers, one connection at a time
+#define SC_EXPORTER_DEFAULT_ADDR        "127.0.0.1:9464"
+// a scraper that stalls longer is cut off
+#define SC_EXPORTER_TIMEOUT_MS          1000
+#define SC_EXPORTER_MAX_REQUEST         4096
+
+// addr is [host:]port for TCP, only numeric hosts, or a Unix socket path
+bool scard_exporter_start(const char *addr);
+void scard_exporter_stop();
+
+#endif // SCARD_EXPORTER_H_
@@ -0,0 +1,173 @@
+/**
+ *
+ */
+
+#ifndef SCARD_FSM_H_
+#define SCARD_FSM_H_
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// state machine engine: a state handler table plus a transition table that
+// is checked at compile time, with entry counts, time in state and the last
+// few transitions kept per machine
+
+#define SC_FSM_MAX_STATES               16
+#define SC_FSM_HISTORY_LEN              32
+
+typedef struct {
+    unsigned from;
+    unsigned to;
+} scard_fsm_transition_t;
+
+typedef struct {
+    uint64_t ts_ns;
+    // time spent in the state that was left
+    uint64_t time_ns;
+    uint16_t from;
+    uint16_t to;
+} scard_fsm_step_t;
+
+typedef struct {
+    unsigned state;
+    uint64_t entered_ns;
+    unsigned long transitions;
+    unsigned long entries[SC_FSM_MAX_STATES];
+    // completed visits only, the current one is now - entered_ns
+    uint64_t time_ns[SC_FSM_MAX_STATES];
+    // ring of the last transitions, oldest at transitions % SC_FSM_HISTORY_LEN
+    scard_fsm_step_t history[SC_FSM_HISTORY_LEN];
+} scard_fsm_stats_t;
+
+template <size_t N>
+constexpr bool scard_fsm_allowed(const scard_fsm_transition_t (&table)[N], unsigned from, unsigned to)
+{
+    for (size_t i = 0; i < N; i++) {
+        if (table[i].from == from && table[i].to == to) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// every entry within range, no duplicates, every state has a way out
+template <size_t N>
+constexpr bool scard_fsm_valid(const scard_fsm_transition_t (&table)[N], unsigned num_states)
+{
+    if (num_states > SC_FSM_MAX_STATES) {
+        return false;
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (table[i].from >= num_states || table[i].to >= num_states) {
+            return false;
+        }
+        for (size_t n = i + 1; n < N; n++) {
+            if (table[i].from == table[n].from && table[i].to == table[n].to) {
+                return false;
+            }
+        }
+    }
+    for (unsigned state = 0; state < num_states; state++) {
+        bool leaves = false;
+        for (size_t i = 0; i < N; i++) {
+            leaves |= (table[i].from == state);
+        }
+        if (! leaves) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <bool allowed, typename S>
+constexpr S scard_fsm_goto(S to)
+{
+    static_assert(allowed, "transition is not in the table");
+    return to;
+}
+
+// returns the next state from a handler; an undeclared transition does not compile
+#define FSM_GOTO(table, from, to)       scard_fsm_goto<scard_fsm_allowed(table, from, to)>(to)
+
+template <typename S, typename D, size_t N>
+struct scard_fsm_t {
+    typedef S (*handler_t)(D *data);
+    const handler_t *handlers;
+    const scard_fsm_transition_t (*table)[N];
+    unsigned num_states;
+    // guards stats, the owner thread steps, anyone may take a copy
+    pthread_mutex_t mutex;
+    scard_fsm_stats_t stats;
+};
+
+template <typename S, typename D, size_t N>
+static inline void scard_fsm_init(scard_fsm_t<S, D, N> *fsm, const typename scard_fsm_t<S, D, N>::handler_t *handlers,
+    const scard_fsm_transition_t (&table)[N], unsigned num_states, S initial, uint64_t now_ns)
+{
+    assert(num_states <= SC_FSM_MAX_STATES);
+    fsm->handlers = handlers;
+    fsm->table = &table;
+    fsm->num_states = num_states;
+    pthread_mutex_init(&fsm->mutex, NULL);
+    memset(&fsm->stats, 0, sizeof(fsm->stats));
+    fsm->stats.state = initial;
+    fsm->stats.entered_ns = now_ns;
+    fsm->stats.entries[initial] = 1;
+}
+
+template <typename S, typename D, size_t N>
+static inline void scard_fsm_destroy(scard_fsm_t<S, D, N> *fsm)
+{
+    pthread_mutex_destroy(&fsm->mutex);
+}
+
+template <typename S, typename D, size_t N>
+static inline S scard_fsm_state(const scard_fsm_t<S, D, N> *fsm)
+{
+    // only the owner thread changes it
+    return (S)fsm->stats.state;
+}
+
+// runs the handler of the current state, a handler returning its own state
+// runs again without counting as a transition
+template <typename S, typename D, size_t N>
+static inline S scard_fsm_step(scard_fsm_t<S, D, N> *fsm, D *data, uint64_t (*now_ns)())
+{
+    S from = (S)fsm->stats.state;
+    S to = fsm->handlers[from](data);
+    // the handlers are checked at build time, this catches a wrong from in FSM_GOTO
+    assert(scard_fsm_allowed(*fsm->table, from, to));
+    if (to == from) {
+        return to;
+    }
+
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&fsm->mutex);
+    scard_fsm_stats_t *stats = &fsm->stats;
+    uint64_t time_ns = now - stats->entered_ns;
+    stats->time_ns[from] += time_ns;
+    stats->entries[to]++;
+    scard_fsm_step_t *step = &stats->history[stats->transitions % SC_FSM_HISTORY_LEN];
+    step->ts_ns = now;
+    step->time_ns = time_ns;
+    step->from = from;
+    step->to = to;
+    stats->transitions++;
+    stats->state = to;
+    stats->entered_ns = now;
+    pthread_mutex_unlock(&fsm->mutex);
+    return to;
+}
+
+template <typename S, typename D, size_t N>
+static inline void scard_fsm_get_stats(scard_fsm_t<S, D, N> *fsm, scard_fsm_stats_t *stats)
+{
+    pthread_mutex_lock(&fsm->mutex);
+    *stats = fsm->stats;
+    pthread_mutex_unlock(&fsm->mutex);
+}
+
+#endif // SCARD_FSM_H_
@@ -0,0 +1,634 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_ipc.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+static_assert(sizeof(scard_ipc_reader_t) == 24, "ipc reader size");
+
+#define IPC_FRAME_HEADER                2
+#define IPC_MAX_FRAME                   (IPC_FRAME_HEADER + SC_IPC_MAX_PAYLOAD)
+// epoll user data of the two fds that are not clients
+#define IPC_LISTEN_ID                   0xFFFFFFFF
+#define IPC_WAKE_ID                     0xFFFFFFFE
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+    uint8_t *p = (uint8_t *)data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+int scard_ipc_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool scard_ipc_send(int fd, uint8_t type, const void *body, uint16_t len)
+{
+    if (len >= SC_IPC_MAX_PAYLOAD) {
+        return false;
+    }
+    uint8_t frame[IPC_MAX_FRAME];
+    uint16_t payload = len + 1;
+    memcpy(frame, &payload, IPC_FRAME_HEADER);
+    frame[IPC_FRAME_HEADER] = type;
+    if (len) {
+        memcpy(frame + IPC_FRAME_HEADER + 1, body, len);
+    }
+    return write_all(fd, frame, IPC_FRAME_HEADER + payload);
+}
+
+int scard_ipc_recv(int fd, uint8_t *type, void *body, uint16_t max)
+{
+    uint16_t payload;
+    uint8_t frame[SC_IPC_MAX_PAYLOAD];
+    if (! read_all(fd, &payload, IPC_FRAME_HEADER) || payload == 0 || payload > SC_IPC_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (! read_all(fd, frame, payload)) {
+        return -1;
+    }
+    *type = frame[0];
+    uint16_t len = payload - 1;
+    memcpy(body, frame + 1, len < max ? len : max);
+    return len;
+}
+
+#ifdef __linux__
+
+typedef struct {
+    int fd;
+    // bumped on every reuse, pending commands of a closed client are not delivered
+    uint32_t generation;
+    uint32_t events;
+    uint8_t in[IPC_MAX_FRAME];
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_alloc;
+    bool want_write;
+} ipc_client_t;
+
+typedef struct {
+    bool used;
+    unsigned client;
+    uint32_t generation;
+    uint32_t tag;
+    scard_completion_t completion;
+} ipc_pending_t;
+
+// everything below belongs to the server thread, but the stats
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t _thread;
+static bool _running = false;
+static volatile bool _stop;
+static int _listen_fd = -1;
+static int _epoll_fd = -1;
+static int _wake_fd = -1;
+static char _path[108];
+static ipc_client_t _clients[SC_IPC_MAX_CLIENTS];
+static ipc_pending_t _pending[SC_IPC_MAX_PENDING];
+static unsigned _num_pending;
+static scard_status_t _shown;
+static scard_ipc_stats_t _stats;
+
+static void wake(void *arg)
+{
+    // counts up, one read drains any number of wakes
+    uint64_t one = 1;
+    ssize_t rv = write(_wake_fd, &one, sizeof(one));
+    (void)rv;
+}
+
+static void client_close(unsigned idx)
+{
+    ipc_client_t *client = &_clients[idx];
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    client->generation++;
+    client->events = 0;
+    client->in_len = 0;
+    free(client->out);
+    client->out = nullptr;
+    client->out_len = client->out_alloc = 0;
+    client->want_write = false;
+    pthread_mutex_lock(&_mutex);
+    _stats.clients--;
+    pthread_mutex_unlock(&_mutex);
+}
+
+static void client_drop(unsigned idx, const char *why)
+{
+    ERR("ipc client %u dropped: %s\n", idx, why);
+    pthread_mutex_lock(&_mutex);
+    _stats.dropped++;
+    pthread_mutex_unlock(&_mutex);
+    client_close(idx);
+}
+
+static void client_watch(unsigned idx, bool want_write)
+{
+    ipc_client_t *client = &_clients[idx];
+    if (client->want_write == want_write) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.u32 = idx;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->want_write = want_write;
+}
+
+// writes what the socket takes now, the rest waits for EPOLLOUT
+static bool client_flush(unsigned idx)
+{
+    ipc_client_t *client = &_clients[idx];
+    size_t done = 0;
+    while (done < client->out_len) {
+        ssize_t n = send(client->fd, client->out + done, client->out_len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    memmove(client->out, client->out + done, client->out_len - done);
+    client->out_len -= done;
+    client_watch(idx, client->out_len != 0);
+    return true;
+}
+
+static void client_send(unsigned idx, uint8_t type, const void *body, uint16_t len)
+{
+    ipc_client_t *client = &_clients[idx];
+    size_t frame_len = IPC_FRAME_HEADER + 1 + len;
+    if (client->out_len + frame_len > SC_IPC_MAX_BACKLOG) {
+        client_drop(idx, "backlog full");
+        return;
+    }
+    if (client->out_len + frame_len > client->out_alloc) {
+        size_t alloc = client->out_alloc ? client->out_alloc * 2 : 1024;
+        while (alloc < client->out_len + frame_len) {
+            alloc *= 2;
+        }
+        uint8_t *out = (uint8_t *)realloc(client->out, alloc);
+        if (! out) {
+            client_drop(idx, "out of memory");
+            return;
+        }
+        client->out = out;
+        client->out_alloc = alloc;
+    }
+    uint8_t *frame = client->out + client->out_len;
+    uint16_t payload = len + 1;
+    memcpy(frame, &payload, IPC_FRAME_HEADER);
+    frame[IPC_FRAME_HEADER] = type;
+    if (len) {
+        memcpy(frame + IPC_FRAME_HEADER + 1, body, len);
+    }
+    client->out_len += frame_len;
+    // only the first frame of a burst goes out here
+    if (! client->want_write && ! client_flush(idx)) {
+        client_close(idx);
+    }
+}
+
+static void fill_reader(scard_ipc_reader_t *out, unsigned slot, const scard_reader_status_t *reader)
+{
+    out->slot = slot;
+    out->active = reader->active;
+    out->card_present = reader->card_present;
+    out->card_ready = reader->card_ready;
+    out->state = reader->state;
+    out->card_class = reader->card_class;
+    out->error_class = reader->error_class;
+    out->pin_retries = reader->pin_retries;
+    out->user_magic = reader->user_magic;
+    out->user_id = reader->user_id;
+    out->user_value = reader->user_value;
+    out->user_total = reader->user_total;
+}
+
+static void send_status(unsigned idx)
+{
+    scard_status_t status;
+    scard_get_status(&status);
+    uint8_t body[SC_IPC_MAX_PAYLOAD];
+    size_t len = 0;
+    memcpy(body, &status.version, sizeof(uint32_t));
+    len += sizeof(uint32_t);
+    uint8_t *count = &body[len++];
+    *count = 0;
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        const scard_reader_status_t *reader = &status.readers[slot];
+        if (! reader->active) {
+            continue;
+        }
+        fill_reader((scard_ipc_reader_t *)&body[len], slot, reader);
+        len += sizeof(scard_ipc_reader_t);
+        size_t name_len = strnlen(reader->name, sizeof(reader->name) - 1);
+        body[len++] = name_len;
+        memcpy(&body[len], reader->name, name_len);
+        len += name_len;
+        (*count)++;
+    }
+    client_send(idx, SC_IPC_STATUS, body, len);
+}
+
+static void broadcast_event(scard_ipc_event_type_t type, unsigned slot, const scard_reader_status_t *reader)
+{
+    scard_ipc_event_t event;
+    event.event = type;
+    fill_reader(&event.reader, slot, reader);
+    unsigned long sent = 0;
+    for (unsigned i = 0; i < SC_IPC_MAX_CLIENTS; i++) {
+        if (_clients[i].fd >= 0 && (_clients[i].events & (1u << type))) {
+            client_send(i, SC_IPC_EVENT, &event, sizeof(event));
+            sent++;
+        }
+    }
+    pthread_mutex_lock(&_mutex);
+    _stats.events += sent;
+    pthread_mutex_unlock(&_mutex);
+}
+
+// turns status changes into events
+static void check_status()
+{
+    scard_status_t status;
+    scard_get_status(&status);
+    if (status.version == _shown.version) {
+        return;
+    }
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        const scard_reader_status_t *now = &status.readers[slot];
+        const scard_reader_status_t *was = &_shown.readers[slot];
+        if (now->active != was->active) {
+            broadcast_event(now->active ? SC_IPC_EVENT_ATTACH : SC_IPC_EVENT_DETACH, slot, now);
+        }
+        if (now->card_present != was->card_present) {
+            broadcast_event(now->card_present ? SC_IPC_EVENT_INSERT : SC_IPC_EVENT_REMOVE, slot, now);
+        }
+        if (now->card_ready && ! was->card_ready) {
+            broadcast_event(SC_IPC_EVENT_READY, slot, now);
+        } else if (now->card_ready && (now->user_id != was->user_id || now->user_value != was->user_value
+            || now->user_total != was->user_total)) {
+            broadcast_event(SC_IPC_EVENT_UPDATE, slot, now);
+        }
+        if (now->state != was->state) {
+            broadcast_event(SC_IPC_EVENT_STATE, slot, now);
+        }
+    }
+    _shown = status;
+}
+
+// delivers the results of the commands that are final by now
+static void check_pending()
+{
+    for (unsigned i = 0; i < SC_IPC_MAX_PENDING && _num_pending; i++) {
+        ipc_pending_t *pending = &_pending[i];
+        if (! pending->used || ! scard_command_done(&pending->completion)) {
+            continue;
+        }
+        ipc_client_t *client = &_clients[pending->client];
+        if (client->fd >= 0 && client->generation == pending->generation) {
+            const scard_completion_t *completion = &pending->completion;
+            scard_ipc_result_t result;
+            result.tag = pending->tag;
+            result.status = scard_command_status(completion);
+            result.user_id = completion->record.id;
+            result.user_value = completion->record.value;
+            result.user_total = completion->record.total;
+            result.latency_us = completion->done_ns ? (completion->done_ns - completion->submit_ns) / 1000 : 0;
+            client_send(pending->client, SC_IPC_RESULT, &result, sizeof(result));
+        }
+        pending->used = false;
+        _num_pending--;
+    }
+}
+
+static void handle_submit(unsigned idx, const scard_ipc_submit_t *submit)
+{
+    if (submit->slot >= SC_MAX_READERS || submit->type >= SC_NUM_CMDS || _num_pending == SC_IPC_MAX_PENDING) {
+        scard_ipc_result_t result;
+        memset(&result, 0, sizeof(result));
+        result.tag = submit->tag;
+        result.status = (_num_pending == SC_IPC_MAX_PENDING) ? SC_CMD_BUSY : SC_CMD_INVALID;
+        client_send(idx, SC_IPC_RESULT, &result, sizeof(result));
+        return;
+    }
+    unsigned i = 0;
+    while (_pending[i].used) {
+        i++;
+    }
+    ipc_pending_t *pending = &_pending[i];
+    pending->used = true;
+    pending->client = idx;
+    pending->generation = _clients[idx].generation;
+    pending->tag = submit->tag;
+    _num_pending++;
+    scard_command_t command;
+    command.type = (scard_command_type_t)submit->type;
+    command.arg = submit->arg;
+    // a refused command is final right away and answered with the next check
+    scard_submit(submit->slot, &command, &pending->completion);
+    pthread_mutex_lock(&_mutex);
+    _stats.commands++;
+    pthread_mutex_unlock(&_mutex);
+}
+
+static void handle_frame(unsigned idx, uint8_t type, const uint8_t *body, uint16_t len)
+{
+    pthread_mutex_lock(&_mutex);
+    _stats.requests++;
+    pthread_mutex_unlock(&_mutex);
+    switch (type) {
+    case SC_IPC_GET_STATUS:
+        send_status(idx);
+        return;
+    case SC_IPC_SUBSCRIBE:
+        if (len != sizeof(uint32_t)) {
+            break;
+        }
+        memcpy(&_clients[idx].events, body, sizeof(uint32_t));
+        client_send(idx, SC_IPC_OK, NULL, 0);
+        return;
+    case SC_IPC_SUBMIT:
+        if (len != sizeof(scard_ipc_submit_t)) {
+            break;
+        }
+        handle_submit(idx, (const scard_ipc_submit_t *)body);
+        return;
+    default:
+        break;
+    }
+    client_send(idx, SC_IPC_ERROR, &type, 1);
+}
+
+static void client_read(unsigned idx)
+{
+    ipc_client_t *client = &_clients[idx];
+    uint32_t generation = client->generation;
+    ssize_t n = recv(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        client_close(idx);
+        return;
+    }
+    client->in_len += n;
+    size_t pos = 0;
+    // every complete frame in the buffer, a client may pipeline requests
+    while (client->in_len - pos >= IPC_FRAME_HEADER) {
+        uint16_t payload;
+        memcpy(&payload, client->in + pos, IPC_FRAME_HEADER);
+        if (payload == 0 || payload > SC_IPC_MAX_PAYLOAD) {
+            client_drop(idx, "bad frame");
+            return;
+        }
+        if (client->in_len - pos < IPC_FRAME_HEADER + (size_t)payload) {
+            break;
+        }
+        const uint8_t *frame = client->in + pos + IPC_FRAME_HEADER;
+        handle_frame(idx, frame[0], frame + 1, payload - 1);
+        if (client->fd < 0 || client->generation != generation) {
+            // dropped while answering
+            return;
+        }
+        pos += IPC_FRAME_HEADER + payload;
+    }
+    memmove(client->in, client->in + pos, client->in_len - pos);
+    client->in_len -= pos;
+}
+
+static void accept_clients()
+{
+    for (;;) {
+        int fd = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        unsigned idx = 0;
+        while (idx < SC_IPC_MAX_CLIENTS && _clients[idx].fd >= 0) {
+            idx++;
+        }
+        if (idx == SC_IPC_MAX_CLIENTS) {
+            ERR("ipc client refused, %u clients already\n", SC_IPC_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        _clients[idx].fd = fd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = idx;
+        epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        pthread_mutex_lock(&_mutex);
+        _stats.accepted++;
+        _stats.clients++;
+        pthread_mutex_unlock(&_mutex);
+        DBG("ipc client %u connected\n", idx);
+    }
+}
+
+static void *ipc_fnc(void *ptr)
+{
+    struct epoll_event events[32];
+    while (! _stop) {
+        int count = epoll_wait(_epoll_fd, events, 32, -1);
+        if (count < 0 && errno != EINTR) {
+            ERR("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            uint32_t id = events[i].data.u32;
+            if (id == IPC_LISTEN_ID) {
+                accept_clients();
+            } else if (id == IPC_WAKE_ID) {
+                uint64_t value;
+                ssize_t rv = read(_wake_fd, &value, sizeof(value));
+                (void)rv;
+            } else if (_clients[id].fd >= 0) {
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    client_close(id);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && ! client_flush(id)) {
+                    client_close(id);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    client_read(id);
+                }
+            }
+        }
+        // cheap when nothing changed, so done on every wake
+        check_status();
+        check_pending();
+    }
+    return 0;
+}
+
+bool scard_ipc_start(const char *path)
+{
+    if (_running) {
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERR("socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(_path, path);
+    // a stale socket from a previous run
+    unlink(path);
+
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listen_fd < 0 || bind(_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(_listen_fd, SC_IPC_MAX_CLIENTS) != 0) {
+        ERR("failed to listen on %s: %s\n", path, strerror(errno));
+        if (_listen_fd >= 0) {
+            close(_listen_fd);
+            _listen_fd = -1;
+        }
+        return false;
+    }
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = IPC_LISTEN_ID;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &ev);
+    ev.data.u32 = IPC_WAKE_ID;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev);
+
+    for (unsigned i = 0; i < SC_IPC_MAX_CLIENTS; i++) {
+        _clients[i].fd = -1;
+    }
+    memset(_pending, 0, sizeof(_pending));
+    _num_pending = 0;
+    memset(&_shown, 0, sizeof(_shown));
+    memset(&_stats, 0, sizeof(_stats));
+    _stop = false;
+    scard_set_notify(wake, NULL);
+
+    int rv = pthread_create(&_thread, NULL, ipc_fnc, NULL);
+    if (rv) {
+        ERR("Error - pthread_create() return code: %d\n", rv);
+        scard_set_notify(NULL, NULL);
+        close(_wake_fd);
+        close(_epoll_fd);
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+    _running = true;
+    INF("ipc listening on %s\n", path);
+    return true;
+}
+
+void scard_ipc_stop()
+{
+    if (! _running) {
+        return;
+    }
+    scard_set_notify(NULL, NULL);
+    _stop = true;
+    wake(NULL);
+    pthread_join(_thread, NULL);
+    for (unsigned i = 0; i < SC_IPC_MAX_CLIENTS; i++) {
+        if (_clients[i].fd >= 0) {
+            client_close(i);
+        }
+    }
+    close(_wake_fd);
+    close(_epoll_fd);
+    close(_listen_fd);
+    _listen_fd = -1;
+    unlink(_path);
+    _running = false;
+}
+
+#else
+
+bool scard_ipc_start(const char *path)
+{
+    ERR("ipc server needs epoll, not available on this platform\n");
+    return false;
+}
+
+void scard_ipc_stop()
+{
+}
+
+#endif
+
+void scard_ipc_get_stats(scard_ipc_stats_t *stats)
+{
+#ifdef __linux__
+    pthread_mutex_lock(&_mutex);
+    *stats = _stats;
+    pthread_mutex_unlock(&_mutex);
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
@@ -0,0 +1,122 @@
+/**
+ *
+ */
+
+#ifndef SCARD_IPC_H_
+#define SCARD_IPC_H_
+
+#include <stdint.h>
+
+// card status and commands for other local processes over a Unix domain
+// socket; every message is a frame of a 16-bit payload length followed by
+// the payload, a type byte and the body. The socket never leaves the host
+// so everything is in host byte order.
+
+#define SC_IPC_DEFAULT_PATH             "/tmp/scard.sock"
+#define SC_IPC_MAX_CLIENTS              64
+// commands in flight over all clients
+#define SC_IPC_MAX_PENDING              64
+#define SC_IPC_MAX_PAYLOAD              4096
+// a client that does not read its events is dropped beyond this
+#define SC_IPC_MAX_BACKLOG              (64 * 1024)
+
+typedef enum {
+    // client requests
+    // no body, answered with SC_IPC_STATUS
+    SC_IPC_GET_STATUS = 1,
+    // uint32_t mask of 1 << scard_ipc_event_type_t, answered with SC_IPC_OK
+    SC_IPC_SUBSCRIBE,
+    // scard_ipc_submit_t, answered with SC_IPC_RESULT once the command is final
+    SC_IPC_SUBMIT,
+
+    // server messages
+    // uint32_t status version, uint8_t count, then per reader an
+    // scard_ipc_reader_t, a uint8_t name length and the name
+    SC_IPC_STATUS = 0x81,
+    // scard_ipc_event_t
+    SC_IPC_EVENT,
+    // scard_ipc_result_t
+    SC_IPC_RESULT,
+    // no body
+    SC_IPC_OK,
+    // uint8_t type of the request that was not understood
+    SC_IPC_ERROR,
+} scard_ipc_type_t;
+
+typedef enum {
+    SC_IPC_EVENT_ATTACH,
+    SC_IPC_EVENT_DETACH,
+    SC_IPC_EVENT_INSERT,
+    SC_IPC_EVENT_REMOVE,
+    // card read and usable for commands
+    SC_IPC_EVENT_READY,
+    // user data on the card changed
+    SC_IPC_EVENT_UPDATE,
+    // any session state change
+    SC_IPC_EVENT_STATE,
+    SC_IPC_NUM_EVENTS
+} scard_ipc_event_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t slot;
+    uint8_t active;
+    uint8_t card_present;
+    uint8_t card_ready;
+    // see scard_state_name(), scard_card_class_name(), scard_error_class_name()
+    uint8_t state;
+    uint8_t card_class;
+    uint8_t error_class;
+    uint8_t pin_retries;
+    uint32_t user_magic;
+    uint32_t user_id;
+    uint32_t user_value;
+    uint32_t user_total;
+} scard_ipc_reader_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t event;
+    scard_ipc_reader_t reader;
+} scard_ipc_event_t;
+
+typedef struct __attribute__((packed)) {
+    // echoed in the result
+    uint32_t tag;
+    uint8_t slot;
+    // scard_command_type_t
+    uint8_t type;
+    uint32_t arg;
+} scard_ipc_submit_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t tag;
+    // scard_command_status_t
+    uint8_t status;
+    uint32_t user_id;
+    uint32_t user_value;
+    uint32_t user_total;
+    // submit to done
+    uint32_t latency_us;
+} scard_ipc_result_t;
+
+typedef struct {
+    unsigned long accepted;
+    unsigned long clients;
+    unsigned long requests;
+    unsigned long events;
+    unsigned long commands;
+    // clients dropped for a bad frame or a full backlog
+    unsigned long dropped;
+} scard_ipc_stats_t;
+
+// server, one thread for all the clients
+bool scard_ipc_start(const char *path);
+void scard_ipc_stop();
+void scard_ipc_get_stats(scard_ipc_stats_t *stats);
+
+// blocking client helpers; a socket fd or -1
+int scard_ipc_connect(const char *path);
+bool scard_ipc_send(int fd, uint8_t type, const void *body, uint16_t len);
+// returns the body length or -1, the body is cut at max
+int scard_ipc_recv(int fd, uint8_t *type, void *body, uint16_t max);
+
+#endif // SCARD_IPC_H_
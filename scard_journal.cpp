@@ -0,0 +1,435 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_journal.h"
+#include "scard_metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(scard_journal_record_t) == 64, "journal record size");
+static_assert(sizeof(scard_journal_header_t) == 64, "journal header size");
+
+typedef struct {
+    uint64_t txn;
+    unsigned reader;
+    uint64_t card_serial;
+    uint32_t card_hash;
+    uint32_t old_id;
+    uint32_t new_id;
+    uint32_t old_value;
+    uint32_t new_value;
+} open_txn_t;
+
+// appends and remaps are serialized, the group commit thread only syncs
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _append_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _synced_cond = PTHREAD_COND_INITIALIZER;
+static int _fd = -1;
+static scard_journal_header_t *_header = nullptr;
+static size_t _map_len;
+static uint64_t _capacity;
+// records written and records known to be on disk
+static uint64_t _head;
+static uint64_t _synced;
+// a sync failed, nothing written since can be trusted to be on disk
+static bool _failed = false;
+static bool _sync_running = false;
+static pthread_t _sync_thread;
+static open_txn_t _open[SC_JOURNAL_MAX_OPEN];
+static unsigned _num_open;
+static scard_journal_stats_t _stats;
+
+static scard_journal_record_t *journal_records()
+{
+    return (scard_journal_record_t *)(_header + 1);
+}
+
+static bool record_valid(const scard_journal_record_t *rec, uint64_t idx)
+{
+    return rec->seq == idx + 1 && rec->crc == scard_crc32(rec, offsetof(scard_journal_record_t, crc));
+}
+
+static int sync_file(int fd)
+{
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+// maps the file at the given number of records, growing it if needed
+static bool journal_map(uint64_t capacity)
+{
+    size_t len = sizeof(scard_journal_header_t) + capacity * sizeof(scard_journal_record_t);
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        ERR("failed to stat journal: %s\n", strerror(errno));
+        return false;
+    }
+    if ((size_t)st.st_size < len) {
+#ifdef __APPLE__
+        int rv = ftruncate(_fd, len) == 0 ? 0 : errno;
+#else
+        // blocks are allocated now, not on the first write to each page
+        int rv = posix_fallocate(_fd, 0, len);
+#endif
+        if (rv != 0) {
+            ERR("failed to grow journal to %lu bytes: %s\n", (unsigned long)len, strerror(rv));
+            return false;
+        }
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        ERR("failed to map journal: %s\n", strerror(errno));
+        return false;
+    }
+    if (_header) {
+        munmap(_header, _map_len);
+    }
+    _header = (scard_journal_header_t *)map;
+    _map_len = len;
+    _capacity = capacity;
+    return true;
+}
+
+static void open_add(const scard_journal_record_t *rec)
+{
+    if (_num_open == SC_JOURNAL_MAX_OPEN) {
+        // oldest one goes, it stays in doubt in the file
+        ERR("too many open journal transactions, forgetting txn %lu\n", (unsigned long)_open[0].txn);
+        memmove(&_open[0], &_open[1], (SC_JOURNAL_MAX_OPEN - 1) * sizeof(open_txn_t));
+        _num_open--;
+    }
+    open_txn_t *t = &_open[_num_open++];
+    t->txn = rec->seq;
+    t->reader = rec->reader;
+    t->card_serial = rec->card_serial;
+    t->card_hash = rec->card_hash;
+    t->old_id = rec->old_id;
+    t->new_id = rec->new_id;
+    t->old_value = rec->old_value;
+    t->new_value = rec->new_value;
+}
+
+static int open_find(uint64_t txn)
+{
+    for (unsigned i = 0; i < _num_open; i++) {
+        if (_open[i].txn == txn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void open_remove(unsigned idx)
+{
+    memmove(&_open[idx], &_open[idx + 1], (_num_open - idx - 1) * sizeof(open_txn_t));
+    _num_open--;
+}
+
+// finds the end of the journal and the intents that never got an outcome
+static void journal_recover()
+{
+    scard_journal_record_t *records = journal_records();
+    uint64_t idx = 0;
+    while (idx < _capacity && record_valid(&records[idx], idx)) {
+        const scard_journal_record_t *rec = &records[idx];
+        if (rec->type == SC_JOURNAL_INTENT) {
+            open_add(rec);
+        } else {
+            int t = open_find(rec->txn);
+            if (t >= 0) {
+                open_remove(t);
+            }
+        }
+        idx++;
+    }
+    // anything after a torn record was never acknowledged, clear it so
+    // that it can not pass for a valid record once the journal moves on;
+    // pages reach the disk in any order, so look past zeroed records too
+    uint64_t end = idx;
+    for (uint64_t i = idx; i < _capacity; i++) {
+        if (records[i].seq != 0) {
+            end = i + 1;
+        }
+    }
+    if (end > idx) {
+        ERR("journal has a torn tail, dropping %lu records\n", (unsigned long)(end - idx));
+        memset(&records[idx], 0, (end - idx) * sizeof(scard_journal_record_t));
+        sync_file(_fd);
+    }
+    _head = idx;
+    _synced = idx;
+    _stats.records = idx;
+    for (unsigned i = 0; i < _num_open; i++) {
+        const open_txn_t *t = &_open[i];
+        ERR("journal txn %lu in doubt: card %016llX ID %u value %u -> ID %u value %u\n", (unsigned long)t->txn,
+            (unsigned long long)t->card_serial, t->old_id, t->old_value, t->new_id, t->new_value);
+    }
+}
+
+// group commit; appends that arrive while a sync runs go out with the next one
+static void *sync_fnc(void *ptr)
+{
+    pthread_mutex_lock(&_mutex);
+    while (_sync_running || (_synced < _head && ! _failed)) {
+        if (_synced == _head || _failed) {
+            pthread_cond_wait(&_append_cond, &_mutex);
+            continue;
+        }
+        uint64_t target = _head;
+        int fd = _fd;
+        pthread_mutex_unlock(&_mutex);
+
+        uint64_t start_ns = scard_now_ns();
+        int rv = sync_file(fd);
+        int err = errno;
+        uint64_t duration_ns = scard_now_ns() - start_ns;
+        scard_metrics_timer(SC_TIMER_JOURNAL_SYNC, duration_ns);
+
+        pthread_mutex_lock(&_mutex);
+        if (rv != 0) {
+            // the pages that did not make it may be marked clean by now, so
+            // a later sync that succeeds proves nothing; stop vouching for
+            // the journal and let the waiting intents fail
+            ERR("journal sync failed: %s, no more card writes\n", strerror(err));
+            _failed = true;
+            pthread_cond_broadcast(&_synced_cond);
+            continue;
+        }
+        _stats.syncs++;
+        _stats.synced_records += target - _synced;
+        if (duration_ns > _stats.sync_max_ns) {
+            _stats.sync_max_ns = duration_ns;
+        }
+        _synced = target;
+        pthread_cond_broadcast(&_synced_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+bool scard_journal_open(const char *path)
+{
+    scard_journal_close();
+
+    pthread_mutex_lock(&_mutex);
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        ERR("failed to open journal %s: %s\n", path, strerror(errno));
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    struct stat st;
+    fstat(_fd, &st);
+    bool fresh = (st.st_size == 0);
+    uint64_t capacity = SC_JOURNAL_SEGMENT_RECORDS;
+    if (! fresh && (size_t)st.st_size > sizeof(scard_journal_header_t)) {
+        capacity = (st.st_size - sizeof(scard_journal_header_t)) / sizeof(scard_journal_record_t);
+    }
+    if (! journal_map(capacity)) {
+        close(_fd);
+        _fd = -1;
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    if (fresh) {
+        _header->magic = SC_JOURNAL_MAGIC;
+        _header->version = SC_JOURNAL_VERSION;
+        _header->record_size = sizeof(scard_journal_record_t);
+        sync_file(_fd);
+    } else if (_header->magic != SC_JOURNAL_MAGIC
+        || _header->version != SC_JOURNAL_VERSION
+        || _header->record_size != sizeof(scard_journal_record_t)) {
+        ERR("%s is not a journal we can append to\n", path);
+        munmap(_header, _map_len);
+        _header = nullptr;
+        close(_fd);
+        _fd = -1;
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+
+    memset(&_stats, 0, sizeof(_stats));
+    _num_open = 0;
+    _failed = false;
+    journal_recover();
+    _stats.open = _num_open;
+
+    _sync_running = true;
+    int rv = pthread_create(&_sync_thread, NULL, sync_fnc, NULL);
+    if (rv) {
+        ERR("Error - pthread_create() return code: %d\n", rv);
+        _sync_running = false;
+        // nothing would make the intents durable
+        _failed = true;
+    }
+    pthread_mutex_unlock(&_mutex);
+    INF("journal %s, %lu records, %u in doubt\n", path, (unsigned long)_head, _num_open);
+    return true;
+}
+
+void scard_journal_close()
+{
+    pthread_mutex_lock(&_mutex);
+    if (_fd < 0) {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    bool join = _sync_running;
+    _sync_running = false;
+    pthread_cond_signal(&_append_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (join) {
+        // flushes what is left before it goes
+        pthread_join(_sync_thread, NULL);
+    }
+
+    pthread_mutex_lock(&_mutex);
+    munmap(_header, _map_len);
+    _header = nullptr;
+    close(_fd);
+    _fd = -1;
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool scard_journal_enabled()
+{
+    pthread_mutex_lock(&_mutex);
+    bool rv = (_fd >= 0);
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+// caller holds the lock
+static uint64_t journal_append(scard_journal_record_t *rec)
+{
+    if (_head == _capacity && ! journal_map(_capacity + SC_JOURNAL_SEGMENT_RECORDS)) {
+        return 0;
+    }
+    rec->ts_ns = scard_wall_ns();
+    rec->seq = _head + 1;
+    if (rec->type == SC_JOURNAL_INTENT) {
+        rec->txn = rec->seq;
+    }
+    memset(rec->pad, 0, sizeof(rec->pad));
+    rec->crc = scard_crc32(rec, offsetof(scard_journal_record_t, crc));
+    journal_records()[_head] = *rec;
+    _head++;
+    _stats.records++;
+    pthread_cond_signal(&_append_cond);
+    return rec->seq;
+}
+
+uint64_t scard_journal_intent(unsigned reader, uint64_t card_serial, uint32_t card_hash, uint32_t old_id,
+    uint32_t new_id, uint32_t old_value, uint32_t new_value)
+{
+    scard_journal_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = SC_JOURNAL_INTENT;
+    rec.reader = reader;
+    rec.card_serial = card_serial;
+    rec.card_hash = card_hash;
+    rec.old_id = old_id;
+    rec.new_id = new_id;
+    rec.old_value = old_value;
+    rec.new_value = new_value;
+
+    pthread_mutex_lock(&_mutex);
+    if (_fd < 0 || _failed) {
+        pthread_mutex_unlock(&_mutex);
+        return 0;
+    }
+    uint64_t seq = journal_append(&rec);
+    if (seq) {
+        open_add(&rec);
+        _stats.open = _num_open;
+        // other sessions appending meanwhile share the same sync; the sync
+        // thread flushes everything before it exits, even on close
+        while (_synced < seq && ! _failed) {
+            pthread_cond_wait(&_synced_cond, &_mutex);
+        }
+        if (_synced < seq) {
+            // not on disk, the card must not be written
+            seq = 0;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return seq;
+}
+
+// caller holds the lock
+static void journal_outcome(unsigned idx, scard_journal_type_t type)
+{
+    const open_txn_t *t = &_open[idx];
+    scard_journal_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.txn = t->txn;
+    rec.type = type;
+    rec.reader = t->reader;
+    rec.card_serial = t->card_serial;
+    rec.card_hash = t->card_hash;
+    rec.old_id = t->old_id;
+    rec.new_id = t->new_id;
+    rec.old_value = t->old_value;
+    rec.new_value = t->new_value;
+    journal_append(&rec);
+    open_remove(idx);
+    _stats.open = _num_open;
+}
+
+void scard_journal_commit(uint64_t txn)
+{
+    pthread_mutex_lock(&_mutex);
+    int idx = open_find(txn);
+    if (_fd >= 0 && idx >= 0) {
+        journal_outcome(idx, SC_JOURNAL_COMMIT);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_journal_reconcile(uint64_t card_serial, uint32_t id, uint32_t value)
+{
+    if (card_serial == 0) {
+        return;
+    }
+    pthread_mutex_lock(&_mutex);
+    if (_fd < 0) {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    // newest first, the card holds the outcome of the last write; intents
+    // from before card serials have none and are left for the operator
+    for (int i = (int)_num_open - 1; i >= 0; i--) {
+        const open_txn_t *t = &_open[i];
+        if (t->card_serial != card_serial) {
+            continue;
+        }
+        if (id == t->new_id && value == t->new_value) {
+            INF("journal txn %lu found on the card, committing\n", (unsigned long)t->txn);
+            journal_outcome(i, SC_JOURNAL_COMMIT);
+            _stats.reconciled++;
+        } else if (id == t->old_id && value == t->old_value) {
+            INF("journal txn %lu not on the card, aborting\n", (unsigned long)t->txn);
+            journal_outcome(i, SC_JOURNAL_ABORT);
+            _stats.reconciled++;
+        } else {
+            ERR("journal txn %lu still in doubt, card has ID %u value %u\n", (unsigned long)t->txn, id, value);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_journal_get_stats(scard_journal_stats_t *stats)
+{
+    pthread_mutex_lock(&_mutex);
+    *stats = _stats;
+    pthread_mutex_unlock(&_mutex);
+}
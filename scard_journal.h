@@ -0,0 +1,86 @@
+/**
+ *
+ */
+
+#ifndef SCARD_JOURNAL_H_
+#define SCARD_JOURNAL_H_
+
+#include <stdint.h>
+
+// append only journal of the card writes; every write is an intent record
+// that is on disk before the card is touched, followed by a commit record
+// once the card holds the new data
+#define SC_JOURNAL_MAGIC                0x4C4A4353      // "SCJL"
+#define SC_JOURNAL_VERSION              1
+// the file is preallocated and grows by this many records at a time
+#define SC_JOURNAL_SEGMENT_RECORDS      16384
+// open transactions remembered until their card shows up again
+#define SC_JOURNAL_MAX_OPEN             64
+
+typedef enum {
+    SC_JOURNAL_INTENT = 1,
+    SC_JOURNAL_COMMIT,
+    // card was found with the old data, the write never happened
+    SC_JOURNAL_ABORT,
+} scard_journal_type_t;
+
+typedef struct {
+    // record index + 1; 0 marks the end of the journal
+    uint64_t seq;
+    // seq of the intent record, shared by its commit or abort
+    uint64_t txn;
+    // CLOCK_REALTIME, for reconciling with the outside world
+    uint64_t ts_ns;
+    uint8_t type;
+    // session slot of the reader
+    uint8_t reader;
+    uint16_t reserved;
+    // see scard_card_hash(), the same on every card of a batch, for the log only
+    uint32_t card_hash;
+    // user data before and after the write
+    uint32_t old_id;
+    uint32_t new_id;
+    uint32_t old_value;
+    uint32_t new_value;
+    // the card the write is for, 0 in records from before card serials
+    uint64_t card_serial;
+    uint32_t pad[1];
+    // CRC-32 of everything above
+    uint32_t crc;
+} scard_journal_record_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved[13];
+} scard_journal_header_t;
+
+typedef struct {
+    unsigned long records;
+    // group commits and the records they made durable
+    unsigned long syncs;
+    unsigned long synced_records;
+    uint64_t sync_max_ns;
+    // intents without an outcome
+    unsigned long open;
+    // outcomes found by looking at the card after a crash or a failed write
+    unsigned long reconciled;
+} scard_journal_stats_t;
+
+// opens or creates the journal, open transactions found in it are kept
+// until their card is read again
+bool scard_journal_open(const char *path);
+void scard_journal_close();
+bool scard_journal_enabled();
+// appends the intent and returns once it is on disk, 0 if the journal is off or failed
+uint64_t scard_journal_intent(unsigned reader, uint64_t card_serial, uint32_t card_hash, uint32_t old_id,
+    uint32_t new_id, uint32_t old_value, uint32_t new_value);
+// appends the outcome without waiting, the next group commit makes it durable
+void scard_journal_commit(uint64_t txn);
+// settles the open transactions of a card from the data now on it; a card
+// without a serial settles nothing, any other card could hold the same data
+void scard_journal_reconcile(uint64_t card_serial, uint32_t id, uint32_t value);
+void scard_journal_get_stats(scard_journal_stats_t *stats);
+
+#endif // SCARD_JOURNAL_H_
@@ -0,0 +1,495 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_ledger.h"
+#include "scard_seqlock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(scard_ledger_entry_t) == 40, "ledger entry size");
+static_assert(sizeof(scard_ledger_header_t) == 16, "ledger header size");
+
+// entries copied out per lock hold by compaction and scans
+#define LEDGER_CHUNK                    4096
+// no compaction for a log smaller than this
+#define LEDGER_COMPACT_MIN_RECORDS      1024
+
+// guards everything below, the summary is published through a seqlock
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+static char *_path = nullptr;
+static int _fd = -1;
+// entries in the order the cards were first seen
+static scard_ledger_entry_t *_entries = nullptr;
+// update sequence of each entry, tells compaction what changed under it
+static uint64_t *_updated = nullptr;
+static size_t _count;
+static size_t _alloc;
+static uint64_t _update_seq;
+// open addressing with linear probing, entry index + 1 per slot, 0 is empty;
+// cards are never removed so there are no tombstones
+static uint32_t *_index = nullptr;
+static size_t _index_len;
+static pthread_t _thread;
+static bool _thread_run = false;
+static scard_ledger_summary_t _summary;
+static scard_seqlock_t _summary_lock;
+static scard_ledger_summary_t _published;
+
+static size_t key_hash(uint64_t card_serial)
+{
+    uint64_t key = card_serial;
+    // murmur3 finalizer, serials are random but nothing checks that
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+static size_t index_slot(uint64_t card_serial)
+{
+    size_t mask = _index_len - 1;
+    size_t slot = key_hash(card_serial) & mask;
+    while (_index[slot]) {
+        const scard_ledger_entry_t *entry = &_entries[_index[slot] - 1];
+        if (entry->card_serial == card_serial) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool index_grow()
+{
+    size_t len = _index_len ? _index_len * 2 : 1024;
+    uint32_t *index = (uint32_t *)calloc(len, sizeof(uint32_t));
+    if (! index) {
+        return false;
+    }
+    free(_index);
+    _index = index;
+    _index_len = len;
+    for (size_t i = 0; i < _count; i++) {
+        _index[index_slot(_entries[i].card_serial)] = i + 1;
+    }
+    return true;
+}
+
+// returns the entry of the card, a zeroed one if it is new; NULL if out of memory
+static scard_ledger_entry_t *ledger_get(uint64_t card_serial, bool *found)
+{
+    // at most half full keeps the probes short
+    if ((_count + 1) * 2 > _index_len && ! index_grow()) {
+        return nullptr;
+    }
+    size_t slot = index_slot(card_serial);
+    *found = (_index[slot] != 0);
+    if (*found) {
+        return &_entries[_index[slot] - 1];
+    }
+    if (_count == _alloc) {
+        size_t alloc = _alloc ? _alloc * 2 : 1024;
+        scard_ledger_entry_t *entries = (scard_ledger_entry_t *)realloc(_entries, alloc * sizeof(scard_ledger_entry_t));
+        if (! entries) {
+            return nullptr;
+        }
+        _entries = entries;
+        uint64_t *updated = (uint64_t *)realloc(_updated, alloc * sizeof(uint64_t));
+        if (! updated) {
+            return nullptr;
+        }
+        _updated = updated;
+        _alloc = alloc;
+    }
+    scard_ledger_entry_t *entry = &_entries[_count];
+    memset(entry, 0, sizeof(scard_ledger_entry_t));
+    entry->card_serial = card_serial;
+    _updated[_count] = 0;
+    _index[slot] = ++_count;
+    _summary.cards = _count;
+    return entry;
+}
+
+static void publish_summary()
+{
+    scard_seqlock_write_begin(&_summary_lock);
+    _published = _summary;
+    scard_seqlock_write_end(&_summary_lock);
+}
+
+static bool write_entry(int fd, const scard_ledger_entry_t *entry)
+{
+    scard_ledger_entry_t rec = *entry;
+    rec.crc = scard_crc32(&rec, offsetof(scard_ledger_entry_t, crc));
+    return write(fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec);
+}
+
+static bool write_header(int fd)
+{
+    scard_ledger_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SC_LEDGER_MAGIC;
+    header.version = SC_LEDGER_VERSION;
+    header.entry_size = sizeof(scard_ledger_entry_t);
+    return write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+}
+
+// replays the log into memory, a torn record at the end is cut off
+static bool ledger_load()
+{
+    scard_ledger_header_t header;
+    ssize_t len = read(_fd, &header, sizeof(header));
+    if (len == 0) {
+        return write_header(_fd);
+    }
+    if (len == sizeof(header) && header.magic == SC_LEDGER_MAGIC && header.version == 1) {
+        // keyed by the card hash, every regular card of a batch is one entry
+        ERR("%s is from before card serials, its cards can not be told apart; move it away\n", _path);
+        return false;
+    }
+    if (len != sizeof(header) || header.magic != SC_LEDGER_MAGIC
+        || header.version != SC_LEDGER_VERSION || header.entry_size != sizeof(scard_ledger_entry_t)) {
+        ERR("%s is not a ledger we can use\n", _path);
+        return false;
+    }
+
+    static scard_ledger_entry_t records[LEDGER_CHUNK];
+    off_t good = sizeof(header);
+    bool torn = false;
+    while (! torn && (len = read(_fd, records, sizeof(records))) > 0) {
+        size_t n = len / sizeof(scard_ledger_entry_t);
+        torn = (len % sizeof(scard_ledger_entry_t)) != 0;
+        for (size_t i = 0; i < n; i++) {
+            const scard_ledger_entry_t *rec = &records[i];
+            if (rec->crc != scard_crc32(rec, offsetof(scard_ledger_entry_t, crc))) {
+                torn = true;
+                break;
+            }
+            bool found;
+            scard_ledger_entry_t *entry = ledger_get(rec->card_serial, &found);
+            if (! entry) {
+                ERR("out of memory loading the ledger\n");
+                return false;
+            }
+            *entry = *rec;
+            good += sizeof(scard_ledger_entry_t);
+            _summary.records++;
+        }
+    }
+    if (torn) {
+        ERR("ledger %s has a torn tail at %ld, cutting it off\n", _path, (long)good);
+        if (ftruncate(_fd, good) != 0) {
+            ERR("failed to truncate ledger: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    lseek(_fd, good, SEEK_SET);
+    for (size_t i = 0; i < _count; i++) {
+        _summary.topups += _entries[i].topups;
+        _summary.value += _entries[i].value;
+    }
+    return true;
+}
+
+static bool write_entries(int fd, scard_ledger_entry_t *entries, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        entries[i].crc = scard_crc32(&entries[i], offsetof(scard_ledger_entry_t, crc));
+    }
+    return write(fd, entries, n * sizeof(scard_ledger_entry_t)) == (ssize_t)(n * sizeof(scard_ledger_entry_t));
+}
+
+// caller holds the lock; copies the entries updated after seq, false if out of memory
+static bool copy_changed(uint64_t seq, scard_ledger_entry_t **entries, size_t *count)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < _count; i++) {
+        n += (_updated[i] > seq);
+    }
+    *entries = nullptr;
+    *count = n;
+    if (n == 0) {
+        return true;
+    }
+    *entries = (scard_ledger_entry_t *)malloc(n * sizeof(scard_ledger_entry_t));
+    if (! *entries) {
+        return false;
+    }
+    n = 0;
+    for (size_t i = 0; i < _count; i++) {
+        if (_updated[i] > seq) {
+            (*entries)[n++] = _entries[i];
+        }
+    }
+    return true;
+}
+
+// writes the live entries to a new file and swaps it in; sessions keep
+// recording meanwhile, the writes and the sync run without the lock and
+// only the last few changes are carried over while holding it
+static bool ledger_compact()
+{
+    uint64_t start_ns = scard_now_ns();
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", _path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ERR("failed to create %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = write_header(fd);
+
+    pthread_mutex_lock(&_mutex);
+    uint64_t snapshot_seq = _update_seq;
+    size_t count = _count;
+    pthread_mutex_unlock(&_mutex);
+
+    static scard_ledger_entry_t chunk[LEDGER_CHUNK];
+    for (size_t pos = 0; ok && pos < count; pos += LEDGER_CHUNK) {
+        size_t n = (count - pos < LEDGER_CHUNK) ? count - pos : LEDGER_CHUNK;
+        pthread_mutex_lock(&_mutex);
+        memcpy(chunk, &_entries[pos], n * sizeof(scard_ledger_entry_t));
+        pthread_mutex_unlock(&_mutex);
+        ok = write_entries(fd, chunk, n);
+    }
+
+    // entries changed while the chunks were written, and cards seen for
+    // the first time; a second snapshot, written and synced unlocked too
+    scard_ledger_entry_t *changed;
+    size_t changed_count;
+    pthread_mutex_lock(&_mutex);
+    ok = copy_changed(snapshot_seq, &changed, &changed_count) && ok;
+    snapshot_seq = _update_seq;
+    pthread_mutex_unlock(&_mutex);
+    ok = ok && write_entries(fd, changed, changed_count);
+    free(changed);
+    ok = ok && fdatasync(fd) == 0;
+    unsigned long records = count + changed_count;
+
+    pthread_mutex_lock(&_mutex);
+    // what changed since is appended like any record, without a sync; the
+    // swap holds the lock so that no record lands in the old file only
+    for (size_t i = 0; ok && i < _count; i++) {
+        if (_updated[i] > snapshot_seq) {
+            ok = write_entry(fd, &_entries[i]);
+            records++;
+        }
+    }
+    if (ok && rename(tmp, _path) == 0) {
+        close(_fd);
+        _fd = fd;
+        uint64_t duration_ns = scard_now_ns() - start_ns;
+        _summary.records = records;
+        _summary.compactions++;
+        if (duration_ns > _summary.compact_max_ns) {
+            _summary.compact_max_ns = duration_ns;
+        }
+        publish_summary();
+        pthread_mutex_unlock(&_mutex);
+        INF("ledger compacted to %lu records in %.1f ms\n", records, duration_ns / 1e6);
+        return true;
+    }
+    pthread_mutex_unlock(&_mutex);
+    ERR("ledger compaction failed: %s\n", strerror(errno));
+    close(fd);
+    unlink(tmp);
+    return false;
+}
+
+static bool compact_due()
+{
+    return _summary.records >= LEDGER_COMPACT_MIN_RECORDS
+        && _summary.records > SC_LEDGER_COMPACT_RATIO * _summary.cards;
+}
+
+static void *ledger_fnc(void *ptr)
+{
+    pthread_mutex_lock(&_mutex);
+    while (_thread_run) {
+        if (! compact_due()) {
+            // scard_ledger_record() signals once there is enough to gain
+            pthread_cond_wait(&_cond, &_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&_mutex);
+        bool ok = ledger_compact();
+        pthread_mutex_lock(&_mutex);
+        if (! ok) {
+            // still due, wait a while before trying again
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += SC_LEDGER_COMPACT_RETRY_S;
+            while (_thread_run && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT) {
+            }
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+bool scard_ledger_open(const char *path)
+{
+    scard_ledger_close();
+
+    pthread_mutex_lock(&_mutex);
+    _path = strdup(path);
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        ERR("failed to open ledger %s: %s\n", path, strerror(errno));
+        pthread_mutex_unlock(&_mutex);
+        scard_ledger_close();
+        return false;
+    }
+    memset(&_summary, 0, sizeof(_summary));
+    uint64_t start_ns = scard_now_ns();
+    if (! ledger_load()) {
+        pthread_mutex_unlock(&_mutex);
+        scard_ledger_close();
+        return false;
+    }
+    INF("ledger %s, %lu cards from %lu records in %.1f ms\n", path, _summary.cards, _summary.records,
+        (scard_now_ns() - start_ns) / 1e6);
+    publish_summary();
+
+    _thread_run = true;
+    int rv = pthread_create(&_thread, NULL, ledger_fnc, NULL);
+    if (rv) {
+        ERR("Error - pthread_create() return code: %d\n", rv);
+        _thread_run = false;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+void scard_ledger_close()
+{
+    pthread_mutex_lock(&_mutex);
+    bool join = _thread_run;
+    _thread_run = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (join) {
+        pthread_join(_thread, NULL);
+    }
+
+    pthread_mutex_lock(&_mutex);
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    free(_path);
+    _path = nullptr;
+    free(_entries);
+    _entries = nullptr;
+    free(_updated);
+    _updated = nullptr;
+    free(_index);
+    _index = nullptr;
+    _count = _alloc = _index_len = 0;
+    memset(&_summary, 0, sizeof(_summary));
+    publish_summary();
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool scard_ledger_record(uint64_t card_serial, uint32_t user_id, uint32_t value, uint32_t total, uint32_t topups,
+    scard_ledger_entry_t *previous)
+{
+    pthread_mutex_lock(&_mutex);
+    if (_fd < 0) {
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    bool found = false;
+    scard_ledger_entry_t *entry = ledger_get(card_serial, &found);
+    if (! entry) {
+        ERR("out of memory, card %016llX not in the ledger\n", (unsigned long long)card_serial);
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    if (previous) {
+        *previous = *entry;
+    }
+    _summary.lookups++;
+    _summary.topups += topups;
+    _summary.value += (uint64_t)value - entry->value;
+    entry->user_id = user_id;
+    entry->value = value;
+    entry->total = total;
+    entry->topups += topups;
+    entry->last_seen_ns = scard_wall_ns();
+    _updated[entry - _entries] = ++_update_seq;
+    // not synced, the journal is what survives a crash; this is history
+    if (! write_entry(_fd, entry)) {
+        ERR("failed to append to ledger: %s\n", strerror(errno));
+    } else {
+        _summary.records++;
+    }
+    publish_summary();
+    if (compact_due()) {
+        pthread_cond_signal(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return found;
+}
+
+bool scard_ledger_lookup(uint64_t card_serial, scard_ledger_entry_t *entry)
+{
+    bool found = false;
+    pthread_mutex_lock(&_mutex);
+    if (_index_len) {
+        size_t slot = index_slot(card_serial);
+        if (_index[slot]) {
+            *entry = _entries[_index[slot] - 1];
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return found;
+}
+
+unsigned long scard_ledger_scan(scard_ledger_fn fn, void *arg)
+{
+    scard_ledger_entry_t *chunk = (scard_ledger_entry_t *)malloc(LEDGER_CHUNK * sizeof(scard_ledger_entry_t));
+    if (! chunk) {
+        return 0;
+    }
+    size_t pos = 0;
+    for (;;) {
+        pthread_mutex_lock(&_mutex);
+        size_t n = (pos < _count) ? _count - pos : 0;
+        if (n > LEDGER_CHUNK) {
+            n = LEDGER_CHUNK;
+        }
+        if (n) {
+            memcpy(chunk, &_entries[pos], n * sizeof(scard_ledger_entry_t));
+        }
+        pthread_mutex_unlock(&_mutex);
+        if (n == 0) {
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            fn(&chunk[i], arg);
+        }
+        pos += n;
+    }
+    free(chunk);
+    return pos;
+}
+
+void scard_ledger_get_summary(scard_ledger_summary_t *summary)
+{
+    uint32_t seq;
+    do {
+        seq = scard_seqlock_read_begin(&_summary_lock);
+        *summary = _published;
+    } while (scard_seqlock_read_retry(&_summary_lock, seq));
+}
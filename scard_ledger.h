@@ -0,0 +1,69 @@
+/**
+ *
+ */
+
+#ifndef SCARD_LEDGER_H_
+#define SCARD_LEDGER_H_
+
+#include <stdint.h>
+
+// history of every card seen, one entry per card; the file is a log of
+// entry snapshots where the last one of a card wins, rewritten from the
+// in-memory entries by a background compaction
+#define SC_LEDGER_MAGIC                 0x474C4353      // "SCLG"
+#define SC_LEDGER_VERSION               2
+// compaction runs when the log holds this many times more records than cards
+#define SC_LEDGER_COMPACT_RATIO         4
+// a failed compaction is tried again after this long
+#define SC_LEDGER_COMPACT_RETRY_S       60
+
+// cards are keyed by their serial; user_id is not unique, every regular card
+// carries SC_REGULAR_ID, and neither is the card hash, every card of a batch
+// has the same header
+typedef struct {
+    uint64_t card_serial;
+    uint32_t user_id;
+    uint32_t value;
+    uint32_t total;
+    uint32_t topups;
+    // CLOCK_REALTIME of the last read or write
+    uint64_t last_seen_ns;
+    uint32_t reserved;
+    // CRC-32 of everything above, only meaningful in the file
+    uint32_t crc;
+} scard_ledger_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t reserved;
+} scard_ledger_header_t;
+
+typedef struct {
+    unsigned long cards;
+    // records in the log file, cards after a compaction
+    unsigned long records;
+    unsigned long topups;
+    uint64_t value;
+    unsigned long lookups;
+    unsigned long compactions;
+    uint64_t compact_max_ns;
+} scard_ledger_summary_t;
+
+// loads the log into memory and starts the compaction thread
+bool scard_ledger_open(const char *path);
+void scard_ledger_close();
+// updates the entry of a card and appends it to the log; the entry as it was
+// before is returned in previous, false if the card is new or the ledger is off
+bool scard_ledger_record(uint64_t card_serial, uint32_t user_id, uint32_t value, uint32_t total, uint32_t topups,
+    scard_ledger_entry_t *previous);
+bool scard_ledger_lookup(uint64_t card_serial, scard_ledger_entry_t *entry);
+// calls fn for every card, on a copy taken a chunk at a time so that
+// sessions are not held up by long reports; returns the number of cards
+typedef void (*scard_ledger_fn)(const scard_ledger_entry_t *entry, void *arg);
+unsigned long scard_ledger_scan(scard_ledger_fn fn, void *arg);
+// never blocks, safe to call every frame
+void scard_ledger_get_summary(scard_ledger_summary_t *summary);
+
+#endif // SCARD_LEDGER_H_
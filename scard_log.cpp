@@ -0,0 +1,276 @@
+/**
+ *
+ */
+
+
+#include "scard_log.h"
+
+#include <atomic>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// fits a formatted line or the largest APDU with its status word
+#define LOG_DATA_LEN                    264
+#define LOG_BATCH_LEN                   512
+#define LOG_WRITER_PERIOD_MS            10
+
+typedef struct {
+    uint64_t ts_ns;
+    const char *func;
+    const char *tag;
+    uint16_t line;
+    uint8_t level;
+    uint8_t hex;
+    uint16_t len;
+    char data[LOG_DATA_LEN];
+} log_record_t;
+
+// single producer (the owning thread), single consumer (the writer thread)
+typedef struct log_ring {
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<bool> dead;
+    std::atomic<unsigned long> dropped;
+    struct log_ring *next;
+    log_record_t records[SC_LOG_RING_SIZE];
+} log_ring_t;
+
+static const char *level_names[] = { "TRC", "DBG", "INF", "ERR" };
+
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+static pthread_key_t _key;
+// protects the ring list and the output
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *_rings = nullptr;
+static thread_local log_ring_t *t_ring = nullptr;
+static pthread_t _writer;
+static std::atomic<bool> _writer_run;
+static FILE *_file = nullptr;
+static uint64_t _start_ns;
+static unsigned long _dropped;
+static log_record_t _batch[LOG_BATCH_LEN];
+
+static uint64_t log_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+    uint64_t ta = ((const log_record_t *)a)->ts_ns;
+    uint64_t tb = ((const log_record_t *)b)->ts_ns;
+    return (ta > tb) - (ta < tb);
+}
+
+static void write_batch(unsigned count)
+{
+    FILE *file = _file ? _file : stderr;
+    // rings are drained one after the other, restore the time order
+    qsort(_batch, count, sizeof(log_record_t), cmp_record);
+    for (unsigned i = 0; i < count; i++) {
+        const log_record_t *rec = &_batch[i];
+        uint64_t ts = rec->ts_ns - _start_ns;
+        fprintf(file, "%5lu.%06lu [%s] %s():%d : ",
+            (unsigned long)(ts / 1000000000ULL), (unsigned long)(ts % 1000000000ULL / 1000),
+            level_names[rec->level], rec->func, rec->line);
+        if (rec->hex) {
+            fprintf(file, "%s: [%u]: ", rec->tag, rec->len);
+            for (unsigned n = 0; n < rec->len; n++) {
+                fprintf(file, "%02X ", (uint8_t)rec->data[n]);
+            }
+            fputc('\n', file);
+        } else {
+            fwrite(rec->data, 1, rec->len, file);
+        }
+    }
+}
+
+// must be called with _mutex held
+static void drain()
+{
+    unsigned count = 0;
+    log_ring_t **link = &_rings;
+    while (*link) {
+        log_ring_t *ring = *link;
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail != head) {
+            _batch[count++] = ring->records[tail % SC_LOG_RING_SIZE];
+            tail++;
+            ring->tail.store(tail, std::memory_order_release);
+            if (count == LOG_BATCH_LEN) {
+                write_batch(count);
+                count = 0;
+            }
+        }
+        _dropped += ring->dropped.exchange(0);
+        if (ring->dead.load(std::memory_order_acquire) && tail == ring->head.load(std::memory_order_acquire)) {
+            // owner thread is gone and everything was written
+            *link = ring->next;
+            delete ring;
+            continue;
+        }
+        link = &ring->next;
+    }
+    write_batch(count);
+    fflush(_file ? _file : stderr);
+}
+
+static void *writer_fnc(void *ptr)
+{
+    while (_writer_run.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&_mutex);
+        drain();
+        pthread_mutex_unlock(&_mutex);
+
+        struct timespec ts = { 0, LOG_WRITER_PERIOD_MS * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+static void ring_release(void *ptr)
+{
+    // thread exit; writer frees the ring once it is drained
+    log_ring_t *ring = (log_ring_t *)ptr;
+    ring->dead.store(true, std::memory_order_release);
+}
+
+static void log_stop()
+{
+    _writer_run = false;
+    pthread_join(_writer, NULL);
+    pthread_mutex_lock(&_mutex);
+    drain();
+    pthread_mutex_unlock(&_mutex);
+}
+
+static void log_init()
+{
+    _start_ns = log_now_ns();
+    pthread_key_create(&_key, ring_release);
+    _writer_run = true;
+    if (pthread_create(&_writer, NULL, writer_fnc, NULL) == 0) {
+        atexit(log_stop);
+    } else {
+        _writer_run = false;
+    }
+}
+
+static log_ring_t *get_ring()
+{
+    if (t_ring) {
+        return t_ring;
+    }
+    pthread_once(&_once, log_init);
+    log_ring_t *ring = new log_ring_t();
+    pthread_mutex_lock(&_mutex);
+    ring->next = _rings;
+    _rings = ring;
+    pthread_mutex_unlock(&_mutex);
+    pthread_setspecific(_key, ring);
+    t_ring = ring;
+    return ring;
+}
+
+static log_record_t *ring_reserve(log_ring_t *ring, int level)
+{
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail >= SC_LOG_RING_SIZE) {
+        if (level < SC_LOG_LEVEL_ERR) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        // errors are never lost, write out the backlog in place of the
+        // writer thread; the order with earlier records is kept
+        pthread_mutex_lock(&_mutex);
+        drain();
+        pthread_mutex_unlock(&_mutex);
+    }
+    return &ring->records[head % SC_LOG_RING_SIZE];
+}
+
+static void ring_commit(log_ring_t *ring)
+{
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void scard_log(int level, const char *func, int line, const char *fmt, ...)
+{
+    log_ring_t *ring = get_ring();
+    log_record_t *rec = ring_reserve(ring, level);
+    if (! rec) {
+        return;
+    }
+    rec->ts_ns = log_now_ns();
+    rec->func = func;
+    rec->tag = nullptr;
+    rec->line = line;
+    rec->level = level;
+    rec->hex = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(rec->data, LOG_DATA_LEN, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= LOG_DATA_LEN) {
+        // truncated, keep the line ending
+        len = LOG_DATA_LEN - 1;
+        rec->data[len - 1] = '\n';
+    }
+    rec->len = len;
+    ring_commit(ring);
+}
+
+void scard_log_hex(int level, const char *func, int line, const char *tag, const void *data, unsigned len)
+{
+    log_ring_t *ring = get_ring();
+    log_record_t *rec = ring_reserve(ring, level);
+    if (! rec) {
+        return;
+    }
+    if (len > LOG_DATA_LEN) {
+        len = LOG_DATA_LEN;
+    }
+    rec->ts_ns = log_now_ns();
+    rec->func = func;
+    rec->tag = tag;
+    rec->line = line;
+    rec->level = level;
+    rec->hex = 1;
+    rec->len = len;
+    memcpy(rec->data, data, len);
+    ring_commit(ring);
+}
+
+void scard_log_flush()
+{
+    pthread_once(&_once, log_init);
+    pthread_mutex_lock(&_mutex);
+    drain();
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_log_set_file(FILE *file)
+{
+    pthread_mutex_lock(&_mutex);
+    _file = file;
+    pthread_mutex_unlock(&_mutex);
+}
+
+unsigned long scard_log_dropped()
+{
+    pthread_mutex_lock(&_mutex);
+    unsigned long rv = _dropped;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
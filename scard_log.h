@@ -0,0 +1,67 @@
+/**
+ *
+ */
+
+#ifndef SCARD_LOG_H_
+#define SCARD_LOG_H_
+
+#include <stdio.h>
+
+// log levels; anything below SC_LOG_LEVEL is compiled out
+#define SC_LOG_LEVEL_TRC                0
+#define SC_LOG_LEVEL_DBG                1
+#define SC_LOG_LEVEL_INF                2
+#define SC_LOG_LEVEL_ERR                3
+#define SC_LOG_LEVEL_NONE               4
+
+// lines are formatted by the caller, keep TRC and DBG out of regular builds
+#ifndef SC_LOG_LEVEL
+#define SC_LOG_LEVEL                    SC_LOG_LEVEL_INF
+#endif
+
+// records a thread can queue before the writer has to catch up
+#define SC_LOG_RING_SIZE                256
+
+// records are queued in a per thread ring and written out by a background
+// thread, the caller never blocks on I/O; when a ring is full the record is
+// dropped, except for ERR which waits for the ring to be written out
+void scard_log(int level, const char *func, int line, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+// binary payload, hex formatted by the writer thread
+void scard_log_hex(int level, const char *func, int line, const char *tag, const void *data, unsigned len);
+// write out everything queued so far
+void scard_log_flush();
+// defaults to stderr
+void scard_log_set_file(FILE *file);
+unsigned long scard_log_dropped();
+
+// formated logging
+#define _LOG(level, ...) scard_log(level, __func__, __LINE__, __VA_ARGS__)
+#define _LOG_HEX(level, tag, data, len) scard_log_hex(level, __func__, __LINE__, tag, data, len)
+
+#if SC_LOG_LEVEL <= SC_LOG_LEVEL_TRC
+#define TRC(...) _LOG(SC_LOG_LEVEL_TRC, __VA_ARGS__)
+#else
+#define TRC(...) do { } while (0)
+#endif
+
+#if SC_LOG_LEVEL <= SC_LOG_LEVEL_DBG
+#define DBG(...) _LOG(SC_LOG_LEVEL_DBG, __VA_ARGS__)
+#define DBG_HEX(tag, data, len) _LOG_HEX(SC_LOG_LEVEL_DBG, tag, data, len)
+#else
+#define DBG(...) do { } while (0)
+#define DBG_HEX(tag, data, len) do { } while (0)
+#endif
+
+#if SC_LOG_LEVEL <= SC_LOG_LEVEL_INF
+#define INF(...) _LOG(SC_LOG_LEVEL_INF, __VA_ARGS__)
+#else
+#define INF(...) do { } while (0)
+#endif
+
+#if SC_LOG_LEVEL <= SC_LOG_LEVEL_ERR
+#define ERR(...) _LOG(SC_LOG_LEVEL_ERR, __VA_ARGS__)
+#else
+#define ERR(...) do { } while (0)
+#endif
+
+#endif // SCARD_LOG_H_
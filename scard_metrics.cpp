@@ -0,0 +1,531 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_metrics.h"
+
+#include <errno.h>
+
+static const char *apdu_names[SC_NUM_APDUS] = {
+    "GET_READER_INFO",
+    "SELECT_CARD_TYPE",
+    "READ_ERROR_COUNTER",
+    "READ_MEMORY",
+    "READ_PROTECTION",
+    "PRESENT_CODE",
+    "CHANGE_CODE",
+    "WRITE_MEMORY",
+    "OTHER"
+};
+
+static const char *timer_names[SC_NUM_TIMERS] = {
+    "INSERT_TO_READY",
+    "UPDATE_TO_WRITTEN",
+    "JOURNAL_SYNC",
+    "PROVISION",
+    "INSERT_TO_AUDITED"
+};
+
+static_assert(SC_NUM_CMDS <= SC_METRICS_MAX_COMMANDS, "command metrics too small");
+static_assert(SC_NUM_CMD_STATUS <= SC_METRICS_MAX_CMD_STATUS, "command status metrics too small");
+static_assert(SC_NUM_ERRORS <= SC_METRICS_MAX_ERRORS, "error metrics too small");
+
+// Prometheus name and help text
+typedef struct {
+    const char *name;
+    const char *help;
+} metric_info_t;
+
+static const metric_info_t counter_info[SC_NUM_COUNTERS] = {
+    { "scard_card_inserts_total", "Card inserts seen by the monitor, one card session each." },
+    { "scard_cards_ready_total", "Cards that got as far as the PIN being accepted." },
+    { "scard_card_writes_total", "User data written to a card and verified." }
+};
+
+static const metric_info_t gauge_info[SC_NUM_GAUGES] = {
+    { "scard_readers", "Readers attached." },
+    { "scard_cards_present", "Readers with a card in them." },
+    { "scard_cards_ready", "Cards ready for commands." }
+};
+
+// counts of one status word, claimed by the first APDU that returns it
+typedef struct {
+    // SW + 1, 0 while the entry is free
+    std::atomic<uint32_t> key;
+    std::atomic<uint64_t> count;
+} sw_counter_t;
+
+static scard_histogram_t _apdus[SC_NUM_APDUS];
+static scard_histogram_t _timers[SC_NUM_TIMERS];
+static scard_histogram_t _states[SC_METRICS_MAX_STATES];
+static sw_counter_t _apdu_sw[SC_NUM_APDUS][SC_METRICS_MAX_SW];
+static std::atomic<uint64_t> _apdu_sw_other[SC_NUM_APDUS];
+static std::atomic<uint64_t> _counters[SC_NUM_COUNTERS];
+static std::atomic<int64_t> _gauges[SC_NUM_GAUGES];
+static std::atomic<uint64_t> _commands[SC_METRICS_MAX_COMMANDS][SC_METRICS_MAX_CMD_STATUS];
+static std::atomic<uint64_t> _card_errors[SC_METRICS_MAX_ERRORS];
+static std::atomic<uint64_t> _pin_retries[SC_METRICS_MAX_PIN_RETRIES + 1];
+
+// periodic dump
+static pthread_mutex_t _dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _dump_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _dump_thread;
+static bool _dump_running = false;
+static unsigned _dump_interval = 0;
+
+static unsigned bucket_index(uint64_t value)
+{
+    if (value < SC_HIST_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned bits = 63 - __builtin_clzll(value);
+    if (bits >= SC_HIST_MAX_BITS) {
+        return SC_HIST_BUCKETS - 1;
+    }
+    unsigned shift = bits - SC_HIST_SUB_BITS;
+    unsigned sub = (value >> shift) - SC_HIST_SUB_BUCKETS;
+    return (shift + 1) * SC_HIST_SUB_BUCKETS + sub;
+}
+
+// highest value that lands in the bucket
+static uint64_t bucket_value(unsigned index)
+{
+    unsigned group = index / SC_HIST_SUB_BUCKETS;
+    uint64_t sub = index % SC_HIST_SUB_BUCKETS;
+    if (group == 0) {
+        return sub;
+    }
+    return ((SC_HIST_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+void scard_histogram_reset(scard_histogram_t *hist)
+{
+    hist->count.store(0, std::memory_order_relaxed);
+    hist->sum_ns.store(0, std::memory_order_relaxed);
+    hist->min_ns.store(0, std::memory_order_relaxed);
+    hist->max_ns.store(0, std::memory_order_relaxed);
+    for (unsigned i = 0; i < SC_HIST_BUCKETS; i++) {
+        hist->buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void scard_histogram_record(scard_histogram_t *hist, uint64_t value_ns)
+{
+    hist->buckets[bucket_index(value_ns)].fetch_add(1, std::memory_order_relaxed);
+    hist->count.fetch_add(1, std::memory_order_relaxed);
+    hist->sum_ns.fetch_add(value_ns, std::memory_order_relaxed);
+
+    // minimum is kept off by one so that 0 can mean no samples
+    uint64_t cur = hist->min_ns.load(std::memory_order_relaxed);
+    while ((cur == 0 || value_ns + 1 < cur)
+        && ! hist->min_ns.compare_exchange_weak(cur, value_ns + 1, std::memory_order_relaxed)) {
+    }
+    cur = hist->max_ns.load(std::memory_order_relaxed);
+    while (value_ns > cur
+        && ! hist->max_ns.compare_exchange_weak(cur, value_ns, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t scard_histogram_percentile(const scard_histogram_t *hist, double fraction)
+{
+    // counts may move while we walk them, the result is approximate anyway
+    uint64_t total = 0;
+    for (unsigned i = 0; i < SC_HIST_BUCKETS; i++) {
+        total += hist->buckets[i].load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    uint64_t max_ns = hist->max_ns.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < SC_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return (value < max_ns) ? value : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+void scard_histogram_summary(const scard_histogram_t *hist, scard_histogram_summary_t *summary)
+{
+    summary->count = hist->count.load(std::memory_order_relaxed);
+    uint64_t min_ns = hist->min_ns.load(std::memory_order_relaxed);
+    summary->min_ns = min_ns ? min_ns - 1 : 0;
+    summary->mean_ns = summary->count ? hist->sum_ns.load(std::memory_order_relaxed) / summary->count : 0;
+    summary->p50_ns = scard_histogram_percentile(hist, 0.50);
+    summary->p90_ns = scard_histogram_percentile(hist, 0.90);
+    summary->p99_ns = scard_histogram_percentile(hist, 0.99);
+    summary->max_ns = hist->max_ns.load(std::memory_order_relaxed);
+}
+
+static scard_apdu_metric_t apdu_metric(uint8_t ins)
+{
+    switch (ins) {
+    case 0x09: return SC_APDU_GET_READER_INFO;
+    case 0xA4: return SC_APDU_SELECT_CARD_TYPE;
+    case 0xB1: return SC_APDU_READ_ERROR_COUNTER;
+    case 0xB0: return SC_APDU_READ_MEMORY;
+    case 0xB2: return SC_APDU_READ_PROTECTION;
+    case 0x20: return SC_APDU_PRESENT_CODE;
+    case 0xD2: return SC_APDU_CHANGE_CODE;
+    case 0xD0: return SC_APDU_WRITE_MEMORY;
+    default: return SC_APDU_OTHER;
+    }
+}
+
+void scard_metrics_apdu(uint8_t ins, uint64_t duration_ns)
+{
+    scard_histogram_record(&_apdus[apdu_metric(ins)], duration_ns);
+}
+
+void scard_metrics_apdu_status(uint8_t ins, uint16_t sw)
+{
+    scard_apdu_metric_t apdu = apdu_metric(ins);
+    uint32_t key = (uint32_t)sw + 1;
+    // a handful of status words per APDU in practice, the scan stays short
+    for (unsigned i = 0; i < SC_METRICS_MAX_SW; i++) {
+        sw_counter_t *entry = &_apdu_sw[apdu][i];
+        uint32_t cur = entry->key.load(std::memory_order_acquire);
+        if (cur == 0) {
+            // lost the race if someone claimed it first, cur is then theirs
+            entry->key.compare_exchange_strong(cur, key, std::memory_order_acq_rel);
+            if (cur == 0) {
+                cur = key;
+            }
+        }
+        if (cur == key) {
+            entry->count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    _apdu_sw_other[apdu].fetch_add(1, std::memory_order_relaxed);
+}
+
+void scard_metrics_timer(scard_timer_metric_t timer, uint64_t duration_ns)
+{
+    assert(timer < SC_NUM_TIMERS);
+    scard_histogram_record(&_timers[timer], duration_ns);
+}
+
+void scard_metrics_state(unsigned state, uint64_t duration_ns)
+{
+    assert(state < SC_METRICS_MAX_STATES);
+    scard_histogram_record(&_states[state], duration_ns);
+}
+
+void scard_metrics_count(scard_counter_metric_t counter)
+{
+    assert(counter < SC_NUM_COUNTERS);
+    _counters[counter].fetch_add(1, std::memory_order_relaxed);
+}
+
+void scard_metrics_gauge(scard_gauge_metric_t gauge, int64_t value)
+{
+    assert(gauge < SC_NUM_GAUGES);
+    _gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void scard_metrics_command(unsigned type, unsigned status)
+{
+    assert(type < SC_METRICS_MAX_COMMANDS && status < SC_METRICS_MAX_CMD_STATUS);
+    _commands[type][status].fetch_add(1, std::memory_order_relaxed);
+}
+
+void scard_metrics_card_error(unsigned error_class)
+{
+    assert(error_class < SC_METRICS_MAX_ERRORS);
+    _card_errors[error_class].fetch_add(1, std::memory_order_relaxed);
+}
+
+void scard_metrics_pin_retries(unsigned left)
+{
+    if (left > SC_METRICS_MAX_PIN_RETRIES) {
+        left = SC_METRICS_MAX_PIN_RETRIES;
+    }
+    _pin_retries[left].fetch_add(1, std::memory_order_relaxed);
+}
+
+const char *scard_metrics_apdu_name(scard_apdu_metric_t apdu)
+{
+    assert(apdu < SC_NUM_APDUS);
+    return apdu_names[apdu];
+}
+
+const char *scard_metrics_timer_name(scard_timer_metric_t timer)
+{
+    assert(timer < SC_NUM_TIMERS);
+    return timer_names[timer];
+}
+
+void scard_metrics_get_apdu(scard_apdu_metric_t apdu, scard_histogram_summary_t *summary)
+{
+    assert(apdu < SC_NUM_APDUS);
+    scard_histogram_summary(&_apdus[apdu], summary);
+}
+
+void scard_metrics_get_timer(scard_timer_metric_t timer, scard_histogram_summary_t *summary)
+{
+    assert(timer < SC_NUM_TIMERS);
+    scard_histogram_summary(&_timers[timer], summary);
+}
+
+void scard_metrics_get_state(unsigned state, scard_histogram_summary_t *summary)
+{
+    assert(state < SC_METRICS_MAX_STATES);
+    scard_histogram_summary(&_states[state], summary);
+}
+
+void scard_metrics_reset()
+{
+    for (unsigned i = 0; i < SC_NUM_APDUS; i++) {
+        scard_histogram_reset(&_apdus[i]);
+    }
+    for (unsigned i = 0; i < SC_NUM_TIMERS; i++) {
+        scard_histogram_reset(&_timers[i]);
+    }
+    for (unsigned i = 0; i < SC_METRICS_MAX_STATES; i++) {
+        scard_histogram_reset(&_states[i]);
+    }
+    for (unsigned i = 0; i < SC_NUM_APDUS; i++) {
+        for (unsigned j = 0; j < SC_METRICS_MAX_SW; j++) {
+            _apdu_sw[i][j].key.store(0, std::memory_order_relaxed);
+            _apdu_sw[i][j].count.store(0, std::memory_order_relaxed);
+        }
+        _apdu_sw_other[i].store(0, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < SC_NUM_COUNTERS; i++) {
+        _counters[i].store(0, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < SC_METRICS_MAX_COMMANDS; i++) {
+        for (unsigned j = 0; j < SC_METRICS_MAX_CMD_STATUS; j++) {
+            _commands[i][j].store(0, std::memory_order_relaxed);
+        }
+    }
+    for (unsigned i = 0; i < SC_METRICS_MAX_ERRORS; i++) {
+        _card_errors[i].store(0, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i <= SC_METRICS_MAX_PIN_RETRIES; i++) {
+        _pin_retries[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+static bool format_line(char *buf, size_t len, const char *kind, const char *name, const scard_histogram_t *hist)
+{
+    scard_histogram_summary_t s;
+    scard_histogram_summary(hist, &s);
+    if (s.count == 0) {
+        return false;
+    }
+    snprintf(buf, len, "%-5s %-20s n=%-8lu min=%-8.1f mean=%-8.1f p50=%-8.1f p90=%-8.1f p99=%-8.1f max=%.1f us\n",
+        kind, name, (unsigned long)s.count, s.min_ns / 1e3, s.mean_ns / 1e3,
+        s.p50_ns / 1e3, s.p90_ns / 1e3, s.p99_ns / 1e3, s.max_ns / 1e3);
+    return true;
+}
+
+// calls out() for every non-empty histogram
+static void dump_lines(void (*out)(const char *line, void *arg), void *arg)
+{
+    char line[256];
+    for (unsigned i = 0; i < SC_NUM_APDUS; i++) {
+        if (format_line(line, sizeof(line), "apdu", apdu_names[i], &_apdus[i])) {
+            out(line, arg);
+        }
+    }
+    for (unsigned i = 0; i < SC_NUM_TIMERS; i++) {
+        if (format_line(line, sizeof(line), "timer", timer_names[i], &_timers[i])) {
+            out(line, arg);
+        }
+    }
+    for (unsigned i = 0; i < SC_METRICS_MAX_STATES; i++) {
+        if (format_line(line, sizeof(line), "state", scard_state_name(i), &_states[i])) {
+            out(line, arg);
+        }
+    }
+}
+
+static void out_file(const char *line, void *arg)
+{
+    fputs(line, (FILE *)arg);
+}
+
+static void out_log(const char *line, void *arg)
+{
+    _UNUSED(arg);
+    INF("%s", line);
+}
+
+void scard_metrics_dump(FILE *file)
+{
+    dump_lines(out_file, file);
+}
+
+// bucket bounds of the exported latency histograms, in seconds
+static const double prom_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300
+};
+
+static void prom_family(FILE *file, const char *name, const char *type, const char *help)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// the HDR buckets are folded into the fixed bounds above; a bucket that
+// straddles a bound counts towards the next one, within the ~6% precision
+static void prom_histogram(FILE *file, const char *name, const char *label, const char *value,
+    const scard_histogram_t *hist)
+{
+    uint64_t buckets[SC_HIST_BUCKETS];
+    uint64_t count = 0;
+    for (unsigned i = 0; i < SC_HIST_BUCKETS; i++) {
+        buckets[i] = hist->buckets[i].load(std::memory_order_relaxed);
+        count += buckets[i];
+    }
+    if (count == 0) {
+        return;
+    }
+    uint64_t seen = 0;
+    unsigned i = 0;
+    for (unsigned b = 0; b < sizeof(prom_bounds) / sizeof(prom_bounds[0]); b++) {
+        uint64_t bound_ns = (uint64_t)(prom_bounds[b] * 1e9);
+        while (i < SC_HIST_BUCKETS && bucket_value(i) <= bound_ns) {
+            seen += buckets[i++];
+        }
+        fprintf(file, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", name, label, value, prom_bounds[b],
+            (unsigned long)seen);
+    }
+    fprintf(file, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", name, label, value, (unsigned long)count);
+    fprintf(file, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value,
+        hist->sum_ns.load(std::memory_order_relaxed) / 1e9);
+    fprintf(file, "%s_count{%s=\"%s\"} %lu\n", name, label, value, (unsigned long)count);
+}
+
+void scard_metrics_write_prometheus(FILE *file)
+{
+    for (unsigned i = 0; i < SC_NUM_COUNTERS; i++) {
+        prom_family(file, counter_info[i].name, "counter", counter_info[i].help);
+        fprintf(file, "%s %lu\n", counter_info[i].name,
+            (unsigned long)_counters[i].load(std::memory_order_relaxed));
+    }
+    for (unsigned i = 0; i < SC_NUM_GAUGES; i++) {
+        prom_family(file, gauge_info[i].name, "gauge", gauge_info[i].help);
+        fprintf(file, "%s %ld\n", gauge_info[i].name, (long)_gauges[i].load(std::memory_order_relaxed));
+    }
+
+    prom_family(file, "scard_apdu_status_total", "counter",
+        "APDUs by instruction and status word, sw=\"error\" for a failed transmit.");
+    for (unsigned i = 0; i < SC_NUM_APDUS; i++) {
+        for (unsigned j = 0; j < SC_METRICS_MAX_SW; j++) {
+            uint32_t key = _apdu_sw[i][j].key.load(std::memory_order_acquire);
+            if (key == 0) {
+                break;
+            }
+            char sw[12];
+            if (key == 1) {
+                strcpy(sw, "error");
+            } else {
+                snprintf(sw, sizeof(sw), "%04X", key - 1);
+            }
+            fprintf(file, "scard_apdu_status_total{apdu=\"%s\",sw=\"%s\"} %lu\n", apdu_names[i], sw,
+                (unsigned long)_apdu_sw[i][j].count.load(std::memory_order_relaxed));
+        }
+        uint64_t other = _apdu_sw_other[i].load(std::memory_order_relaxed);
+        if (other) {
+            fprintf(file, "scard_apdu_status_total{apdu=\"%s\",sw=\"other\"} %lu\n", apdu_names[i],
+                (unsigned long)other);
+        }
+    }
+
+    prom_family(file, "scard_commands_total", "counter", "Commands by type and final status.");
+    for (unsigned i = 0; i < SC_NUM_CMDS; i++) {
+        for (unsigned j = 0; j < SC_NUM_CMD_STATUS; j++) {
+            uint64_t count = _commands[i][j].load(std::memory_order_relaxed);
+            if (count) {
+                fprintf(file, "scard_commands_total{command=\"%s\",status=\"%s\"} %lu\n",
+                    scard_command_name(i), scard_command_status_name(j), (unsigned long)count);
+            }
+        }
+    }
+
+    prom_family(file, "scard_card_errors_total", "counter", "Failed card operations by error class.");
+    for (unsigned i = 0; i < SC_NUM_ERRORS; i++) {
+        fprintf(file, "scard_card_errors_total{class=\"%s\"} %lu\n", scard_error_class_name(i),
+            (unsigned long)_card_errors[i].load(std::memory_order_relaxed));
+    }
+
+    prom_family(file, "scard_pin_retries", "histogram", "PIN attempts left on the inserted cards.");
+    uint64_t seen = 0;
+    uint64_t sum = 0;
+    for (unsigned i = 0; i <= SC_METRICS_MAX_PIN_RETRIES; i++) {
+        uint64_t count = _pin_retries[i].load(std::memory_order_relaxed);
+        seen += count;
+        sum += count * i;
+        fprintf(file, "scard_pin_retries_bucket{le=\"%u\"} %lu\n", i, (unsigned long)seen);
+    }
+    fprintf(file, "scard_pin_retries_bucket{le=\"+Inf\"} %lu\n", (unsigned long)seen);
+    fprintf(file, "scard_pin_retries_sum %lu\n", (unsigned long)sum);
+    fprintf(file, "scard_pin_retries_count %lu\n", (unsigned long)seen);
+
+    prom_family(file, "scard_apdu_duration_seconds", "histogram", "APDU round trip by instruction.");
+    for (unsigned i = 0; i < SC_NUM_APDUS; i++) {
+        prom_histogram(file, "scard_apdu_duration_seconds", "apdu", apdu_names[i], &_apdus[i]);
+    }
+    prom_family(file, "scard_timer_duration_seconds", "histogram",
+        "Session timers, e.g. INSERT_TO_READY from card insert to a usable card.");
+    for (unsigned i = 0; i < SC_NUM_TIMERS; i++) {
+        prom_histogram(file, "scard_timer_duration_seconds", "timer", timer_names[i], &_timers[i]);
+    }
+    prom_family(file, "scard_state_duration_seconds", "histogram", "Time in one session FSM state handler.");
+    for (unsigned i = 0; i < SC_METRICS_MAX_STATES; i++) {
+        prom_histogram(file, "scard_state_duration_seconds", "state", scard_state_name(i), &_states[i]);
+    }
+}
+
+static void *dump_fnc(void *ptr)
+{
+    pthread_mutex_lock(&_dump_mutex);
+    while (_dump_interval) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += _dump_interval;
+        if (pthread_cond_timedwait(&_dump_cond, &_dump_mutex, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&_dump_mutex);
+            dump_lines(out_log, NULL);
+            pthread_mutex_lock(&_dump_mutex);
+        }
+    }
+    pthread_mutex_unlock(&_dump_mutex);
+    return 0;
+}
+
+void scard_metrics_set_dump_interval(unsigned seconds)
+{
+    pthread_mutex_lock(&_dump_mutex);
+    _dump_interval = seconds;
+    pthread_cond_signal(&_dump_cond);
+    bool join = (seconds == 0 && _dump_running);
+    if (seconds && ! _dump_running) {
+        int rv = pthread_create(&_dump_thread, NULL, dump_fnc, NULL);
+        if (rv) {
+            ERR("Error - pthread_create() return code: %d\n", rv);
+            _dump_interval = 0;
+        } else {
+            _dump_running = true;
+        }
+    }
+    if (join) {
+        _dump_running = false;
+    }
+    pthread_mutex_unlock(&_dump_mutex);
+    if (join) {
+        pthread_join(_dump_thread, NULL);
+    }
+}
@@ -0,0 +1,129 @@
+/**
+ *
+ */
+
+#ifndef SCARD_METRICS_H_
+#define SCARD_METRICS_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+// log-linear (HDR style) latency histogram in nanoseconds; every power of two
+// is split into 16 linear sub-buckets, giving ~6% precision up to ~18 minutes
+#define SC_HIST_SUB_BITS                4
+#define SC_HIST_SUB_BUCKETS             (1 << SC_HIST_SUB_BITS)
+#define SC_HIST_MAX_BITS                40
+#define SC_HIST_BUCKETS                 ((SC_HIST_MAX_BITS - SC_HIST_SUB_BITS + 1) * SC_HIST_SUB_BUCKETS)
+
+// recording is lock free, any number of threads may record at the same time
+typedef struct {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> min_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[SC_HIST_BUCKETS];
+} scard_histogram_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} scard_histogram_summary_t;
+
+void scard_histogram_reset(scard_histogram_t *hist);
+void scard_histogram_record(scard_histogram_t *hist, uint64_t value_ns);
+// value below which the given fraction (0.0 - 1.0) of the samples fall
+uint64_t scard_histogram_percentile(const scard_histogram_t *hist, double fraction);
+void scard_histogram_summary(const scard_histogram_t *hist, scard_histogram_summary_t *summary);
+
+// APDU latency, keyed by the ACR38 instruction byte
+typedef enum {
+    SC_APDU_GET_READER_INFO,            // FF 09
+    SC_APDU_SELECT_CARD_TYPE,           // FF A4
+    SC_APDU_READ_ERROR_COUNTER,         // FF B1
+    SC_APDU_READ_MEMORY,                // FF B0
+    SC_APDU_READ_PROTECTION,            // FF B2
+    SC_APDU_PRESENT_CODE,               // FF 20
+    SC_APDU_CHANGE_CODE,                // FF D2
+    SC_APDU_WRITE_MEMORY,               // FF D0
+    SC_APDU_OTHER,
+    SC_NUM_APDUS
+} scard_apdu_metric_t;
+
+// session timers
+typedef enum {
+    // card insert seen by the monitor until the card is ready for the user
+    SC_TIMER_INSERT_TO_READY,
+    // command submitted until its data is on the card
+    SC_TIMER_UPDATE_TO_WRITTEN,
+    // one group commit of the transaction journal
+    SC_TIMER_JOURNAL_SYNC,
+    // blank card from set PIN until the read back matched
+    SC_TIMER_PROVISION,
+    // card insert until the card is exported in audit mode
+    SC_TIMER_INSERT_TO_AUDITED,
+    SC_NUM_TIMERS
+} scard_timer_metric_t;
+
+// time spent in one FSM state handler, indexed by the session state
+#define SC_METRICS_MAX_STATES           16
+// status words told apart per APDU, the rest is counted as other
+#define SC_METRICS_MAX_SW               16
+// keyed counters, sized for scard_command_type_t, scard_command_status_t
+// and scard_error_class_t
+#define SC_METRICS_MAX_COMMANDS         8
+#define SC_METRICS_MAX_CMD_STATUS       16
+#define SC_METRICS_MAX_ERRORS           8
+// PIN attempts left on an inserted card, 0..3 on SLE4442
+#define SC_METRICS_MAX_PIN_RETRIES      3
+
+// event counters, only ever go up
+typedef enum {
+    // card inserts seen by the monitor, one card session each
+    SC_COUNTER_CARD_INSERTS,
+    // cards that got as far as the PIN being accepted
+    SC_COUNTER_CARDS_READY,
+    // user data written and verified
+    SC_COUNTER_CARD_WRITES,
+    SC_NUM_COUNTERS
+} scard_counter_metric_t;
+
+// current values, set by whoever owns them
+typedef enum {
+    SC_GAUGE_READERS,
+    SC_GAUGE_CARDS_PRESENT,
+    SC_GAUGE_CARDS_READY,
+    SC_NUM_GAUGES
+} scard_gauge_metric_t;
+
+void scard_metrics_apdu(uint8_t ins, uint64_t duration_ns);
+// sw is SW1 << 8 | SW2, 0 for a failed transmit
+void scard_metrics_apdu_status(uint8_t ins, uint16_t sw);
+void scard_metrics_timer(scard_timer_metric_t timer, uint64_t duration_ns);
+void scard_metrics_state(unsigned state, uint64_t duration_ns);
+void scard_metrics_count(scard_counter_metric_t counter);
+void scard_metrics_gauge(scard_gauge_metric_t gauge, int64_t value);
+void scard_metrics_command(unsigned type, unsigned status);
+void scard_metrics_card_error(unsigned error_class);
+void scard_metrics_pin_retries(unsigned left);
+
+const char *scard_metrics_apdu_name(scard_apdu_metric_t apdu);
+const char *scard_metrics_timer_name(scard_timer_metric_t timer);
+void scard_metrics_get_apdu(scard_apdu_metric_t apdu, scard_histogram_summary_t *summary);
+void scard_metrics_get_timer(scard_timer_metric_t timer, scard_histogram_summary_t *summary);
+void scard_metrics_get_state(unsigned state, scard_histogram_summary_t *summary);
+void scard_metrics_reset();
+
+// one line per non-empty histogram
+void scard_metrics_dump(FILE *file);
+// everything in the Prometheus text exposition format
+void scard_metrics_write_prometheus(FILE *file);
+// dumps to the log every interval seconds, 0 stops
+void scard_metrics_set_dump_interval(unsigned seconds);
+
+#endif // SCARD_METRICS_H_
@@ -0,0 +1,683 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+
+#include <errno.h>
+#include <time.h>
+
+// emulates ACR38 readers with SLE4442 cards, see
+// REF-ACR38x-CCID-6.05.pdf and the SLE4442 datasheet
+
+#define MOCK_PNP_READER                 "\\\\?PnP?\\Notification"
+#define MOCK_MAX_CONTEXTS               32
+#define MOCK_MAX_HANDLES                32
+#define MOCK_FIRMWARE                   "ACR38U-MCK"
+// TS 3B, T0 04 and the 4 byte header at the start of the memory as the
+// historical bytes, what the ACR38 reports for an SLE4442
+#define MOCK_ATR_LEN                    6
+
+typedef struct {
+    bool attached;
+    bool present;
+    // insert/remove counter, reported in the upper 16 bits of the event state
+    unsigned events;
+    // bumped on every insert, stale handles get SCARD_W_REMOVED_CARD
+    unsigned generation;
+    BYTE selected_card;
+    char name[SC_MAX_READERNAME_LEN+1];
+
+    // SLE4442 card
+    BYTE memory[SC_MOCK_MEMORY_LEN];
+    // protection bits for the first 32 bytes, 1 means writable
+    BYTE protection[4];
+    BYTE psc[3];
+    BYTE error_counter;
+    bool unlocked;
+
+    // injected transmit failures
+    unsigned fail_count;
+    LONG fail_rv;
+} mock_reader_t;
+
+typedef struct {
+    bool used;
+    unsigned cancel_seq;
+} mock_context_t;
+
+typedef struct {
+    bool used;
+    unsigned reader;
+    unsigned generation;
+} mock_handle_t;
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+static bool _configured = false;
+static scard_mock_config_t _config;
+static mock_reader_t _readers[SC_MOCK_MAX_READERS];
+static mock_context_t _contexts[MOCK_MAX_CONTEXTS];
+static mock_handle_t _handles[MOCK_MAX_HANDLES];
+static unsigned long _apdu_count;
+static unsigned long _eeprom_writes;
+
+void scard_mock_default_config(scard_mock_config_t *config)
+{
+    memset(config, 0, sizeof(scard_mock_config_t));
+    config->readers = 1;
+    // USB round trip of the ACR38
+    config->apdu_latency_us = 1000;
+    config->byte_latency_us = 10;
+    // SLE4442 erase and write cycle
+    config->eeprom_write_us = 2500;
+    config->max_send = 128;
+    config->max_recv = 128;
+}
+
+static void mock_reset_reader(unsigned idx)
+{
+    mock_reader_t *reader = &_readers[idx];
+    memset(reader, 0, sizeof(mock_reader_t));
+    snprintf(reader->name, sizeof(reader->name), "Mock ACR38U %02u 00", idx);
+}
+
+static void mock_configure(const scard_mock_config_t *config)
+{
+    _config = *config;
+    if (_config.readers > SC_MOCK_MAX_READERS) {
+        _config.readers = SC_MOCK_MAX_READERS;
+    }
+    for (unsigned i = 0; i < SC_MOCK_MAX_READERS; i++) {
+        mock_reset_reader(i);
+        _readers[i].attached = (i < _config.readers);
+    }
+    _apdu_count = 0;
+    _eeprom_writes = 0;
+    _configured = true;
+}
+
+void scard_mock_configure(const scard_mock_config_t *config)
+{
+    pthread_mutex_lock(&_mutex);
+    mock_configure(config);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_mock_attach_reader(unsigned reader, bool attached)
+{
+    assert(reader < SC_MOCK_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    mock_reset_reader(reader);
+    _readers[reader].attached = attached;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_mock_insert_card(unsigned reader, const BYTE *memory, const BYTE *psc)
+{
+    assert(reader < SC_MOCK_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    mock_reader_t *r = &_readers[reader];
+    if (memory) {
+        memcpy(r->memory, memory, SC_MOCK_MEMORY_LEN);
+    } else {
+        // blank card; only the ATR header is programmed and locked
+        memset(r->memory, 0xFF, SC_MOCK_MEMORY_LEN);
+        r->memory[0] = 0xA2;
+        r->memory[1] = 0x13;
+        r->memory[2] = 0x10;
+        r->memory[3] = 0x91;
+    }
+    memset(r->protection, 0xFF, sizeof(r->protection));
+    r->protection[0] = 0xF0;
+    if (psc) {
+        memcpy(r->psc, psc, sizeof(r->psc));
+    } else {
+        memset(r->psc, 0xFF, sizeof(r->psc));
+    }
+    r->error_counter = 0x07;
+    r->unlocked = false;
+    r->present = true;
+    r->events++;
+    r->generation++;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_mock_remove_card(unsigned reader)
+{
+    assert(reader < SC_MOCK_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    mock_reader_t *r = &_readers[reader];
+    if (r->present) {
+        r->present = false;
+        r->unlocked = false;
+        r->events++;
+    }
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void scard_mock_fail_transmit(unsigned reader, unsigned count, LONG rv)
+{
+    assert(reader < SC_MOCK_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    _readers[reader].fail_count = count;
+    _readers[reader].fail_rv = rv;
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool scard_mock_card_memory(unsigned reader, LPBYTE memory)
+{
+    assert(reader < SC_MOCK_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    bool rv = _readers[reader].present;
+    if (rv) {
+        memcpy(memory, _readers[reader].memory, SC_MOCK_MEMORY_LEN);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+unsigned long scard_mock_apdu_count()
+{
+    pthread_mutex_lock(&_mutex);
+    unsigned long rv = _apdu_count;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+unsigned long scard_mock_eeprom_writes()
+{
+    pthread_mutex_lock(&_mutex);
+    unsigned long rv = _eeprom_writes;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static void mock_delay(unsigned long usec)
+{
+    if (usec == 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+static mock_context_t *mock_context(SCARDCONTEXT context)
+{
+    if (context <= 0 || context > MOCK_MAX_CONTEXTS) {
+        return nullptr;
+    }
+    mock_context_t *ctx = &_contexts[context - 1];
+    return ctx->used ? ctx : nullptr;
+}
+
+// caller holds the lock
+static DWORD mock_atr(const mock_reader_t *r, LPBYTE atr)
+{
+    atr[0] = 0x3B;
+    atr[1] = 0x04;
+    memcpy(atr + 2, r->memory, 4);
+    return MOCK_ATR_LEN;
+}
+
+static int mock_find_reader(LPCSTR name)
+{
+    for (unsigned i = 0; i < SC_MOCK_MAX_READERS; i++) {
+        if (_readers[i].attached && strcmp(_readers[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static LONG mock_establish_context(PSCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    if (! _configured) {
+        scard_mock_config_t config;
+        scard_mock_default_config(&config);
+        mock_configure(&config);
+    }
+    LONG rv = SCARD_E_NO_MEMORY;
+    for (unsigned i = 0; i < MOCK_MAX_CONTEXTS; i++) {
+        if (! _contexts[i].used) {
+            _contexts[i].used = true;
+            _contexts[i].cancel_seq = 0;
+            *context = i + 1;
+            rv = SCARD_S_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG mock_release_context(SCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    mock_context_t *ctx = mock_context(context);
+    if (ctx) {
+        ctx->used = false;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ctx ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+static LONG mock_list_readers(SCARDCONTEXT context, LPSTR readers, LPDWORD readers_len)
+{
+    pthread_mutex_lock(&_mutex);
+    if (! mock_context(context)) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    // multi-string: NUL separated names followed by an extra NUL
+    DWORD len = 1;
+    for (unsigned i = 0; i < SC_MOCK_MAX_READERS; i++) {
+        if (_readers[i].attached) {
+            len += strlen(_readers[i].name) + 1;
+        }
+    }
+    LONG rv = SCARD_S_SUCCESS;
+    if (len == 1) {
+        rv = SCARD_E_NO_READERS_AVAILABLE;
+    } else if (readers && *readers_len < len) {
+        rv = SCARD_E_INSUFFICIENT_BUFFER;
+    } else if (readers) {
+        DWORD off = 0;
+        for (unsigned i = 0; i < SC_MOCK_MAX_READERS; i++) {
+            if (_readers[i].attached) {
+                strcpy(readers + off, _readers[i].name);
+                off += strlen(_readers[i].name) + 1;
+            }
+        }
+        readers[off] = 0;
+    }
+    *readers_len = len;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+// fills in the event state, returns true if it differs from the current state
+static bool mock_reader_event(SCARD_READERSTATE *state)
+{
+    DWORD event;
+    DWORD mask;
+    if (strcmp(state->szReader, MOCK_PNP_READER) == 0) {
+        // reader count is kept in the upper 16 bits
+        DWORD count = 0;
+        for (unsigned i = 0; i < SC_MOCK_MAX_READERS; i++) {
+            count += _readers[i].attached ? 1 : 0;
+        }
+        event = count << 16;
+        mask = 0xFFFF0000;
+    } else {
+        int idx = mock_find_reader(state->szReader);
+        if (idx < 0) {
+            event = SCARD_STATE_UNKNOWN;
+        } else {
+            mock_reader_t *r = &_readers[idx];
+            event = ((r->events & 0xFFFF) << 16) | (r->present ? SCARD_STATE_PRESENT : SCARD_STATE_EMPTY);
+            if (r->present) {
+                state->cbAtr = mock_atr(r, state->rgbAtr);
+            }
+        }
+        mask = 0xFFFF0000 | SCARD_STATE_UNKNOWN | SCARD_STATE_PRESENT | SCARD_STATE_EMPTY;
+    }
+
+    bool changed = (state->dwCurrentState == SCARD_STATE_UNAWARE)
+        || ((state->dwCurrentState & mask) != (event & mask));
+    state->dwEventState = event | (changed ? SCARD_STATE_CHANGED : 0);
+    return changed;
+}
+
+static LONG mock_get_status_change(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout != INFINITE) {
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&_mutex);
+    mock_context_t *ctx = mock_context(context);
+    if (! ctx) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    // like pcscd, cancel only aborts a wait that is in progress
+    unsigned cancel_seq = ctx->cancel_seq;
+    LONG rv = SCARD_S_SUCCESS;
+    while (1) {
+        bool changed = false;
+        for (DWORD i = 0; i < count; i++) {
+            changed |= mock_reader_event(&states[i]);
+        }
+        if (changed) {
+            break;
+        }
+        if (ctx->cancel_seq != cancel_seq) {
+            rv = SCARD_E_CANCELLED;
+            break;
+        }
+        if (timeout == INFINITE) {
+            pthread_cond_wait(&_cond, &_mutex);
+        } else if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT) {
+            rv = SCARD_E_TIMEOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG mock_connect(SCARDCONTEXT context, LPCSTR reader, PSCARDHANDLE handle, LPDWORD protocol)
+{
+    pthread_mutex_lock(&_mutex);
+    LONG rv = SCARD_S_SUCCESS;
+    int idx = mock_find_reader(reader);
+    if (! mock_context(context)) {
+        rv = SCARD_E_INVALID_HANDLE;
+    } else if (idx < 0) {
+        rv = SCARD_E_UNKNOWN_READER;
+    } else if (! _readers[idx].present) {
+        rv = SCARD_E_NO_SMARTCARD;
+    } else {
+        rv = SCARD_E_NO_MEMORY;
+        for (unsigned i = 0; i < MOCK_MAX_HANDLES; i++) {
+            if (! _handles[i].used) {
+                _handles[i].used = true;
+                _handles[i].reader = idx;
+                _handles[i].generation = _readers[idx].generation;
+                *handle = i + 1;
+                // memory cards are reported as T0 by the ACR38
+                *protocol = SCARD_PROTOCOL_T0;
+                rv = SCARD_S_SUCCESS;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG mock_status(SCARDHANDLE handle, LPSTR reader_names, LPDWORD reader_len, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atr_len)
+{
+    pthread_mutex_lock(&_mutex);
+    if (handle <= 0 || handle > MOCK_MAX_HANDLES || ! _handles[handle - 1].used) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    mock_handle_t *h = &_handles[handle - 1];
+    mock_reader_t *r = &_readers[h->reader];
+    LONG rv = SCARD_S_SUCCESS;
+    if (! r->present || r->generation != h->generation) {
+        rv = SCARD_W_REMOVED_CARD;
+    } else {
+        if (reader_names && reader_len) {
+            DWORD len = strlen(r->name) + 2;
+            if (*reader_len >= len) {
+                // multi-string with a single name
+                strcpy(reader_names, r->name);
+                reader_names[len - 1] = 0;
+            }
+            *reader_len = len;
+        }
+        if (state) {
+            *state = SCARD_SPECIFIC;
+        }
+        if (protocol) {
+            *protocol = SCARD_PROTOCOL_T0;
+        }
+        if (atr && atr_len) {
+            if (*atr_len < MOCK_ATR_LEN) {
+                rv = SCARD_E_INSUFFICIENT_BUFFER;
+            } else {
+                mock_atr(r, atr);
+            }
+            *atr_len = MOCK_ATR_LEN;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG mock_disconnect(SCARDHANDLE handle, DWORD disposition)
+{
+    pthread_mutex_lock(&_mutex);
+    LONG rv = SCARD_E_INVALID_HANDLE;
+    if (handle > 0 && handle <= MOCK_MAX_HANDLES && _handles[handle - 1].used) {
+        mock_handle_t *h = &_handles[handle - 1];
+        mock_reader_t *r = &_readers[h->reader];
+        if (disposition != SCARD_LEAVE_CARD && r->generation == h->generation) {
+            // card power cycle drops the PSC verification
+            r->unlocked = false;
+        }
+        h->used = false;
+        rv = SCARD_S_SUCCESS;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG mock_cancel(SCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    mock_context_t *ctx = mock_context(context);
+    if (ctx) {
+        ctx->cancel_seq++;
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ctx ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+static void mock_sw(LPBYTE resp, DWORD *resp_len, BYTE sw1, BYTE sw2)
+{
+    resp[(*resp_len)++] = sw1;
+    resp[(*resp_len)++] = sw2;
+}
+
+// handles one ACR38 pseudo APDU, returns the number of EEPROM bytes programmed
+static unsigned mock_apdu(mock_reader_t *r, LPCBYTE cmd, DWORD cmd_len, LPBYTE resp, DWORD *resp_len)
+{
+    *resp_len = 0;
+    if (cmd_len < 5 || cmd[0] != 0xFF) {
+        mock_sw(resp, resp_len, 0x6E, 0x00);
+        return 0;
+    }
+    BYTE ins = cmd[1];
+    BYTE address = cmd[3];
+    BYTE len = cmd[4];
+    LPCBYTE data = cmd + 5;
+
+    // everything except reader commands needs the memory card type selected
+    if (ins != 0x09 && ins != 0xA4 && r->selected_card != 0x06) {
+        mock_sw(resp, resp_len, 0x6A, 0x81);
+        return 0;
+    }
+
+    unsigned programmed = 0;
+    switch (ins) {
+    case 0x09:
+        // GET_READER_INFORMATION
+        memcpy(resp, MOCK_FIRMWARE, SC_MAX_FIRMWARE_LEN);
+        resp[10] = _config.max_send;
+        resp[11] = _config.max_recv;
+        resp[12] = 0x00;
+        resp[13] = 0x7F;
+        resp[14] = r->selected_card;
+        resp[15] = r->present ? 0x03 : 0x00;
+        *resp_len = 16;
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0xA4:
+        // SELECT_CARD_TYPE
+        if (cmd_len < 6) {
+            mock_sw(resp, resp_len, 0x67, 0x00);
+            break;
+        }
+        r->selected_card = data[0];
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0xB0:
+        // READ_MEMORY_CARD
+        if (len > _config.max_recv || address + len > SC_MOCK_MEMORY_LEN) {
+            mock_sw(resp, resp_len, 0x67, 0x00);
+            break;
+        }
+        memcpy(resp, r->memory + address, len);
+        *resp_len = len;
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0xB1:
+        // READ_PRESENTATION_ERROR_COUNTER_MEMORY_CARD
+        resp[0] = r->error_counter;
+        if (r->unlocked) {
+            memcpy(resp + 1, r->psc, 3);
+        } else {
+            memset(resp + 1, 0x00, 3);
+        }
+        *resp_len = 4;
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0xB2:
+        // READ_PROTECTION_BITS
+        memcpy(resp, r->protection, 4);
+        *resp_len = 4;
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0x20:
+        // PRESENT_CODE_MEMORY_CARD
+        if (cmd_len < 8) {
+            mock_sw(resp, resp_len, 0x67, 0x00);
+            break;
+        }
+        if (r->error_counter != 0 && memcmp(data, r->psc, 3) == 0) {
+            r->error_counter = 0x07;
+            r->unlocked = true;
+        } else {
+            // every failed attempt clears one bit of the counter
+            r->error_counter >>= 1;
+            r->unlocked = false;
+        }
+        programmed = 1;
+        mock_sw(resp, resp_len, 0x90, r->error_counter);
+        break;
+
+    case 0xD2:
+        // CHANGE_CODE_MEMORY_CARD
+        if (! r->unlocked) {
+            mock_sw(resp, resp_len, 0x69, 0x82);
+            break;
+        }
+        memcpy(r->psc, data, 3);
+        programmed = 3;
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    case 0xD0:
+        // WRITE_MEMORY_CARD
+        if (cmd_len > _config.max_send || cmd_len < 5U + len || address + len > SC_MOCK_MEMORY_LEN) {
+            mock_sw(resp, resp_len, 0x67, 0x00);
+            break;
+        }
+        if (! r->unlocked) {
+            mock_sw(resp, resp_len, 0x69, 0x82);
+            break;
+        }
+        for (unsigned i = 0; i < len; i++) {
+            unsigned a = address + i;
+            if (a < 32 && !(r->protection[a / 8] & (1 << (a % 8)))) {
+                // write protected byte is left as is
+                continue;
+            }
+            r->memory[a] = data[i];
+            programmed++;
+        }
+        mock_sw(resp, resp_len, 0x90, 0x00);
+        break;
+
+    default:
+        mock_sw(resp, resp_len, 0x6D, 0x00);
+        break;
+    }
+
+    return programmed;
+}
+
+static LONG mock_transmit(SCARDHANDLE handle, const SCARD_IO_REQUEST *pci, LPCBYTE send_data, DWORD send_len, LPBYTE recv_data, LPDWORD recv_len)
+{
+    _UNUSED(pci);
+    BYTE resp[SC_MOCK_MEMORY_LEN+2];
+    DWORD resp_len = 0;
+
+    pthread_mutex_lock(&_mutex);
+    if (handle <= 0 || handle > MOCK_MAX_HANDLES || ! _handles[handle - 1].used) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    mock_handle_t *h = &_handles[handle - 1];
+    mock_reader_t *r = &_readers[h->reader];
+    if (! r->attached) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_READER_UNAVAILABLE;
+    }
+    if (! r->present || r->generation != h->generation) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_W_REMOVED_CARD;
+    }
+    if (r->fail_count) {
+        r->fail_count--;
+        _apdu_count++;
+        LONG rv = r->fail_rv;
+        pthread_mutex_unlock(&_mutex);
+        return rv;
+    }
+    unsigned programmed = mock_apdu(r, send_data, send_len, resp, &resp_len);
+    _apdu_count++;
+    _eeprom_writes += programmed;
+    unsigned long delay = _config.apdu_latency_us
+        + _config.byte_latency_us * (send_len + resp_len)
+        + _config.eeprom_write_us * programmed;
+    pthread_mutex_unlock(&_mutex);
+
+    mock_delay(delay);
+
+    if (*recv_len < resp_len) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(recv_data, resp, resp_len);
+    *recv_len = resp_len;
+    return SCARD_S_SUCCESS;
+}
+
+const scard_transport_t scard_mock_transport = {
+    "mock",
+    mock_establish_context,
+    mock_release_context,
+    mock_list_readers,
+    mock_get_status_change,
+    mock_connect,
+    mock_transmit,
+    mock_status,
+    mock_disconnect,
+    mock_cancel
+};
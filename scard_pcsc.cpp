@@ -0,0 +1,71 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+
+
+static LONG pcsc_establish_context(PSCARDCONTEXT context)
+{
+    LONG rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, context);
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    return SCardIsValidContext(*context);
+}
+
+static LONG pcsc_release_context(SCARDCONTEXT context)
+{
+    return SCardReleaseContext(context);
+}
+
+static LONG pcsc_list_readers(SCARDCONTEXT context, LPSTR readers, LPDWORD readers_len)
+{
+    LPSTR mszGroups = nullptr;
+    return SCardListReaders(context, mszGroups, readers, readers_len);
+}
+
+static LONG pcsc_get_status_change(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count)
+{
+    return SCardGetStatusChange(context, timeout, states, count);
+}
+
+static LONG pcsc_connect(SCARDCONTEXT context, LPCSTR reader, PSCARDHANDLE handle, LPDWORD protocol)
+{
+    return SCardConnect(context, reader, SCARD_SHARE_SHARED,
+        SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, handle, protocol);
+}
+
+static LONG pcsc_transmit(SCARDHANDLE handle, const SCARD_IO_REQUEST *pci, LPCBYTE send_data, DWORD send_len, LPBYTE recv_data, LPDWORD recv_len)
+{
+    return SCardTransmit(handle, pci, send_data, send_len, NULL, recv_data, recv_len);
+}
+
+static LONG pcsc_status(SCARDHANDLE handle, LPSTR reader_names, LPDWORD reader_len, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atr_len)
+{
+    return SCardStatus(handle, reader_names, reader_len, state, protocol, atr, atr_len);
+}
+
+static LONG pcsc_disconnect(SCARDHANDLE handle, DWORD disposition)
+{
+    return SCardDisconnect(handle, disposition);
+}
+
+static LONG pcsc_cancel(SCARDCONTEXT context)
+{
+    return SCardCancel(context);
+}
+
+const scard_transport_t scard_pcsc_transport = {
+    "pcsc",
+    pcsc_establish_context,
+    pcsc_release_context,
+    pcsc_list_readers,
+    pcsc_get_status_change,
+    pcsc_connect,
+    pcsc_transmit,
+    pcsc_status,
+    pcsc_disconnect,
+    pcsc_cancel
+};
@@ -0,0 +1,90 @@
+/**
+ *
+ */
+
+#ifndef SCARD_QUEUE_H_
+#define SCARD_QUEUE_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// bounded queue for any number of producers and a single consumer; every
+// cell carries a sequence number that tells whose turn it is, so producers
+// only race on the tail index and never on the cells (D. Vyukov)
+template <typename T, unsigned N>
+struct scard_queue_t {
+    static_assert(N && (N & (N - 1)) == 0, "queue size must be a power of two");
+    struct {
+        std::atomic<uint32_t> seq;
+        T item;
+    } cells[N];
+    // producers claim slots at the tail, the consumer takes from the head
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> head;
+};
+
+template <typename T, unsigned N>
+static inline void scard_queue_init(scard_queue_t<T, N> *queue)
+{
+    for (unsigned i = 0; i < N; i++) {
+        queue->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    queue->tail.store(0, std::memory_order_relaxed);
+    queue->head.store(0, std::memory_order_release);
+}
+
+// any thread; false if the queue is full
+template <typename T, unsigned N>
+static inline bool scard_queue_push(scard_queue_t<T, N> *queue, const T *item)
+{
+    uint32_t pos = queue->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        auto *cell = &queue->cells[pos & (N - 1)];
+        uint32_t seq = cell->seq.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            // cell is free for this position, claim it
+            if (queue->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell->item = *item;
+                // hand the cell over to the consumer
+                cell->seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+            // pos was reloaded by the failed exchange
+        } else if (diff < 0) {
+            // consumer did not get to this cell yet
+            return false;
+        } else {
+            pos = queue->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// consumer thread only; false if the queue is empty
+template <typename T, unsigned N>
+static inline bool scard_queue_pop(scard_queue_t<T, N> *queue, T *item)
+{
+    uint32_t pos = queue->head.load(std::memory_order_relaxed);
+    auto *cell = &queue->cells[pos & (N - 1)];
+    uint32_t seq = cell->seq.load(std::memory_order_acquire);
+    if ((int32_t)(seq - (pos + 1)) < 0) {
+        // empty, or a producer claimed the cell and is still writing it
+        return false;
+    }
+    *item = cell->item;
+    // cell is free again one lap later
+    cell->seq.store(pos + N, std::memory_order_release);
+    queue->head.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
+// consumer thread only; true if the next item is ready to be taken
+template <typename T, unsigned N>
+static inline bool scard_queue_pending(scard_queue_t<T, N> *queue)
+{
+    uint32_t pos = queue->head.load(std::memory_order_relaxed);
+    uint32_t seq = queue->cells[pos & (N - 1)].seq.load(std::memory_order_acquire);
+    return (int32_t)(seq - (pos + 1)) >= 0;
+}
+
+#endif // SCARD_QUEUE_H_
@@ -0,0 +1,699 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_trace.h"
+
+#include <errno.h>
+#include <time.h>
+
+// serves a recorded APDU trace as if the readers and cards were real
+
+#define REPLAY_PNP_READER               "\\\\?PnP?\\Notification"
+#define REPLAY_MAX_CONTEXTS             32
+#define REPLAY_MAX_HANDLES              32
+
+// trace record put back together from its slots
+typedef struct {
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint64_t duration_ns;
+    uint32_t rv;
+    uint8_t type;
+    uint8_t reader;
+    uint16_t send_len;
+    uint16_t recv_len;
+    uint8_t data[SC_TRACE_DATA_LEN];
+} replay_record_t;
+
+typedef struct {
+    bool used;
+    char name[SC_MAX_READERNAME_LEN+1];
+    // indexes into _records, in recorded order
+    unsigned *records;
+    unsigned count;
+    unsigned cursor;
+    bool present;
+    // insert/remove counter, reported in the upper 16 bits of the event state
+    unsigned events;
+    unsigned generation;
+    // scard_submit() request reached in the trace, not yet picked up
+    bool command_pending;
+    scard_command_t command;
+} replay_reader_t;
+
+typedef struct {
+    bool used;
+    unsigned cancel_seq;
+} replay_context_t;
+
+typedef struct {
+    bool used;
+    unsigned reader;
+    unsigned generation;
+} replay_handle_t;
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+static bool _realtime;
+static uint64_t _start_ns;
+static uint64_t _trace_start_ns;
+static replay_record_t *_records;
+static unsigned _num_records;
+static replay_reader_t _readers[SC_MAX_READERS];
+static replay_context_t _contexts[REPLAY_MAX_CONTEXTS];
+static replay_handle_t _handles[REPLAY_MAX_HANDLES];
+static unsigned long _progress;
+static scard_replay_stats_t _stats;
+
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t sa = ((const replay_record_t *)a)->seq;
+    uint64_t sb = ((const replay_record_t *)b)->seq;
+    return (sa > sb) - (sa < sb);
+}
+
+static void replay_reset()
+{
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        free(_readers[i].records);
+    }
+    free(_records);
+    _records = nullptr;
+    _num_records = 0;
+    memset(_readers, 0, sizeof(_readers));
+    memset(&_stats, 0, sizeof(_stats));
+    _progress = 0;
+}
+
+bool scard_replay_load(const char *path, bool realtime)
+{
+    FILE *file = fopen(path, "rb");
+    if (! file) {
+        ERR("failed to open trace %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    scard_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != SC_TRACE_MAGIC
+        || header.version != SC_TRACE_VERSION
+        || header.record_size != sizeof(scard_trace_slot_t)
+        || header.capacity < SC_TRACE_MAX_SLOTS) {
+        ERR("%s is not a trace file\n", path);
+        fclose(file);
+        return false;
+    }
+    scard_trace_slot_t *slots = (scard_trace_slot_t *)calloc(header.capacity, sizeof(scard_trace_slot_t));
+    // a short file leaves the rest of the slots empty
+    size_t num_slots = fread(slots, sizeof(scard_trace_slot_t), header.capacity, file);
+    fclose(file);
+
+    replay_record_t *records = (replay_record_t *)malloc((size_t)header.capacity * sizeof(replay_record_t));
+    unsigned count = 0;
+    for (unsigned i = 0; i < num_slots; i++) {
+        const scard_trace_record_t *slot = &slots[i].record;
+        // skip empty and continuation slots, and records torn by a crash during the write
+        if (slot->seq == 0 || (slot->seq & SC_TRACE_CONT) || slot->seq > header.head
+            || (slot->seq - 1) % header.capacity != i) {
+            continue;
+        }
+        unsigned len = slot->send_len + slot->recv_len;
+        if (slot->reader >= SC_MAX_READERS || len > SC_TRACE_DATA_LEN || slot->slots != SC_TRACE_SLOTS(len)) {
+            continue;
+        }
+        replay_record_t *rec = &records[count];
+        unsigned done = (len < SC_TRACE_HEAD_DATA_LEN) ? len : SC_TRACE_HEAD_DATA_LEN;
+        memcpy(rec->data, slot->data, done);
+        bool torn = false;
+        for (unsigned n = 1; n < slot->slots; n++) {
+            const scard_trace_cont_t *cont = &slots[(i + n) % header.capacity].cont;
+            if (cont->seq != ((slot->seq + n) | SC_TRACE_CONT)) {
+                torn = true;
+                break;
+            }
+            unsigned chunk = (len - done < SC_TRACE_CONT_DATA_LEN) ? len - done : SC_TRACE_CONT_DATA_LEN;
+            memcpy(rec->data + done, cont->data, chunk);
+            done += chunk;
+        }
+        if (torn) {
+            continue;
+        }
+        rec->seq = slot->seq;
+        rec->ts_ns = slot->ts_ns;
+        rec->duration_ns = slot->duration_ns;
+        rec->rv = slot->rv;
+        rec->type = slot->type;
+        rec->reader = slot->reader;
+        rec->send_len = slot->send_len;
+        rec->recv_len = slot->recv_len;
+        count++;
+    }
+    free(slots);
+    // ring may have wrapped, restore the recorded order
+    qsort(records, count, sizeof(replay_record_t), cmp_seq);
+
+    pthread_mutex_lock(&_mutex);
+    replay_reset();
+    _records = records;
+    _num_records = count;
+    for (unsigned i = 0; i < count; i++) {
+        replay_reader_t *r = &_readers[records[i].reader];
+        if (! r->used) {
+            r->used = true;
+            r->records = (unsigned *)malloc(count * sizeof(unsigned));
+            snprintf(r->name, sizeof(r->name), "Replay reader %u", records[i].reader);
+        }
+        if (records[i].type == SC_TRACE_ATTACH) {
+            unsigned len = records[i].send_len;
+            if (len > SC_MAX_READERNAME_LEN) {
+                len = SC_MAX_READERNAME_LEN;
+            }
+            memcpy(r->name, records[i].data, len);
+            r->name[len] = 0;
+        }
+        r->records[r->count++] = i;
+    }
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        replay_reader_t *r = &_readers[i];
+        // trace that starts in the middle of a session begins with the card present
+        for (unsigned n = 0; n < r->count; n++) {
+            uint8_t type = _records[r->records[n]].type;
+            if (type == SC_TRACE_ATTACH) {
+                continue;
+            }
+            if (type != SC_TRACE_INSERT) {
+                r->present = true;
+                r->events = 1;
+                r->generation = 1;
+            }
+            break;
+        }
+    }
+    _stats.records = count;
+    _realtime = realtime;
+    _start_ns = scard_now_ns();
+    _trace_start_ns = count ? records[0].ts_ns : 0;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    INF("loaded %u trace records from %s\n", count, path);
+    return true;
+}
+
+// time at which the record is due when replaying at the recorded pace
+static uint64_t replay_due_ns(const replay_record_t *rec)
+{
+    if (! _realtime) {
+        return 0;
+    }
+    return _start_ns + (rec->ts_ns - _trace_start_ns);
+}
+
+static replay_record_t *replay_next(replay_reader_t *r)
+{
+    if (r->cursor >= r->count) {
+        return nullptr;
+    }
+    return &_records[r->records[r->cursor]];
+}
+
+static void replay_consume(replay_reader_t *r)
+{
+    r->cursor++;
+    _progress++;
+}
+
+static void replay_seed_cache(replay_reader_t *r, const replay_record_t *rec)
+{
+    if (rec->send_len != SC_TRACE_CAPS_LEN) {
+        return;
+    }
+    scard_reader_caps_t caps;
+    memset(&caps, 0, sizeof(caps));
+    strcpy(caps.name, r->name);
+    memcpy(caps.firmware, rec->data, SC_MAX_FIRMWARE_LEN);
+    caps.max_send = rec->data[10];
+    caps.max_recv = rec->data[11];
+    caps.card_types = (rec->data[12] << 8) | rec->data[13];
+    scard_reader_cache_store(&caps);
+}
+
+// applies the card events that are due, returns the time the next one is due or 0
+static uint64_t replay_advance(replay_reader_t *r)
+{
+    uint64_t now = scard_now_ns();
+    replay_record_t *rec;
+    while ((rec = replay_next(r))) {
+        if (rec->type == SC_TRACE_ATTACH) {
+            replay_consume(r);
+            continue;
+        }
+        if (rec->type == SC_TRACE_CAPS) {
+            // recorded with the reader in the capability cache, it has to
+            // be there before the FSM identifies the reader
+            replay_seed_cache(r, rec);
+            replay_consume(r);
+            continue;
+        }
+        if (rec->type == SC_TRACE_APDU || rec->type == SC_TRACE_ATR) {
+            // waits for the FSM to ask for it
+            return 0;
+        }
+        if (rec->type == SC_TRACE_COMMAND && r->command_pending) {
+            // previous request still not picked up
+            return 0;
+        }
+        uint64_t due = replay_due_ns(rec);
+        if (due > now) {
+            return due;
+        }
+        if (rec->type == SC_TRACE_INSERT) {
+            r->present = true;
+            r->generation++;
+            r->events++;
+        } else if (rec->type == SC_TRACE_REMOVE) {
+            r->present = false;
+            r->events++;
+        } else {
+            // user requests arrive independently of the APDU flow
+            uint32_t type;
+            memcpy(&type, rec->data, sizeof(uint32_t));
+            memcpy(&r->command.arg, rec->data + sizeof(uint32_t), sizeof(uint32_t));
+            r->command.type = (scard_command_type_t)type;
+            r->command_pending = (type < SC_NUM_CMDS);
+        }
+        replay_consume(r);
+        pthread_cond_broadcast(&_cond);
+    }
+    return 0;
+}
+
+unsigned scard_replay_readers()
+{
+    return SC_MAX_READERS;
+}
+
+const char *scard_replay_reader_name(unsigned reader)
+{
+    assert(reader < SC_MAX_READERS);
+    return _readers[reader].used ? _readers[reader].name : nullptr;
+}
+
+bool scard_replay_take_command(unsigned reader, scard_command_t *command)
+{
+    assert(reader < SC_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    replay_reader_t *r = &_readers[reader];
+    replay_advance(r);
+    bool rv = r->command_pending;
+    if (rv) {
+        *command = r->command;
+        r->command_pending = false;
+        replay_advance(r);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+void scard_replay_skip(unsigned reader)
+{
+    assert(reader < SC_MAX_READERS);
+    pthread_mutex_lock(&_mutex);
+    replay_reader_t *r = &_readers[reader];
+    if (replay_next(r)) {
+        replay_consume(r);
+        _stats.skipped++;
+        replay_advance(r);
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+unsigned long scard_replay_progress()
+{
+    pthread_mutex_lock(&_mutex);
+    unsigned long rv = _progress;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+bool scard_replay_done()
+{
+    pthread_mutex_lock(&_mutex);
+    bool rv = true;
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        if (_readers[i].cursor < _readers[i].count || _readers[i].command_pending) {
+            rv = false;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+void scard_replay_get_stats(scard_replay_stats_t *stats)
+{
+    pthread_mutex_lock(&_mutex);
+    *stats = _stats;
+    pthread_mutex_unlock(&_mutex);
+}
+
+static replay_context_t *replay_context(SCARDCONTEXT context)
+{
+    if (context <= 0 || context > REPLAY_MAX_CONTEXTS) {
+        return nullptr;
+    }
+    replay_context_t *ctx = &_contexts[context - 1];
+    return ctx->used ? ctx : nullptr;
+}
+
+static int replay_find_reader(LPCSTR name)
+{
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        if (_readers[i].used && strcmp(_readers[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static LONG replay_establish_context(PSCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    LONG rv = SCARD_E_NO_MEMORY;
+    for (unsigned i = 0; i < REPLAY_MAX_CONTEXTS; i++) {
+        if (! _contexts[i].used) {
+            _contexts[i].used = true;
+            _contexts[i].cancel_seq = 0;
+            *context = i + 1;
+            rv = SCARD_S_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG replay_release_context(SCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    replay_context_t *ctx = replay_context(context);
+    if (ctx) {
+        ctx->used = false;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ctx ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+static LONG replay_list_readers(SCARDCONTEXT context, LPSTR readers, LPDWORD readers_len)
+{
+    pthread_mutex_lock(&_mutex);
+    if (! replay_context(context)) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    // multi-string: NUL separated names followed by an extra NUL
+    DWORD len = 1;
+    for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+        if (_readers[i].used) {
+            len += strlen(_readers[i].name) + 1;
+        }
+    }
+    LONG rv = SCARD_S_SUCCESS;
+    if (len == 1) {
+        rv = SCARD_E_NO_READERS_AVAILABLE;
+    } else if (readers && *readers_len < len) {
+        rv = SCARD_E_INSUFFICIENT_BUFFER;
+    } else if (readers) {
+        DWORD off = 0;
+        for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+            if (_readers[i].used) {
+                strcpy(readers + off, _readers[i].name);
+                off += strlen(_readers[i].name) + 1;
+            }
+        }
+        readers[off] = 0;
+    }
+    *readers_len = len;
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+// fills in the event state, returns true if it differs from the current state
+static bool replay_reader_event(SCARD_READERSTATE *state)
+{
+    DWORD event;
+    DWORD mask;
+    if (strcmp(state->szReader, REPLAY_PNP_READER) == 0) {
+        // reader count is kept in the upper 16 bits
+        DWORD count = 0;
+        for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+            count += _readers[i].used ? 1 : 0;
+        }
+        event = count << 16;
+        mask = 0xFFFF0000;
+    } else {
+        int idx = replay_find_reader(state->szReader);
+        if (idx < 0) {
+            event = SCARD_STATE_UNKNOWN;
+        } else {
+            replay_reader_t *r = &_readers[idx];
+            event = ((r->events & 0xFFFF) << 16) | (r->present ? SCARD_STATE_PRESENT : SCARD_STATE_EMPTY);
+        }
+        mask = 0xFFFF0000 | SCARD_STATE_UNKNOWN | SCARD_STATE_PRESENT | SCARD_STATE_EMPTY;
+    }
+
+    bool changed = (state->dwCurrentState == SCARD_STATE_UNAWARE)
+        || ((state->dwCurrentState & mask) != (event & mask));
+    state->dwEventState = event | (changed ? SCARD_STATE_CHANGED : 0);
+    return changed;
+}
+
+static void replay_abstime(uint64_t wake_ns, struct timespec *ts)
+{
+    // condition variable waits on the realtime clock
+    uint64_t now = scard_now_ns();
+    uint64_t delta = wake_ns > now ? wake_ns - now : 0;
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += delta / 1000000000ULL;
+    ts->tv_nsec += delta % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static LONG replay_get_status_change(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count)
+{
+    uint64_t deadline = 0;
+    if (timeout != INFINITE) {
+        deadline = scard_now_ns() + (uint64_t)timeout * 1000000ULL;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    replay_context_t *ctx = replay_context(context);
+    if (! ctx) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    // like pcscd, cancel only aborts a wait that is in progress
+    unsigned cancel_seq = ctx->cancel_seq;
+    LONG rv = SCARD_S_SUCCESS;
+    while (1) {
+        uint64_t wake = deadline;
+        for (unsigned i = 0; i < SC_MAX_READERS; i++) {
+            uint64_t due = replay_advance(&_readers[i]);
+            if (due && (wake == 0 || due < wake)) {
+                wake = due;
+            }
+        }
+        bool changed = false;
+        for (DWORD i = 0; i < count; i++) {
+            changed |= replay_reader_event(&states[i]);
+        }
+        if (changed) {
+            break;
+        }
+        if (ctx->cancel_seq != cancel_seq) {
+            rv = SCARD_E_CANCELLED;
+            break;
+        }
+        if (deadline && scard_now_ns() >= deadline) {
+            rv = SCARD_E_TIMEOUT;
+            break;
+        }
+        if (wake == 0) {
+            pthread_cond_wait(&_cond, &_mutex);
+        } else {
+            struct timespec ts;
+            replay_abstime(wake, &ts);
+            pthread_cond_timedwait(&_cond, &_mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG replay_connect(SCARDCONTEXT context, LPCSTR reader, PSCARDHANDLE handle, LPDWORD protocol)
+{
+    pthread_mutex_lock(&_mutex);
+    LONG rv = SCARD_S_SUCCESS;
+    int idx = replay_find_reader(reader);
+    if (! replay_context(context)) {
+        rv = SCARD_E_INVALID_HANDLE;
+    } else if (idx < 0) {
+        rv = SCARD_E_UNKNOWN_READER;
+    } else if (! _readers[idx].present) {
+        rv = SCARD_E_NO_SMARTCARD;
+    } else {
+        rv = SCARD_E_NO_MEMORY;
+        for (unsigned i = 0; i < REPLAY_MAX_HANDLES; i++) {
+            if (! _handles[i].used) {
+                _handles[i].used = true;
+                _handles[i].reader = idx;
+                _handles[i].generation = _readers[idx].generation;
+                *handle = i + 1;
+                *protocol = SCARD_PROTOCOL_T0;
+                rv = SCARD_S_SUCCESS;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG replay_disconnect(SCARDHANDLE handle, DWORD disposition)
+{
+    _UNUSED(disposition);
+    pthread_mutex_lock(&_mutex);
+    LONG rv = SCARD_E_INVALID_HANDLE;
+    if (handle > 0 && handle <= REPLAY_MAX_HANDLES && _handles[handle - 1].used) {
+        _handles[handle - 1].used = false;
+        rv = SCARD_S_SUCCESS;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG replay_cancel(SCARDCONTEXT context)
+{
+    pthread_mutex_lock(&_mutex);
+    replay_context_t *ctx = replay_context(context);
+    if (ctx) {
+        ctx->cancel_seq++;
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ctx ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+static LONG replay_status(SCARDHANDLE handle, LPSTR reader_names, LPDWORD reader_len, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atr_len)
+{
+    _UNUSED(reader_names);
+    _UNUSED(state);
+    pthread_mutex_lock(&_mutex);
+    if (handle <= 0 || handle > REPLAY_MAX_HANDLES || ! _handles[handle - 1].used) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    replay_reader_t *r = &_readers[_handles[handle - 1].reader];
+    replay_advance(r);
+    replay_record_t *rec = replay_next(r);
+    if (! rec || rec->type != SC_TRACE_ATR) {
+        _stats.mismatches++;
+        pthread_mutex_unlock(&_mutex);
+        ERR("unexpected status request, nothing recorded for it\n");
+        return SCARD_E_NOT_TRANSACTED;
+    }
+    LONG rv = SCARD_S_SUCCESS;
+    if (reader_len) {
+        *reader_len = 0;
+    }
+    if (protocol) {
+        *protocol = SCARD_PROTOCOL_T0;
+    }
+    if (atr && atr_len) {
+        if (*atr_len < rec->send_len) {
+            rv = SCARD_E_INSUFFICIENT_BUFFER;
+        } else {
+            memcpy(atr, rec->data, rec->send_len);
+        }
+        *atr_len = rec->send_len;
+    }
+    replay_consume(r);
+    replay_advance(r);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    return rv;
+}
+
+static LONG replay_transmit(SCARDHANDLE handle, const SCARD_IO_REQUEST *pci, LPCBYTE send_data, DWORD send_len, LPBYTE recv_data, LPDWORD recv_len)
+{
+    _UNUSED(pci);
+    pthread_mutex_lock(&_mutex);
+    if (handle <= 0 || handle > REPLAY_MAX_HANDLES || ! _handles[handle - 1].used) {
+        pthread_mutex_unlock(&_mutex);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    replay_reader_t *r = &_readers[_handles[handle - 1].reader];
+    replay_advance(r);
+    replay_record_t *rec = replay_next(r);
+    if (! rec || rec->type != SC_TRACE_APDU) {
+        // FSM went somewhere the recording did not
+        _stats.mismatches++;
+        pthread_mutex_unlock(&_mutex);
+        ERR("unexpected command, nothing recorded for it\n");
+        return SCARD_E_NOT_TRANSACTED;
+    }
+    if (rec->send_len != send_len || memcmp(rec->data, send_data, send_len) != 0) {
+        // the recorded response belongs to another command, the FSM
+        // must not parse it
+        _stats.mismatches++;
+        pthread_mutex_unlock(&_mutex);
+        ERR("command differs from the recorded one\n");
+        return SCARD_E_NOT_TRANSACTED;
+    }
+    LONG rv = (LONG)(int32_t)rec->rv;
+    DWORD resp_len = rec->recv_len;
+    BYTE resp[SC_TRACE_DATA_LEN];
+    memcpy(resp, rec->data + rec->send_len, resp_len);
+    uint64_t duration = rec->duration_ns;
+    _stats.apdus++;
+    _stats.recorded_ns += duration;
+    replay_consume(r);
+    replay_advance(r);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    if (_realtime && duration) {
+        struct timespec ts;
+        ts.tv_sec = duration / 1000000000ULL;
+        ts.tv_nsec = duration % 1000000000ULL;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        }
+    }
+
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    if (*recv_len < resp_len) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(recv_data, resp, resp_len);
+    *recv_len = resp_len;
+    return SCARD_S_SUCCESS;
+}
+
+const scard_transport_t scard_replay_transport = {
+    "replay",
+    replay_establish_context,
+    replay_release_context,
+    replay_list_readers,
+    replay_get_status_change,
+    replay_connect,
+    replay_transmit,
+    replay_status,
+    replay_disconnect,
+    replay_cancel
+};
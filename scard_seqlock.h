@@ -0,0 +1,46 @@
+/**
+ *
+ */
+
+#ifndef SCARD_SEQLOCK_H_
+#define SCARD_SEQLOCK_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// sequence lock for data with one writer at a time and any number of readers;
+// readers never block the writer, they retry if the copy was torn
+typedef struct {
+    std::atomic<uint32_t> seq;
+} scard_seqlock_t;
+
+static inline void scard_seqlock_write_begin(scard_seqlock_t *lock)
+{
+    uint32_t seq = lock->seq.load(std::memory_order_relaxed);
+    // odd sequence marks a write in progress
+    lock->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline void scard_seqlock_write_end(scard_seqlock_t *lock)
+{
+    uint32_t seq = lock->seq.load(std::memory_order_relaxed);
+    lock->seq.store(seq + 1, std::memory_order_release);
+}
+
+static inline uint32_t scard_seqlock_read_begin(const scard_seqlock_t *lock)
+{
+    uint32_t seq;
+    while ((seq = lock->seq.load(std::memory_order_acquire)) & 1) {
+        // writer is busy
+    }
+    return seq;
+}
+
+static inline bool scard_seqlock_read_retry(const scard_seqlock_t *lock, uint32_t seq)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return lock->seq.load(std::memory_order_relaxed) != seq;
+}
+
+#endif // SCARD_SEQLOCK_H_
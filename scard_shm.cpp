@@ -0,0 +1,203 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_shm.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(scard_seqlock_t) == sizeof(uint32_t), "seqlock must map to a plain uint32_t");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "seqlock must work across processes");
+static_assert(sizeof(scard_shm_reader_t) == 320, "shm reader size");
+static_assert(offsetof(scard_shm_page_t, readers) == 320, "shm header size");
+
+// guards the mapping; updates come in under the status lock already, so
+// this is never contended
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> _enabled(false);
+static scard_shm_page_t *_page = nullptr;
+static char _path[256];
+
+bool scard_shm_open(const char *path)
+{
+    scard_shm_close();
+
+    if (strlen(path) >= sizeof(_path)) {
+        ERR("status page path too long: %s\n", path);
+        return false;
+    }
+    // readers of a previous page keep their old file
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        ERR("failed to create status page %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, sizeof(scard_shm_page_t)) != 0) {
+        ERR("failed to size status page %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    void *map = mmap(NULL, sizeof(scard_shm_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("failed to map status page %s: %s\n", path, strerror(errno));
+        unlink(path);
+        return false;
+    }
+
+    // the file starts out zeroed, an idle reader is all zeros
+    scard_shm_page_t *page = (scard_shm_page_t *)map;
+    page->version = SC_SHM_VERSION;
+    page->header_size = offsetof(scard_shm_page_t, readers);
+    page->reader_size = sizeof(scard_shm_reader_t);
+    page->max_readers = SC_MAX_READERS;
+    page->pid = getpid();
+    page->start_ns = scard_wall_ns();
+    unsigned state = 0;
+    while (state < SC_FSM_MAX_STATES && strcmp(scard_state_name(state), "?")) {
+        strncpy(page->state_names[state], scard_state_name(state), SC_SHM_NAME_LEN - 1);
+        state++;
+    }
+    page->num_states = state;
+    page->updated_ns = page->start_ns;
+    // last, a reader that sees the magic sees the rest
+    std::atomic_thread_fence(std::memory_order_release);
+    page->magic = SC_SHM_MAGIC;
+
+    pthread_mutex_lock(&_mutex);
+    _page = page;
+    strcpy(_path, path);
+    _enabled.store(true, std::memory_order_release);
+    pthread_mutex_unlock(&_mutex);
+    INF("status page at %s\n", path);
+    return true;
+}
+
+void scard_shm_close()
+{
+    pthread_mutex_lock(&_mutex);
+    scard_shm_page_t *page = _page;
+    _enabled.store(false, std::memory_order_relaxed);
+    _page = nullptr;
+    pthread_mutex_unlock(&_mutex);
+    if (page) {
+        munmap(page, sizeof(scard_shm_page_t));
+        unlink(_path);
+    }
+}
+
+void scard_shm_update(unsigned slot, const scard_reader_status_t *reader, uint32_t version,
+    const scard_fsm_stats_t *fsm)
+{
+    if (! _enabled.load(std::memory_order_acquire)) {
+        return;
+    }
+    uint64_t now = scard_wall_ns();
+    pthread_mutex_lock(&_mutex);
+    scard_shm_page_t *page = _page;
+    if (! page) {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    scard_seqlock_write_begin(&page->seq);
+    scard_shm_reader_t *out = &page->readers[slot];
+    if (! reader->active) {
+        memset(out, 0, sizeof(scard_shm_reader_t));
+    } else {
+        out->active = 1;
+        out->card_present = reader->card_present;
+        out->card_ready = reader->card_ready;
+        out->state = reader->state;
+        out->card_class = reader->card_class;
+        out->error_class = reader->error_class;
+        out->pin_retries = reader->pin_retries;
+        out->card_known = reader->card_known;
+        memcpy(out->name, reader->name, sizeof(out->name));
+        out->user_magic = reader->user_magic;
+        out->user_id = reader->user_id;
+        out->user_total = reader->user_total;
+        out->user_value = reader->user_value;
+        out->card_topups = reader->card_topups;
+        out->card_last_seen_ns = reader->card_last_seen_ns;
+        if (fsm) {
+            out->state_ns = fsm->entered_ns;
+            out->transitions = fsm->transitions;
+            for (unsigned state = 0; state < SC_FSM_MAX_STATES; state++) {
+                out->entries[state] = fsm->entries[state];
+            }
+        }
+    }
+    page->status_version = version;
+    page->updated_ns = now;
+    page->updates++;
+    scard_seqlock_write_end(&page->seq);
+    pthread_mutex_unlock(&_mutex);
+}
+
+const scard_shm_page_t *scard_shm_map(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ERR("failed to open status page %s: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < offsetof(scard_shm_page_t, readers)) {
+        ERR("status page %s is too short\n", path);
+        close(fd);
+        return nullptr;
+    }
+    void *map = mmap(NULL, sizeof(scard_shm_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("failed to map status page %s: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    const scard_shm_page_t *page = (const scard_shm_page_t *)map;
+    if (page->magic != SC_SHM_MAGIC || page->version != SC_SHM_VERSION
+        || page->header_size != offsetof(scard_shm_page_t, readers)
+        || page->reader_size != sizeof(scard_shm_reader_t) || page->max_readers != SC_MAX_READERS
+        || (size_t)st.st_size < sizeof(scard_shm_page_t)) {
+        ERR("status page %s has another layout, version %u\n", path, page->version);
+        munmap(map, sizeof(scard_shm_page_t));
+        return nullptr;
+    }
+    return page;
+}
+
+void scard_shm_unmap(const scard_shm_page_t *page)
+{
+    munmap((void *)page, sizeof(scard_shm_page_t));
+}
+
+bool scard_shm_read(const scard_shm_page_t *page, scard_shm_page_t *copy)
+{
+    // the constant part needs no lock
+    memcpy((void *)copy, page, offsetof(scard_shm_page_t, seq));
+    for (unsigned i = 0; i < SC_SHM_READ_TRIES; i++) {
+        uint32_t seq = page->seq.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            // writer is busy, or died holding the page
+            sched_yield();
+            continue;
+        }
+        copy->status_version = page->status_version;
+        copy->updated_ns = page->updated_ns;
+        copy->updates = page->updates;
+        memcpy(copy->readers, page->readers, sizeof(copy->readers));
+        if (! scard_seqlock_read_retry(&page->seq, seq)) {
+            copy->seq.seq.store(seq, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
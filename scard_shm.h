@@ -0,0 +1,93 @@
+/**
+ *
+ */
+
+#ifndef SCARD_SHM_H_
+#define SCARD_SHM_H_
+
+#include "scard.h"
+#include "scard_seqlock.h"
+
+// status page: the reader status and session counters in a shared file,
+// kept current by the card sessions; other processes map it read only and
+// take a consistent copy with no syscall. The page has a fixed layout of
+// naturally aligned fields, readers check magic, version and the sizes
+// before they trust it.
+#define SC_SHM_MAGIC                    0x48534353      // "SCSH"
+// bumped on any layout change; fields only ever get appended within a version
+#define SC_SHM_VERSION                  1
+#define SC_SHM_DEFAULT_PATH             "/dev/shm/scard"
+#define SC_SHM_NAME_LEN                 16
+// a reader gives up on a page that stays locked, the writer died mid update
+#define SC_SHM_READ_TRIES               1000
+
+typedef struct {
+    uint8_t active;
+    uint8_t card_present;
+    uint8_t card_ready;
+    // index into state_names of the header
+    uint8_t state;
+    // scard_card_class_t, scard_error_class_t
+    uint8_t card_class;
+    uint8_t error_class;
+    uint8_t pin_retries;
+    uint8_t card_known;
+    char name[SC_MAX_READERNAME_LEN+1];
+    uint8_t pad[7];
+    // last user record read from or written to the card
+    uint32_t user_magic;
+    uint32_t user_id;
+    uint32_t user_total;
+    uint32_t user_value;
+    uint32_t card_topups;
+    uint32_t reserved;
+    // CLOCK_REALTIME of the previous visit of the card
+    uint64_t card_last_seen_ns;
+    // CLOCK_MONOTONIC the session entered the state
+    uint64_t state_ns;
+    // session FSM counters since the reader was attached
+    uint64_t transitions;
+    uint64_t entries[SC_FSM_MAX_STATES];
+} scard_shm_reader_t;
+
+typedef struct {
+    // constant once the page is set up
+    uint32_t magic;
+    uint32_t version;
+    // offset of readers[], size of one reader
+    uint32_t header_size;
+    uint32_t reader_size;
+    uint32_t max_readers;
+    uint32_t num_states;
+    uint32_t pid;
+    uint32_t reserved;
+    // CLOCK_REALTIME the page was set up
+    uint64_t start_ns;
+    char state_names[SC_FSM_MAX_STATES][SC_SHM_NAME_LEN];
+
+    // everything below is written under seq: odd while an update is in
+    // progress, a copy taken between two equal even reads is consistent
+    scard_seqlock_t seq;
+    // scard_status_t version
+    uint32_t status_version;
+    // CLOCK_REALTIME of the last update
+    uint64_t updated_ns;
+    uint64_t updates;
+    scard_shm_reader_t readers[SC_MAX_READERS];
+} scard_shm_page_t;
+
+// creates the page, the file is replaced if it exists
+bool scard_shm_open(const char *path);
+// removes the page, readers that still have it mapped see it frozen
+void scard_shm_close();
+// card sessions, one at a time; fsm may be NULL to keep the counters
+void scard_shm_update(unsigned slot, const scard_reader_status_t *reader, uint32_t version,
+    const scard_fsm_stats_t *fsm);
+
+// readers; NULL if the page is missing or of another layout
+const scard_shm_page_t *scard_shm_map(const char *path);
+void scard_shm_unmap(const scard_shm_page_t *page);
+// consistent copy of the changing part, false if the writer stays busy
+bool scard_shm_read(const scard_shm_page_t *page, scard_shm_page_t *copy);
+
+#endif // SCARD_SHM_H_
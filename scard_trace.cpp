@@ -0,0 +1,203 @@
+/**
+ *
+ */
+
+
+#include "scard.h"
+#include "scard_trace.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(scard_trace_slot_t) == SC_TRACE_SLOT_LEN, "trace slot size");
+static_assert(sizeof(scard_trace_record_t) == SC_TRACE_SLOT_LEN, "trace record size");
+
+static std::atomic<scard_trace_header_t *> _header(nullptr);
+static size_t _map_len;
+// threads inside scard_trace_apdu() or scard_trace_event(), the mapping
+// stays until they are out
+static std::atomic<unsigned> _writers(0);
+
+static scard_trace_slot_t *trace_slot(scard_trace_header_t *header, uint64_t idx)
+{
+    return &((scard_trace_slot_t *)(header + 1))[idx % header->capacity];
+}
+
+bool scard_trace_open(const char *path, unsigned slots)
+{
+    if (slots == 0) {
+        slots = SC_TRACE_DEFAULT_SLOTS;
+    }
+    if (slots < SC_TRACE_MAX_SLOTS) {
+        // the largest record has to fit
+        slots = SC_TRACE_MAX_SLOTS;
+    }
+    scard_trace_close();
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ERR("failed to open trace %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t len = sizeof(scard_trace_header_t) + (size_t)slots * sizeof(scard_trace_slot_t);
+    if (ftruncate(fd, len) != 0) {
+        ERR("failed to size trace %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("failed to map trace %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    scard_trace_header_t *header = (scard_trace_header_t *)map;
+    header->magic = SC_TRACE_MAGIC;
+    header->version = SC_TRACE_VERSION;
+    header->record_size = sizeof(scard_trace_slot_t);
+    header->capacity = slots;
+    header->head = 0;
+    _map_len = len;
+    _header.store(header, std::memory_order_release);
+    INF("tracing APDUs to %s, %u slots\n", path, slots);
+    return true;
+}
+
+void scard_trace_close()
+{
+    scard_trace_header_t *header = _header.exchange(nullptr, std::memory_order_seq_cst);
+    if (header) {
+        // a writer that got the header before the exchange may still use it
+        while (_writers.load(std::memory_order_seq_cst)) {
+            sched_yield();
+        }
+        msync(header, _map_len, MS_SYNC);
+        munmap(header, _map_len);
+    }
+}
+
+bool scard_trace_enabled()
+{
+    return _header.load(std::memory_order_relaxed) != nullptr;
+}
+
+// header to write to, nullptr if tracing is off; pair with trace_leave()
+static scard_trace_header_t *trace_enter()
+{
+    _writers.fetch_add(1, std::memory_order_seq_cst);
+    scard_trace_header_t *header = _header.load(std::memory_order_seq_cst);
+    if (! header) {
+        _writers.fetch_sub(1, std::memory_order_release);
+    }
+    return header;
+}
+
+static void trace_leave()
+{
+    _writers.fetch_sub(1, std::memory_order_release);
+}
+
+// claims the ring slots for len data bytes; the record is published by trace_commit()
+static scard_trace_record_t *trace_claim(scard_trace_header_t *header, unsigned len, uint64_t *idx)
+{
+    unsigned slots = SC_TRACE_SLOTS(len);
+    uint64_t first = __atomic_fetch_add(&header->head, slots, __ATOMIC_RELAXED);
+    // invalidate the old records before overwriting them
+    for (unsigned i = 0; i < slots; i++) {
+        __atomic_store_n(&trace_slot(header, first + i)->cont.seq, 0, __ATOMIC_RELAXED);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    scard_trace_record_t *rec = &trace_slot(header, first)->record;
+    rec->slots = slots;
+    *idx = first;
+    return rec;
+}
+
+// stores len bytes at offset of the record data, spilling into the continuation slots
+static void trace_copy(scard_trace_header_t *header, uint64_t idx, unsigned offset, const void *data, unsigned len)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    while (len) {
+        uint8_t *dst;
+        unsigned room;
+        if (offset < SC_TRACE_HEAD_DATA_LEN) {
+            dst = trace_slot(header, idx)->record.data + offset;
+            room = SC_TRACE_HEAD_DATA_LEN - offset;
+        } else {
+            unsigned cont = offset - SC_TRACE_HEAD_DATA_LEN;
+            dst = trace_slot(header, idx + 1 + cont / SC_TRACE_CONT_DATA_LEN)->cont.data + cont % SC_TRACE_CONT_DATA_LEN;
+            room = SC_TRACE_CONT_DATA_LEN - cont % SC_TRACE_CONT_DATA_LEN;
+        }
+        unsigned n = (len < room) ? len : room;
+        memcpy(dst, src, n);
+        src += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static void trace_commit(scard_trace_header_t *header, scard_trace_record_t *rec, uint64_t idx)
+{
+    for (unsigned i = 1; i < rec->slots; i++) {
+        __atomic_store_n(&trace_slot(header, idx + i)->cont.seq, (idx + i + 1) | SC_TRACE_CONT, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void scard_trace_apdu(unsigned reader, uint64_t ts_ns, uint64_t duration_ns, LONG rv,
+    LPCBYTE send_data, DWORD send_len, LPCBYTE recv_data, DWORD recv_len)
+{
+    scard_trace_header_t *header = trace_enter();
+    if (! header) {
+        return;
+    }
+    if (send_len > SC_TRACE_DATA_LEN) {
+        send_len = SC_TRACE_DATA_LEN;
+    }
+    if (recv_len > SC_TRACE_DATA_LEN - send_len) {
+        recv_len = SC_TRACE_DATA_LEN - send_len;
+    }
+    uint64_t idx;
+    scard_trace_record_t *rec = trace_claim(header, send_len + recv_len, &idx);
+    rec->ts_ns = ts_ns;
+    rec->duration_ns = duration_ns;
+    rec->rv = (uint32_t)rv;
+    rec->type = SC_TRACE_APDU;
+    rec->reader = reader;
+    rec->reserved = 0;
+    rec->send_len = send_len;
+    rec->recv_len = recv_len;
+    trace_copy(header, idx, 0, send_data, send_len);
+    trace_copy(header, idx, send_len, recv_data, recv_len);
+    trace_commit(header, rec, idx);
+    trace_leave();
+}
+
+void scard_trace_event(unsigned reader, scard_trace_type_t type, const void *data, unsigned len)
+{
+    scard_trace_header_t *header = trace_enter();
+    if (! header) {
+        return;
+    }
+    if (len > SC_TRACE_DATA_LEN) {
+        len = SC_TRACE_DATA_LEN;
+    }
+    uint64_t idx;
+    scard_trace_record_t *rec = trace_claim(header, len, &idx);
+    rec->ts_ns = scard_now_ns();
+    rec->duration_ns = 0;
+    rec->rv = SCARD_S_SUCCESS;
+    rec->type = type;
+    rec->reader = reader;
+    rec->reserved = 0;
+    rec->send_len = len;
+    rec->recv_len = 0;
+    trace_copy(header, idx, 0, data, len);
+    trace_commit(header, rec, idx);
+    trace_leave();
+}
@@ -0,0 +1,128 @@
+/**
+ *
+ */
+
+#ifndef SCARD_TRACE_H_
+#define SCARD_TRACE_H_
+
+#include <stdint.h>
+
+#include "scard_transport.h"
+
+// binary APDU trace; a memory mapped file holding a ring of 64 byte slots,
+// a record takes one slot plus as many continuation slots as its data needs
+#define SC_TRACE_MAGIC                  0x52544353      // "SCTR"
+#define SC_TRACE_VERSION                3
+#define SC_TRACE_SLOT_LEN               64
+#define SC_TRACE_DEFAULT_SLOTS          16384
+// command with a full payload plus the response with its status word
+#define SC_TRACE_DATA_LEN               520
+// data bytes held by the first slot of a record and by each continuation
+#define SC_TRACE_HEAD_DATA_LEN          28
+#define SC_TRACE_CONT_DATA_LEN          56
+#define SC_TRACE_SLOTS(len)             (((len) <= SC_TRACE_HEAD_DATA_LEN) ? 1 : \
+    1 + ((len) - SC_TRACE_HEAD_DATA_LEN + SC_TRACE_CONT_DATA_LEN - 1) / SC_TRACE_CONT_DATA_LEN)
+#define SC_TRACE_MAX_SLOTS              SC_TRACE_SLOTS(SC_TRACE_DATA_LEN)
+// set in the seq of a continuation slot
+#define SC_TRACE_CONT                   (1ULL << 63)
+
+typedef enum {
+    SC_TRACE_APDU = 0,
+    // reader attached, data holds its name
+    SC_TRACE_ATTACH,
+    SC_TRACE_INSERT,
+    SC_TRACE_REMOVE,
+    // scard_submit() request, data holds the command type and argument
+    SC_TRACE_COMMAND,
+    // card status read after the connect, data holds the ATR
+    SC_TRACE_ATR,
+    // reader info taken from the capability cache instead of the reader
+    SC_TRACE_CAPS,
+} scard_trace_type_t;
+
+// SC_TRACE_CAPS data, laid out as the first bytes of the GET_READER_INFORMATION
+// response: 10 bytes of firmware, max send, max recv and the card types (big endian)
+#define SC_TRACE_CAPS_LEN               14
+
+// first slot of a record
+typedef struct {
+    // slot index + 1, written last; 0 or a stale value means the record is not complete
+    uint64_t seq;
+    // CLOCK_MONOTONIC
+    uint64_t ts_ns;
+    uint64_t duration_ns;
+    // PC/SC return code
+    uint32_t rv;
+    uint8_t type;
+    // session slot of the reader
+    uint8_t reader;
+    // slots taken by the record, this one included
+    uint8_t slots;
+    uint8_t reserved;
+    uint16_t send_len;
+    uint16_t recv_len;
+    // command bytes followed by the response bytes, continued in the next slots
+    uint8_t data[SC_TRACE_HEAD_DATA_LEN];
+} scard_trace_record_t;
+
+// rest of the data of a record
+typedef struct {
+    // slot index + 1 with SC_TRACE_CONT set, written before the first slot
+    uint64_t seq;
+    uint8_t data[SC_TRACE_CONT_DATA_LEN];
+} scard_trace_cont_t;
+
+typedef union {
+    scard_trace_record_t record;
+    scard_trace_cont_t cont;
+} scard_trace_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // SC_TRACE_SLOT_LEN
+    uint32_t record_size;
+    // in slots
+    uint32_t capacity;
+    // total number of slots ever claimed, the ring index is head % capacity
+    uint64_t head;
+} scard_trace_header_t;
+
+// recorder; any thread may add records, they are lock free
+bool scard_trace_open(const char *path, unsigned slots);
+// waits for the writers in progress before the file is unmapped
+void scard_trace_close();
+bool scard_trace_enabled();
+void scard_trace_apdu(unsigned reader, uint64_t ts_ns, uint64_t duration_ns, LONG rv,
+    LPCBYTE send_data, DWORD send_len, LPCBYTE recv_data, DWORD recv_len);
+void scard_trace_event(unsigned reader, scard_trace_type_t type, const void *data, unsigned len);
+
+// replays a trace: the readers, card events and responses come from the
+// recorded file and the commands sent by the FSM are checked against it
+extern const scard_transport_t scard_replay_transport;
+
+typedef struct {
+    unsigned long records;
+    unsigned long apdus;
+    // command differs from the recorded one or was not expected at all
+    unsigned long mismatches;
+    // records given up on because the FSM never asked for them
+    unsigned long skipped;
+    // sum of the recorded APDU durations
+    uint64_t recorded_ns;
+} scard_replay_stats_t;
+
+// realtime replays at the recorded pace, otherwise as fast as the FSM goes
+bool scard_replay_load(const char *path, bool realtime);
+unsigned scard_replay_readers();
+const char *scard_replay_reader_name(unsigned reader);
+// scard_submit() request that is due for the reader; the caller submits it
+bool scard_replay_take_command(unsigned reader, scard_command_t *command);
+// gives up on the record the reader is stuck at
+void scard_replay_skip(unsigned reader);
+// number of records consumed so far, used to detect a stall
+unsigned long scard_replay_progress();
+bool scard_replay_done();
+void scard_replay_get_stats(scard_replay_stats_t *stats);
+
+#endif // SCARD_TRACE_H_
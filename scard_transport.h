@@ -0,0 +1,71 @@
+/**
+ *
+ */
+
+#ifndef SCARD_TRANSPORT_H_
+#define SCARD_TRANSPORT_H_
+
+// PC/SC lite
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+// card transport; all the card and reader I/O goes through one of these
+// the calls follow the PC/SC API and return PC/SC status codes
+typedef struct scard_transport {
+    const char *name;
+    LONG (*establish_context)(PSCARDCONTEXT context);
+    LONG (*release_context)(SCARDCONTEXT context);
+    LONG (*list_readers)(SCARDCONTEXT context, LPSTR readers, LPDWORD readers_len);
+    LONG (*get_status_change)(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count);
+    LONG (*connect)(SCARDCONTEXT context, LPCSTR reader, PSCARDHANDLE handle, LPDWORD protocol);
+    LONG (*transmit)(SCARDHANDLE handle, const SCARD_IO_REQUEST *pci, LPCBYTE send_data, DWORD send_len, LPBYTE recv_data, LPDWORD recv_len);
+    LONG (*status)(SCARDHANDLE handle, LPSTR reader_names, LPDWORD reader_len, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atr_len);
+    LONG (*disconnect)(SCARDHANDLE handle, DWORD disposition);
+    LONG (*cancel)(SCARDCONTEXT context);
+} scard_transport_t;
+
+// winscard (pcscd) transport, the default
+extern const scard_transport_t scard_pcsc_transport;
+// in-process SLE4442 card in an ACR38 reader
+extern const scard_transport_t scard_mock_transport;
+
+// must be set before the user thread is started
+void scard_set_transport(const scard_transport_t *transport);
+const scard_transport_t *scard_get_transport();
+
+// mock reader and card control
+#define SC_MOCK_MAX_READERS             8
+#define SC_MOCK_MEMORY_LEN              256
+
+typedef struct {
+    // number of attached readers
+    unsigned readers;
+    // fixed time spent on each transmitted APDU
+    unsigned apdu_latency_us;
+    // time spent per byte moved between the reader and the card
+    unsigned byte_latency_us;
+    // time needed to erase and program one EEPROM byte
+    unsigned eeprom_write_us;
+    // reported by GET_READER_INFORMATION
+    BYTE max_send;
+    BYTE max_recv;
+} scard_mock_config_t;
+
+void scard_mock_default_config(scard_mock_config_t *config);
+void scard_mock_configure(const scard_mock_config_t *config);
+void scard_mock_attach_reader(unsigned reader, bool attached);
+// NULL memory inserts a blank card, NULL psc uses the default PIN (FF FF FF)
+void scard_mock_insert_card(unsigned reader, const BYTE *memory, const BYTE *psc);
+void scard_mock_remove_card(unsigned reader);
+bool scard_mock_card_memory(unsigned reader, LPBYTE memory);
+// the next count transmits on the reader fail with rv, as a flaky reader would
+void scard_mock_fail_transmit(unsigned reader, unsigned count, LONG rv);
+// number of APDUs and EEPROM bytes written since configure
+unsigned long scard_mock_apdu_count();
+unsigned long scard_mock_eeprom_writes();
+
+#endif // SCARD_TRANSPORT_H_
@@ -4,12 +4,23 @@
 
 
 #include "scard.h"
+#include "scard_audit.h"
+#include "scard_fsm.h"
+#include "scard_journal.h"
+#include "scard_ledger.h"
+#include "scard_metrics.h"
+#include "scard_queue.h"
+#include "scard_seqlock.h"
+#include "scard_shm.h"
+#include "scard_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 
 typedef enum {
     STATE_INITIAL,
-    STATE_CHECK_READER,
-    STATE_WAIT_READER,
-    STATE_CHECK_CARD,
     STATE_WAIT_CARD,
     STATE_CONNECT,
     STATE_DISCONNECT,
@@ -19,17 +30,18 @@ typedef enum {
     STATE_PRESENT_PIN,
     STATE_WAIT_USER,
     STATE_UPDATE,
+    STATE_VERIFY,
+    STATE_REJECT,
+    STATE_AUDIT,
     STATE_IDLE,
     STATE_ERROR,
     NUM_STATES } state_t;
+static_assert(NUM_STATES <= SC_METRICS_MAX_STATES, "state metrics too small");
 
 typedef struct instance_data instance_data_t;
 typedef state_t state_func_t( instance_data_t *data );
 
 state_t do_state_initial( instance_data_t *data );
-state_t do_state_check_reader( instance_data_t *data );
-state_t do_state_wait_reader( instance_data_t *data );
-state_t do_state_check_card( instance_data_t *data );
 state_t do_state_wait_card( instance_data_t *data );
 state_t do_state_connect( instance_data_t *data );
 state_t do_state_disconnect( instance_data_t *data );
@@ -39,14 +51,32 @@ state_t do_state_set_pin( instance_data_t *data );
 state_t do_state_present_pin( instance_data_t *data );
 state_t do_state_wait_user( instance_data_t *data );
 state_t do_state_update( instance_data_t *data );
+state_t do_state_verify( instance_data_t *data );
+state_t do_state_reject( instance_data_t *data );
+state_t do_state_audit( instance_data_t *data );
 state_t do_state_idle( instance_data_t *data );
 state_t do_state_error( instance_data_t *data );
 
+static const char *state_names[ NUM_STATES ] = {
+    "INITIAL",
+    "WAIT_CARD",
+    "CONNECT",
+    "DISCONNECT",
+    "IDENTIFY",
+    "READ",
+    "SET_PIN",
+    "PRESENT_PIN",
+    "WAIT_USER",
+    "UPDATE",
+    "VERIFY",
+    "REJECT",
+    "AUDIT",
+    "IDLE",
+    "ERROR"
+};
+
 state_func_t* const state_table[ NUM_STATES ] = {
     do_state_initial,
-    do_state_check_reader,
-    do_state_wait_reader,
-    do_state_check_card,
     do_state_wait_card,
     do_state_connect,
     do_state_disconnect,
@@ -56,16 +86,144 @@ state_func_t* const state_table[ NUM_STATES ] = {
     do_state_present_pin,
     do_state_wait_user,
     do_state_update,
+    do_state_verify,
+    do_state_reject,
+    do_state_audit,
     do_state_idle,
     do_state_error
 };
 
+// every transition a handler may return, anything else does not build
+static constexpr scard_fsm_transition_t transitions[] = {
+    { STATE_INITIAL,        STATE_WAIT_CARD },
+    { STATE_WAIT_CARD,      STATE_WAIT_CARD },
+    { STATE_WAIT_CARD,      STATE_CONNECT },
+    { STATE_CONNECT,        STATE_ERROR },
+    { STATE_CONNECT,        STATE_REJECT },
+    { STATE_CONNECT,        STATE_IDENTIFY },
+    { STATE_DISCONNECT,     STATE_INITIAL },
+    { STATE_IDENTIFY,       STATE_ERROR },
+    { STATE_IDENTIFY,       STATE_READ },
+    { STATE_READ,           STATE_ERROR },
+    { STATE_READ,           STATE_AUDIT },
+    { STATE_READ,           STATE_SET_PIN },
+    { STATE_READ,           STATE_PRESENT_PIN },
+    { STATE_SET_PIN,        STATE_ERROR },
+    { STATE_SET_PIN,        STATE_UPDATE },
+    { STATE_PRESENT_PIN,    STATE_ERROR },
+    { STATE_PRESENT_PIN,    STATE_WAIT_USER },
+    { STATE_WAIT_USER,      STATE_WAIT_USER },
+    { STATE_WAIT_USER,      STATE_UPDATE },
+    { STATE_WAIT_USER,      STATE_VERIFY },
+    { STATE_WAIT_USER,      STATE_DISCONNECT },
+    { STATE_UPDATE,         STATE_ERROR },
+    { STATE_UPDATE,         STATE_WAIT_USER },
+    { STATE_UPDATE,         STATE_VERIFY },
+    { STATE_VERIFY,         STATE_ERROR },
+    { STATE_VERIFY,         STATE_WAIT_USER },
+    { STATE_REJECT,         STATE_REJECT },
+    { STATE_REJECT,         STATE_DISCONNECT },
+    { STATE_AUDIT,          STATE_AUDIT },
+    { STATE_AUDIT,          STATE_DISCONNECT },
+    { STATE_IDLE,           STATE_INITIAL },
+    { STATE_ERROR,          STATE_ERROR },
+    { STATE_ERROR,          STATE_DISCONNECT },
+};
+static_assert(scard_fsm_valid(transitions, NUM_STATES), "broken transition table");
+
+#define GOTO(from, to)                  FSM_GOTO(transitions, from, to)
+
+typedef scard_fsm_t<state_t, instance_data_t, sizeof(transitions) / sizeof(transitions[0])> session_fsm_t;
+
 // user data start in smartcard memory
 #define USER_AREA_ADDRESS       64
-// user data is 16 bytes (4x 32-bit integer)
-#define USER_AREA_LENGTH        16
+// user data is 16 bytes (4x 32-bit integer) followed by the 64-bit card serial;
+// the card header in bytes 0-31 is the same on every card of a batch, the
+// serial is what tells cards apart
+#define USER_AREA_LENGTH        24
+
+// error recovery; the first retry is immediate, the next ones back off
+// exponentially from the minimum, so the last of ERROR_RETRIES_MAX retries
+// waits ERROR_BACKOFF_MAX_US
+#define ERROR_RETRIES_MAX       5
+#define ERROR_BACKOFF_MIN_US    1000
+#define ERROR_BACKOFF_MAX_US    (ERROR_BACKOFF_MIN_US << (ERROR_RETRIES_MAX - 2))
+
+// retries of the same card before giving up on it until it is removed
+static constexpr unsigned error_retries[ SC_NUM_ERRORS ] = {
+    2,      // NONE, e.g. read back data differs, a fresh read sorts it out
+    5,      // TRANSIENT
+    0,      // REMOVED, nothing to retry
+    2,      // SW, a reconnect selects the card type again
+    0,      // PIN, every retry costs an attempt
+    0       // READER, the monitor stops the session
+};
+
+static constexpr bool error_retries_valid()
+{
+    for (unsigned i = 0; i < SC_NUM_ERRORS; i++) {
+        if (error_retries[i] > ERROR_RETRIES_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(error_retries_valid(), "raise ERROR_RETRIES_MAX, backoff would pass ERROR_BACKOFF_MAX_US");
+
+typedef struct {
+    scard_command_t command;
+    scard_completion_t *completion;
+    uint64_t submit_ns;
+    // card the command was meant for, see card_generation
+    unsigned generation;
+} queued_command_t;
 
 struct instance_data {
+    // session, one per attached reader
+    unsigned slot;
+    bool used;
+    // cleared by the monitor to stop the session thread
+    std::atomic<bool> run;
+    pthread_t thread;
+    // UNKNOWN or UNAVAILABLE as the reader reported it, 0 while it is usable;
+    // the monitor waits on it so that only a real change ends the wait, and
+    // only the monitor uses it
+    DWORD unusable_state;
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    scard_reader_t reader;
+    session_fsm_t fsm;
+
+    // events posted by the monitor and scard_submit(), one bit per
+    // scard_event_t; posting takes no lock, the session sleeps on wake_pipe
+    std::atomic<unsigned> events;
+    // session is about to sleep, posters write to wake_pipe only then
+    std::atomic<bool> sleeping;
+    int wake_pipe[2];
+    std::atomic<uint64_t> insert_ns;
+    // bumped with every insert, tells one inserted card from the next
+    unsigned card_generation;
+    // insert time carried over to the card becoming ready, a blank card
+    // is connected twice before that
+    uint64_t ready_from_ns;
+
+    // commands from any thread, taken when the card is ready
+    scard_queue_t<queued_command_t, SC_COMMAND_QUEUE_LEN> commands;
+    // taken from the queue but left for the next batch
+    queued_command_t lookahead;
+    bool has_lookahead;
+    // commands merged into the update in progress
+    queued_command_t batch[SC_COMMAND_QUEUE_LEN];
+    unsigned batch_len;
+    // generation of the connected card
+    unsigned connected_generation;
+
+    // recovery from card errors; retries count up until the card is ready
+    scard_error_class_t error_class;
+    unsigned error_retries;
+    bool error_parked;
+
+    // everything below is forgotten with the card
     uint8_t pin_retries;
     uint8_t pin_code1;
     uint8_t pin_code2;
@@ -76,54 +234,558 @@ struct instance_data {
     uint32_t user_id;
     uint32_t user_total;
     uint32_t user_value;
+    // 0 until the card got one with its first write, see new_card_serial()
+    uint64_t card_serial;
 
     // card readiness
     bool card_ready;
 
-    // update data
+    // user data the update state writes
     uint32_t new_value;
     uint32_t new_id;
-    bool do_update;
+    // journal transaction of the write in flight, 0 if none
+    uint64_t txn;
+    // set by the update state, the verify state records the write in the ledger
+    bool card_written;
+
+    // ledger entry of the card, last seen is from before this visit
+    bool card_known;
+    uint32_t card_topups;
+    uint64_t card_last_seen_ns;
+
+    // blank card being provisioned since, 0 if none
+    uint64_t provision_start_ns;
+    // card exported in audit mode
+    bool audited;
 };
 
+// scard_submit() callers inside a session slot in the low bits, and whether
+// the slot takes commands; outside of instance_data_t, that is cleared on start
+#define GATE_OPEN               0x80000000u
+static std::atomic<uint32_t> _gates[SC_MAX_READERS];
+
+// monitor thread follows reader and card changes and runs the sessions
 static SCARDCONTEXT _context = 0;
 static pthread_t _thread_id = 0;
-static bool _thread_run = true;
-static SCARDHANDLE _card = 0;
-static instance_data_t _data = {0};
+static std::atomic<bool> _thread_run(true);
+// protects session slot allocation and the monitor counters
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static instance_data_t _sessions[SC_MAX_READERS];
+static scard_monitor_stats_t _monitor_stats;
+// published status; card threads write it one at a time, readers take no lock
+static pthread_mutex_t _status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static scard_seqlock_t _status_lock;
+static scard_status_t _status;
+// provisioning mode and its counters per slot
+static std::atomic<bool> _provisioning(false);
+static pthread_mutex_t _provision_mutex = PTHREAD_MUTEX_INITIALIZER;
+static scard_provision_stats_t _provision[SC_MAX_READERS];
+static uint64_t _provision_start_ns;
+// status and completion listener
+static pthread_mutex_t _notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static scard_notify_fn _notify_fn = nullptr;
+static void *_notify_arg = nullptr;
+// signalled when any command completes
+static pthread_mutex_t _completion_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _completion_cond = PTHREAD_COND_INITIALIZER;
 
-static state_t run_state( state_t cur_state, instance_data_t *data )
-{
-    state_t new_state = state_table[cur_state](data);
-    return new_state;
+static const char *command_names[ SC_NUM_CMDS ] = {
+    "TOPUP",
+    "SET_TYPE",
+    "READ",
+    "FORMAT"
+};
+
+static const char *command_status_names[ SC_NUM_CMD_STATUS ] = {
+    "IDLE",
+    "QUEUED",
+    "RUNNING",
+    "DONE",
+    "FAILED",
+    "NO_CARD",
+    "INVALID",
+    "BUSY",
+    "CANCELLED"
 };
 
+static void notify()
+{
+    pthread_mutex_lock(&_notify_mutex);
+    if (_notify_fn) {
+        _notify_fn(_notify_arg);
+    }
+    pthread_mutex_unlock(&_notify_mutex);
+}
+
+static void complete(scard_completion_t *completion, scard_command_status_t status)
+{
+    completion->done_ns = scard_now_ns();
+    // the status is the last thing the owner may rely on
+    pthread_mutex_lock(&_completion_mutex);
+    __atomic_store_n(&completion->status, status, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&_completion_cond);
+    pthread_mutex_unlock(&_completion_mutex);
+    notify();
+}
+
+static bool next_command(instance_data_t *data, queued_command_t *item)
+{
+    if (data->has_lookahead) {
+        *item = data->lookahead;
+        data->has_lookahead = false;
+        return true;
+    }
+    return scard_queue_pop(&data->commands, item);
+}
+
+// every command gets its own line, also when it was merged with others
+static void audit_command(instance_data_t *data, const queued_command_t *item, scard_command_status_t status)
+{
+    INF("%s: %s %u %s, card ID %u value %u, %lu us after submit\n", data->reader.name,
+        command_names[item->command.type], item->command.arg, command_status_names[status],
+        data->user_id, data->user_value, (unsigned long)((scard_now_ns() - item->submit_ns) / 1000));
+    scard_metrics_command(item->command.type, status);
+    scard_completion_t *completion = item->completion;
+    if (completion) {
+        completion->record.magic = data->user_magic;
+        completion->record.id = data->user_id;
+        completion->record.total = data->user_total;
+        completion->record.value = data->user_value;
+        complete(completion, status);
+    }
+}
+
+static void start_command(instance_data_t *data, const queued_command_t *item)
+{
+    assert(data->batch_len < SC_COMMAND_QUEUE_LEN);
+    data->batch[data->batch_len++] = *item;
+    if (item->completion) {
+        item->completion->start_ns = scard_now_ns();
+        __atomic_store_n(&item->completion->status, SC_CMD_RUNNING, __ATOMIC_RELEASE);
+    }
+}
+
+static void finish_batch(instance_data_t *data, scard_command_status_t status)
+{
+    for (unsigned i = 0; i < data->batch_len; i++) {
+        audit_command(data, &data->batch[i], status);
+    }
+    data->batch_len = 0;
+}
+
+// completes every queued command with the status, nothing can be done with them
+static void fail_commands(instance_data_t *data, scard_command_status_t status)
+{
+    finish_batch(data, status);
+    queued_command_t item;
+    while (next_command(data, &item)) {
+        audit_command(data, &item, status);
+    }
+}
+
 static void forget_card(instance_data_t *data)
 {
     TRC("clearing user info..\n");
-    memset(data, 0, sizeof(instance_data_t));
+    memset(&data->pin_retries, 0, sizeof(instance_data_t) - offsetof(instance_data_t, pin_retries));
+}
+
+// reader and card counts for the metrics, under the status lock
+static void publish_gauges()
+{
+    unsigned readers = 0, present = 0, ready = 0;
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        const scard_reader_status_t *status = &_status.readers[slot];
+        readers += status->active;
+        present += status->card_present;
+        ready += status->card_ready;
+    }
+    scard_metrics_gauge(SC_GAUGE_READERS, readers);
+    scard_metrics_gauge(SC_GAUGE_CARDS_PRESENT, present);
+    scard_metrics_gauge(SC_GAUGE_CARDS_READY, ready);
 }
 
+static void publish_session(instance_data_t *data, state_t state)
+{
+    pthread_mutex_lock(&_status_mutex);
+    scard_seqlock_write_begin(&_status_lock);
+    scard_reader_status_t *status = &_status.readers[data->slot];
+    status->state = state;
+    status->card_ready = data->card_ready;
+    status->card_class = data->reader.card_class;
+    status->error_class = data->error_class;
+    status->pin_retries = data->pin_retries;
+    status->user_magic = data->user_magic;
+    status->user_id = data->user_id;
+    status->user_total = data->user_total;
+    status->user_value = data->user_value;
+    status->card_known = data->card_known;
+    status->card_topups = data->card_topups;
+    status->card_last_seen_ns = data->card_last_seen_ns;
+    _status.version++;
+    scard_seqlock_write_end(&_status_lock);
+    // only this thread changes the FSM counters, no need for their lock
+    scard_shm_update(data->slot, status, _status.version, &data->fsm.stats);
+    publish_gauges();
+    pthread_mutex_unlock(&_status_mutex);
+    notify();
+}
 
-static void *thread_fnc(void *ptr)
+static void publish_reader(instance_data_t *data)
+{
+    pthread_mutex_lock(&_status_mutex);
+    scard_seqlock_write_begin(&_status_lock);
+    scard_reader_status_t *status = &_status.readers[data->slot];
+    if (data->used) {
+        status->active = true;
+        strncpy(status->name, data->reader.name, SC_MAX_READERNAME_LEN);
+        status->card_present = (scard_get_reader_state(&data->reader) & SCARD_STATE_PRESENT) ? true : false;
+    } else {
+        memset(status, 0, sizeof(scard_reader_status_t));
+    }
+    _status.version++;
+    scard_seqlock_write_end(&_status_lock);
+    scard_shm_update(data->slot, status, _status.version, NULL);
+    publish_gauges();
+    pthread_mutex_unlock(&_status_mutex);
+    notify();
+}
+
+static void post_event(instance_data_t *data, scard_event_t event)
+{
+    // recorded before the session can act on it, replay relies on the order
+    if (event == SC_EVENT_INSERT) {
+        scard_trace_event(data->slot, SC_TRACE_INSERT, NULL, 0);
+    } else if (event == SC_EVENT_REMOVE) {
+        scard_trace_event(data->slot, SC_TRACE_REMOVE, NULL, 0);
+    }
+
+    if (event == SC_EVENT_INSERT) {
+        data->insert_ns.store(scard_now_ns(), std::memory_order_relaxed);
+        __atomic_add_fetch(&data->card_generation, 1, __ATOMIC_RELEASE);
+    }
+    data->events.fetch_or(1 << event, std::memory_order_seq_cst);
+    // a session that is not about to sleep sees the bit before it does
+    if (data->sleeping.load(std::memory_order_seq_cst)) {
+        char wake = 0;
+        ssize_t rv = write(data->wake_pipe[1], &wake, 1);
+        _UNUSED(rv);
+    }
+}
+
+// takes the most urgent pending event, false if there is none
+static bool take_event(instance_data_t *data, scard_event_t *event)
+{
+    unsigned events = data->events.load(std::memory_order_acquire);
+    if (events == 0) {
+        return false;
+    }
+    // only the session clears bits
+    int bit = __builtin_ctz(events);
+    data->events.fetch_and(~(1 << bit), std::memory_order_acq_rel);
+    *event = (scard_event_t)bit;
+    return true;
+}
+
+// sleeps until an event is posted or the deadline passed, 0 sleeps for good
+static void sleep_event(instance_data_t *data, uint64_t deadline_ns)
+{
+    data->sleeping.store(true, std::memory_order_seq_cst);
+    if (data->events.load(std::memory_order_seq_cst) == 0) {
+        int timeout_ms = -1;
+        if (deadline_ns) {
+            uint64_t now = scard_now_ns();
+            timeout_ms = (deadline_ns > now) ? (deadline_ns - now + 999999) / 1000000 : 0;
+        }
+        struct pollfd fd;
+        fd.fd = data->wake_pipe[0];
+        fd.events = POLLIN;
+        fd.revents = 0;
+        poll(&fd, 1, timeout_ms);
+    }
+    data->sleeping.store(false, std::memory_order_relaxed);
+    // the events themselves are in the bit mask, the bytes only wake
+    char buf[16];
+    while (read(data->wake_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+// takes the most urgent pending event, waits for one if there is none
+static scard_event_t wait_event(instance_data_t *data)
 {
-    state_t cur_state = STATE_INITIAL;
+    scard_event_t event;
+    while (! take_event(data, &event)) {
+        sleep_event(data, 0);
+    }
+    return event;
+}
+
+// same as wait_event() but gives up after the timeout, false if it did
+static bool wait_event_timeout(instance_data_t *data, uint64_t timeout_us, scard_event_t *event)
+{
+    uint64_t deadline = scard_now_ns() + timeout_us * 1000;
+    while (! take_event(data, event)) {
+        if (scard_now_ns() >= deadline) {
+            return false;
+        }
+        sleep_event(data, deadline);
+    }
+    return true;
+}
+
+static void *session_fnc(void *ptr)
+{
+    instance_data_t *data = (instance_data_t *)ptr;
     unsigned fsm_loop = 0;
 
+    DBG("session for %s started\n", data->reader.name);
+    while (data->run.load(std::memory_order_acquire)) {
+        fsm_loop++;
+        TRC("%s loop, #%d ..\n", data->reader.name, fsm_loop);
+
+        uint64_t start_ns = scard_now_ns();
+        state_t state = scard_fsm_state(&data->fsm);
+        state_t next = scard_fsm_step(&data->fsm, data, scard_now_ns);
+        scard_metrics_state(state, scard_now_ns() - start_ns);
+        if (next != state) {
+            TRC("%s -> %s\n", state_names[state], state_names[next]);
+        }
+        publish_session(data, next);
+    }
+
+    if (data->card) {
+        forget_card(data);
+        scard_disconnect_card(&data->reader, &data->card);
+    }
+    DBG("session for %s finished\n", data->reader.name);
+    return 0;
+}
+
+static bool start_session(unsigned slot, LPCSTR name)
+{
+    instance_data_t *data = &_sessions[slot];
+    SCARDCONTEXT context = 0;
+    // each session has its own context for its card handle
+    if (! scard_create_context(&context)) {
+        return false;
+    }
+    // wakes the session, neither end may block
+    int wake_pipe[2];
+    if (pipe(wake_pipe) != 0) {
+        ERR("failed to create pipe: %s\n", strerror(errno));
+        scard_destroy_context(&context);
+        return false;
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_lock(&_mutex);
+    memset((void *)data, 0, sizeof(instance_data_t));
+    scard_reader_init(&data->reader, name);
+    data->reader.id = slot;
+    data->slot = slot;
+    data->wake_pipe[0] = wake_pipe[0];
+    data->wake_pipe[1] = wake_pipe[1];
+    scard_queue_init(&data->commands);
+    scard_fsm_init(&data->fsm, state_table, transitions, NUM_STATES, STATE_INITIAL, scard_now_ns());
+    data->context = context;
+    data->run.store(true, std::memory_order_relaxed);
+    data->used = true;
+    _monitor_stats.events[SC_EVENT_ATTACH]++;
+    pthread_mutex_unlock(&_mutex);
+    scard_trace_event(slot, SC_TRACE_ATTACH, name, strlen(name));
+    publish_reader(data);
+    publish_session(data, STATE_INITIAL);
+
+    int rv = pthread_create(&data->thread, NULL, session_fnc, data);
+    if (rv) {
+        ERR("Error - pthread_create() return code: %d\n", rv);
+        pthread_mutex_lock(&_mutex);
+        data->used = false;
+        scard_reader_destroy(&data->reader);
+        close(data->wake_pipe[0]);
+        close(data->wake_pipe[1]);
+        scard_fsm_destroy(&data->fsm);
+        pthread_mutex_unlock(&_mutex);
+        scard_destroy_context(&context);
+        // the slot was published as active above
+        publish_reader(data);
+        return false;
+    }
+    // open for scard_submit()
+    _gates[slot].fetch_or(GATE_OPEN, std::memory_order_release);
+    INF("reader %s attached to slot %u\n", name, slot);
+    return true;
+}
+
+static void stop_session(unsigned slot)
+{
+    instance_data_t *data = &_sessions[slot];
+    // no more commands, and wait for the submits in progress to leave
+    _gates[slot].fetch_and(~GATE_OPEN, std::memory_order_relaxed);
+    while (_gates[slot].load(std::memory_order_acquire) & ~GATE_OPEN) {
+        sched_yield();
+    }
+    data->run.store(false, std::memory_order_release);
+    post_event(data, SC_EVENT_DETACH);
+    pthread_join(data->thread, NULL);
+    INF("reader %s detached from slot %u\n", data->reader.name, slot);
+
+    pthread_mutex_lock(&_mutex);
+    data->used = false;
+    // no one can queue more now
+    fail_commands(data, SC_CMD_CANCELLED);
+    _monitor_stats.events[SC_EVENT_DETACH]++;
+    scard_destroy_context(&data->context);
+    scard_reader_destroy(&data->reader);
+    close(data->wake_pipe[0]);
+    close(data->wake_pipe[1]);
+    scard_fsm_destroy(&data->fsm);
+    pthread_mutex_unlock(&_mutex);
+    publish_reader(data);
+}
+
+static void sync_sessions()
+{
+    char names[SC_MAX_READERS][SC_MAX_READERNAME_LEN+1];
+    unsigned count = scard_list_readers(_context, names, SC_MAX_READERS);
+
+    // stop sessions of detached readers
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        if (! _sessions[slot].used) {
+            continue;
+        }
+        bool listed = false;
+        for (unsigned i = 0; i < count; i++) {
+            listed |= (strcmp(names[i], _sessions[slot].reader.name) == 0);
+        }
+        if (! listed) {
+            stop_session(slot);
+        }
+    }
+
+    // start sessions for new readers
+    for (unsigned i = 0; i < count; i++) {
+        int free_slot = -1;
+        bool known = false;
+        for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+            if (_sessions[slot].used) {
+                known |= (strcmp(names[i], _sessions[slot].reader.name) == 0);
+            } else if (free_slot < 0) {
+                free_slot = slot;
+            }
+        }
+        if (! known && free_slot >= 0) {
+            start_session(free_slot, names[i]);
+        }
+    }
+}
+
+// turns a reader state change into card events for its session
+static void reader_changed(instance_data_t *data, DWORD state)
+{
+    DWORD old_state = scard_get_reader_state(&data->reader);
+    scard_set_reader_state(&data->reader, state);
+    publish_reader(data);
+
+    bool was_present = (old_state & SCARD_STATE_PRESENT);
+    bool is_present = (state & SCARD_STATE_PRESENT);
+    // upper 16 bits count the card events, catches a quick remove and insert
+    bool swapped = was_present && is_present && ((old_state ^ state) & 0xFFFF0000);
+    if (was_present && (! is_present || swapped)) {
+        post_event(data, SC_EVENT_REMOVE);
+        pthread_mutex_lock(&_mutex);
+        _monitor_stats.events[SC_EVENT_REMOVE]++;
+        pthread_mutex_unlock(&_mutex);
+    }
+    if (is_present && (! was_present || swapped)) {
+        post_event(data, SC_EVENT_INSERT);
+        scard_metrics_count(SC_COUNTER_CARD_INSERTS);
+        pthread_mutex_lock(&_mutex);
+        _monitor_stats.events[SC_EVENT_INSERT]++;
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+static void *thread_fnc(void *ptr)
+{
     bool rv = scard_create_context(&_context);
     DBG("created CONTEXT 0x%08lX\n", _context);
     assert(rv != false);
 
-    while (1) {
-        fsm_loop++;
-        TRC("loop, #%d ..\n", fsm_loop);
-        (void)fflush(stdout);
+    // PnP pseudo reader first, followed by every known reader
+    SCARD_READERSTATE states[1 + SC_MAX_READERS];
+    unsigned slots[1 + SC_MAX_READERS];
+    DWORD pnp_state = SCARD_STATE_UNAWARE;
+    bool readers_changed = true;
+    while (_thread_run) {
+        if (readers_changed) {
+            sync_sessions();
+            readers_changed = false;
+        }
 
-        cur_state = run_state(cur_state, &_data);
+        DWORD count = 0;
+        memset(states, 0, sizeof(states));
+        states[count].szReader = "\\\\?PnP?\\Notification";
+        states[count].dwCurrentState = pnp_state;
+        count++;
+        for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+            if (_sessions[slot].used) {
+                slots[count] = slot;
+                states[count].szReader = _sessions[slot].reader.name;
+                states[count].dwCurrentState = _sessions[slot].unusable_state
+                    ? _sessions[slot].unusable_state : scard_get_reader_state(&_sessions[slot].reader);
+                count++;
+            }
+        }
 
-        if (! _thread_run) {
-            TRC("stopping thread ..\n");
-            break;
+        DBG("waiting for reader or card change..\n");
+        LONG rv = scard_wait_for_change(_context, states, count, INFINITE);
+        // this point is reached if something has changed or user canceled the wait
+        pthread_mutex_lock(&_mutex);
+        _monitor_stats.wakeups++;
+        pthread_mutex_unlock(&_mutex);
+        if (rv != SCARD_S_SUCCESS) {
+            if (rv != SCARD_E_CANCELLED && rv != SCARD_E_TIMEOUT) {
+                // service went away or similar, start over with a fresh view
+                pnp_state = SCARD_STATE_UNAWARE;
+                readers_changed = true;
+                usleep(100000);
+            }
+            continue;
+        }
+
+        if (states[0].dwEventState & SCARD_STATE_CHANGED) {
+            // number of readers is kept in the upper 16 bits of the PnP state
+            pnp_state = states[0].dwEventState & ~SCARD_STATE_CHANGED;
+            readers_changed = true;
+        }
+        for (DWORD i = 1; i < count; i++) {
+            DWORD state = states[i].dwEventState;
+            if (! (state & SCARD_STATE_CHANGED)) {
+                continue;
+            }
+            instance_data_t *data = &_sessions[slots[i]];
+            if (state & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE)) {
+                // reader is going away or busy; it stays watched, from the
+                // state it reported so that the next wait blocks until that
+                // changes, and the card state from before is kept
+                data->unusable_state = state & ~SCARD_STATE_CHANGED;
+                readers_changed = true;
+                continue;
+            }
+            // usable again, card changes meanwhile are seen against the
+            // state from before
+            data->unusable_state = 0;
+            reader_changed(data, state & ~SCARD_STATE_CHANGED);
+        }
+    }
+
+    TRC("stopping thread ..\n");
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        if (_sessions[slot].used) {
+            stop_session(slot);
         }
     }
 
@@ -156,9 +818,9 @@ void scard_user_thread_stop()
 
 void scard_cancel_wait(const SCARDCONTEXT context)
 {
-    // cancel waiting SCardEstablishContext() inside the thread
+    // cancel waiting SCardGetStatusChange() inside the thread
     if (context) {
-        LONG rv = SCardCancel(context);
+        LONG rv = scard_get_transport()->cancel(context);
         CHECK("SCardCancel", rv);
     }
     DBG("Canceled wait for a change..\n");
@@ -167,131 +829,261 @@ void scard_cancel_wait(const SCARDCONTEXT context)
 
 
 
-state_t do_state_initial( instance_data_t *data )
+static bool card_serial_valid(uint64_t serial)
 {
-    TRC(">>>\n");
-    scard_detect_reader(_context);
-    return STATE_CHECK_READER;
+    // erased memory reads as all ones
+    return serial != 0 && serial != UINT64_MAX;
 }
 
-state_t do_state_check_reader( instance_data_t *data )
+// random, so that hosts provisioning cards on their own do not hand out
+// the same serial twice
+static uint64_t new_card_serial()
 {
-    TRC(">>>\n");
-    if (! scard_reader_presence()) {
-        return STATE_WAIT_READER;
+    uint64_t serial = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &serial, sizeof(serial)) != (ssize_t)sizeof(serial)) {
+            serial = 0;
+        }
+        close(fd);
     }
-    return STATE_CHECK_CARD;
+    while (! card_serial_valid(serial)) {
+        ERR("no random card serial, deriving one from the clock\n");
+        serial = (scard_wall_ns() ^ scard_now_ns()) * 0x9E3779B97F4A7C15ULL;
+    }
+    return serial;
 }
 
-state_t do_state_wait_reader( instance_data_t *data )
+static void set_user_data(instance_data_t *data, const BYTE *bytes)
 {
-    TRC(">>>\n");
-    DBG("NO READER\n");
-    DBG("waiting for reader..\n");
-    scard_reset_reader_state();
-    scard_reset_card_state();
-    scard_wait_for_reader(_context, INFINITE);
-    // this point is reached if state has changed or user canceled the wait
-    return STATE_INITIAL;
+    data->user_magic = *(uint32_t *)&bytes[0];
+    data->user_id = *(uint32_t *)&bytes[4];
+    data->user_total = *(uint32_t *)&bytes[8];
+    data->user_value = *(uint32_t *)&bytes[12];
+    uint64_t serial = *(uint64_t *)&bytes[16];
+    data->card_serial = card_serial_valid(serial) ? serial : 0;
+    DBG("MAGIC: %u\n", data->user_magic);
+    DBG("CARD ID: %u\n", data->user_id);
+    DBG("TOTAL: %u\n", data->user_total);
+    DBG("VALUE: %u\n", data->user_value);
+    DBG("SERIAL: %016llX\n", (unsigned long long)data->card_serial);
 }
 
-state_t do_state_check_card( instance_data_t *data )
+typedef enum {
+    PROVISION_DONE,
+    PROVISION_FAILED,
+    PROVISION_SKIPPED,
+} provision_result_t;
+
+static void count_provision(instance_data_t *data, provision_result_t result)
+{
+    uint64_t now = scard_now_ns();
+    pthread_mutex_lock(&_provision_mutex);
+    scard_provision_stats_t *stats = &_provision[data->slot];
+    strncpy(stats->name, data->reader.name, SC_MAX_READERNAME_LEN);
+    if (result == PROVISION_DONE) {
+        uint64_t time_ns = now - data->provision_start_ns;
+        stats->provisioned++;
+        stats->time_ns += time_ns;
+        if (time_ns > stats->time_max_ns) {
+            stats->time_max_ns = time_ns;
+        }
+        stats->last_ns = now;
+        scard_metrics_timer(SC_TIMER_PROVISION, time_ns);
+    } else if (result == PROVISION_FAILED) {
+        stats->failed++;
+    } else {
+        stats->skipped++;
+    }
+    pthread_mutex_unlock(&_provision_mutex);
+    data->provision_start_ns = 0;
+}
+
+// the ledger is looked up here, on the session thread, and never by the UI
+static void record_card(instance_data_t *data, uint32_t topups)
+{
+    if (! data->card_serial) {
+        // written before serials, the ledger learns about it with its next write
+        return;
+    }
+    scard_ledger_entry_t previous;
+    bool found = scard_ledger_record(data->card_serial, data->user_id, data->user_value,
+        data->user_total, topups, &previous);
+    if (topups) {
+        data->card_topups += topups;
+    } else if (found) {
+        // first read of this visit
+        data->card_known = true;
+        data->card_topups = previous.topups;
+        data->card_last_seen_ns = previous.last_seen_ns;
+        INF("card ID %u seen before, %u top-ups\n", data->user_id, previous.topups);
+    }
+}
+
+static void set_card_ready(instance_data_t *data)
+{
+    data->card_ready = true;
+    data->error_class = SC_ERROR_NONE;
+    data->error_retries = 0;
+    // once per inserted card, not after every write
+    if (data->ready_from_ns) {
+        scard_metrics_count(SC_COUNTER_CARDS_READY);
+        scard_metrics_timer(SC_TIMER_INSERT_TO_READY, scard_now_ns() - data->ready_from_ns);
+        data->ready_from_ns = 0;
+    }
+}
+
+state_t do_state_initial( instance_data_t *data )
 {
     TRC(">>>\n");
-    DBG("READER %s\n", scard_reader_name());
-    DBG("probing for card..\n");
-    scard_wait_for_card(_context, 1);
-    if (! scard_card_presence()) {
-        return STATE_WAIT_CARD;
+    scard_reset_card_state(&data->reader);
+    if (! scard_card_presence(&data->reader)) {
+        // next card starts with a clean slate
+        data->ready_from_ns = 0;
+        data->error_class = SC_ERROR_NONE;
+        data->error_retries = 0;
     }
-    return STATE_CONNECT;
+    // card events from before are stale, the reader state tells if a card is in
+    data->events.fetch_and(~((1 << SC_EVENT_INSERT) | (1 << SC_EVENT_REMOVE)), std::memory_order_acq_rel);
+    return GOTO(STATE_INITIAL, STATE_WAIT_CARD);
 }
 
 state_t do_state_wait_card( instance_data_t *data )
 {
     TRC(">>>\n");
+    DBG("READER %s\n", data->reader.name);
+    if (scard_card_presence(&data->reader)) {
+        return GOTO(STATE_WAIT_CARD, STATE_CONNECT);
+    }
     DBG("NO CARD!\n");
+    // whatever is still queued was meant for a card that is gone
+    fail_commands(data, SC_CMD_NO_CARD);
+    if (scard_audit_enabled()) {
+        // reader is idle, the exports of the last card go to disk now
+        // instead of when the buffers fill up or audit mode ends
+        scard_audit_flush();
+    }
     DBG("waiting for card insert..\n");
-    scard_reset_card_state();
-    scard_wait_for_card(_context, INFINITE);
-    // this point is reached if state has changed or user canceled the wait
-    return STATE_INITIAL;
+    scard_event_t event = wait_event(data);
+    if (event == SC_EVENT_INSERT) {
+        return GOTO(STATE_WAIT_CARD, STATE_CONNECT);
+    }
+    if (event == SC_EVENT_COMMAND) {
+        fail_commands(data, SC_CMD_NO_CARD);
+    }
+    return GOTO(STATE_WAIT_CARD, STATE_WAIT_CARD);
 }
 
 state_t do_state_connect( instance_data_t *data )
 {
     TRC(">>>\n");
-    if (! scard_connect_card(_context, &_card)) {
-        return STATE_INITIAL;
+    if (! scard_connect_card(data->context, &data->reader, &data->card)) {
+        return GOTO(STATE_CONNECT, STATE_ERROR);
+    }
+
+    uint64_t insert_ns = data->insert_ns.exchange(0, std::memory_order_relaxed);
+    data->connected_generation = __atomic_load_n(&data->card_generation, __ATOMIC_ACQUIRE);
+    if (insert_ns) {
+        data->ready_from_ns = insert_ns;
+        uint64_t latency = scard_now_ns() - insert_ns;
+        pthread_mutex_lock(&_mutex);
+        _monitor_stats.connects++;
+        _monitor_stats.insert_to_connect_ns += latency;
+        if (latency > _monitor_stats.insert_to_connect_max_ns) {
+            _monitor_stats.insert_to_connect_max_ns = latency;
+        }
+        pthread_mutex_unlock(&_mutex);
+        DBG("insert to connect %lu us\n", (unsigned long)(latency / 1000));
+    }
+
+    // tell the card apart before any APDU goes out
+    if (! scard_read_atr(&data->reader, data->card)) {
+        return GOTO(STATE_CONNECT, STATE_ERROR);
+    }
+    if (! scard_card_class_supported(data->reader.card_class)) {
+        INF("%s card in %s is not supported, remove it\n",
+            scard_card_class_name(data->reader.card_class), data->reader.name);
+        return GOTO(STATE_CONNECT, STATE_REJECT);
     }
-    return STATE_IDENTIFY;
+    return GOTO(STATE_CONNECT, STATE_IDENTIFY);
 }
 
 state_t do_state_disconnect( instance_data_t *data )
 {
     TRC(">>>\n");
+    if (data->provision_start_ns) {
+        // removed or failed before the read back
+        count_provision(data, PROVISION_FAILED);
+    }
     forget_card(data);
-    scard_disconnect_card(&_card);
-    return STATE_INITIAL;
+    scard_disconnect_card(&data->reader, &data->card);
+    return GOTO(STATE_DISCONNECT, STATE_INITIAL);
 }
 
 state_t do_state_identify( instance_data_t *data )
 {
     TRC(">>>\n");
-    if (! scard_get_reader_info(_card)) {
-        return STATE_DISCONNECT;
-    }
-    if (! scard_select_memory_card(_card)) {
-        return STATE_DISCONNECT;
+    if (! scard_identify_reader(&data->reader, data->card)) {
+        return GOTO(STATE_IDENTIFY, STATE_ERROR);
     }
     data->pin_retries = 0xFF;
     data->pin_code1 = data->pin_code2 = data->pin_code3 = 0xFF;
-    if (! scard_get_error_counter(_card, &data->pin_code1, &data->pin_code2, &data->pin_code3, &data->pin_retries)) {
-        return STATE_DISCONNECT;
+    if (! scard_get_error_counter(&data->reader, data->card, &data->pin_code1, &data->pin_code2, &data->pin_code3, &data->pin_retries)) {
+        return GOTO(STATE_IDENTIFY, STATE_ERROR);
     }
-    return STATE_READ;
+    // one bit per attempt left
+    scard_metrics_pin_retries(__builtin_popcount(data->pin_retries & 0x07));
+    return GOTO(STATE_IDENTIFY, STATE_READ);
 }
 
 state_t do_state_read( instance_data_t *data )
 {
     TRC(">>>\n");
+    // one bulk read of the whole card, the fields below come from the image
+    if (! scard_read_card_image(&data->reader, data->card)) {
+        return GOTO(STATE_READ, STATE_ERROR);
+    }
     BYTE bytes[USER_AREA_LENGTH];
-    if (! scard_read_user_data(_card, USER_AREA_ADDRESS, bytes, USER_AREA_LENGTH)) {
-        return STATE_DISCONNECT;
+    if (! scard_read_user_data(&data->reader, data->card, USER_AREA_ADDRESS, bytes, USER_AREA_LENGTH)) {
+        return GOTO(STATE_READ, STATE_ERROR);
     }
-    data->user_magic = *(uint32_t *)&bytes[0];
-    data->user_id = *(uint32_t *)&bytes[4];
-    data->user_total = *(uint32_t *)&bytes[8];
-    data->user_value = *(uint32_t *)&bytes[12];
-    DBG("MAGIC: %u\n", data->user_magic);
-    DBG("CARD ID: %u\n", data->user_id);
-    DBG("TOTAL: %u\n", data->user_total);
-    DBG("VALUE: %u\n", data->user_value);
-    
+    set_user_data(data, bytes);
+    if (scard_audit_enabled()) {
+        // the error counter came with identify, nothing more is needed
+        return GOTO(STATE_READ, STATE_AUDIT);
+    }
+    // a write that was cut short by a crash or a pulled card shows up here
+    scard_journal_reconcile(data->card_serial, data->user_id, data->user_value);
+
     if (data->user_magic == 0xFFFFFFFF) {
         // we have a new, vanilla, card
-        return STATE_SET_PIN;
+        if (_provisioning.load(std::memory_order_relaxed)) {
+            data->provision_start_ns = scard_now_ns();
+        }
+        return GOTO(STATE_READ, STATE_SET_PIN);
+    }
+    if (_provisioning.load(std::memory_order_relaxed)) {
+        count_provision(data, PROVISION_SKIPPED);
     }
+    record_card(data, 0);
 
     data->card_ready = true;
-    return STATE_PRESENT_PIN;
+    return GOTO(STATE_READ, STATE_PRESENT_PIN);
 }
 
 state_t do_state_set_pin( instance_data_t *data )
 {
     TRC(">>>\n");
 
-    // UNTESTED !!!!
-
     // use default PIN here!!!
     data->pin_retries = 0xFF;
-    if (! scard_present_pin(_card, 0xFF, 0xFF, 0xFF, &data->pin_retries)) {
-        return STATE_ERROR;
+    if (! scard_present_pin(&data->reader, data->card, 0xFF, 0xFF, 0xFF, &data->pin_retries)) {
+        return GOTO(STATE_SET_PIN, STATE_ERROR);
     }
 
     // use our PIN here!!!
-    if (! scard_change_pin(_card, SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3)) {
-        return STATE_ERROR;
+    if (! scard_change_pin(&data->reader, data->card, SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3)) {
+        return GOTO(STATE_SET_PIN, STATE_ERROR);
     }
     DBG("Card PIN updated!\n");
 
@@ -305,69 +1097,251 @@ state_t do_state_set_pin( instance_data_t *data )
     data->new_value = 0;
 
     // perform initialization of the blank card now
-    return STATE_UPDATE;
+    return GOTO(STATE_SET_PIN, STATE_UPDATE);
 }
 
 state_t do_state_present_pin( instance_data_t *data )
 {
     TRC(">>>\n");
     data->pin_retries = 0xFF;
-    if (! scard_present_pin(_card, SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3, &data->pin_retries)) {
-        return STATE_ERROR;
+    if (! scard_present_pin(&data->reader, data->card, SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3, &data->pin_retries)) {
+        return GOTO(STATE_PRESENT_PIN, STATE_ERROR);
     }
-    return STATE_WAIT_USER;
+    set_card_ready(data);
+    return GOTO(STATE_PRESENT_PIN, STATE_WAIT_USER);
 }
 
-state_t do_state_wait_user( instance_data_t *data )
+static bool card_events_pending(instance_data_t *data)
+{
+    return data->events.load(std::memory_order_acquire) & ((1 << SC_EVENT_DETACH) | (1 << SC_EVENT_REMOVE));
+}
+
+// user data after the command, false if the command is not possible
+static bool apply_command(const scard_command_t *command, uint32_t *id, uint32_t *value)
+{
+    switch (command->type) {
+    case SC_CMD_TOPUP:
+        if (command->arg > UINT32_MAX - *value) {
+            return false;
+        }
+        // add new value to remaining user value
+        *id = SC_REGULAR_ID;
+        *value += command->arg;
+        return true;
+    case SC_CMD_SET_TYPE:
+        *value = (command->arg == SC_REGULAR_ID) ? *value : 0;
+        *id = command->arg;
+        return true;
+    case SC_CMD_FORMAT:
+        *id = SC_REGULAR_ID;
+        *value = 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// takes the queued commands for the card; the writes in a row are folded
+// into one net update, a read ends the batch and runs on its own
+static state_t start_batch( instance_data_t *data )
 {
-    DBG("waiting for user UPDATE..\n");
-    scard_wait_for_card(_context, INFINITE);
-    // this point is reached if state has changed or user canceled the wait
+    uint32_t id = data->user_id;
+    uint32_t value = data->user_value;
+    queued_command_t item;
+    while (data->batch_len < SC_COMMAND_QUEUE_LEN && next_command(data, &item)) {
+        if (item.generation != data->connected_generation) {
+            // submitted for a card that is gone by now
+            audit_command(data, &item, SC_CMD_NO_CARD);
+            continue;
+        }
+        if (item.command.type == SC_CMD_READ) {
+            if (data->batch_len) {
+                data->lookahead = item;
+                data->has_lookahead = true;
+                break;
+            }
+            start_command(data, &item);
+            // straight from the card, not from the image
+            return GOTO(STATE_WAIT_USER, STATE_VERIFY);
+        }
+        if (! apply_command(&item.command, &id, &value)) {
+            audit_command(data, &item, SC_CMD_INVALID);
+            continue;
+        }
+        start_command(data, &item);
+    }
+    if (data->batch_len == 0) {
+        return GOTO(STATE_WAIT_USER, STATE_WAIT_USER);
+    }
+    if (data->batch_len > 1) {
+        DBG("%u commands merged into one update\n", data->batch_len);
+    }
+    data->new_id = id;
+    data->new_value = value;
+    return GOTO(STATE_WAIT_USER, STATE_UPDATE);
+}
 
-    if (! data->do_update) {
-        return STATE_DISCONNECT;
+state_t do_state_wait_user( instance_data_t *data )
+{
+    // queued commands go first unless the card is already gone
+    if (! card_events_pending(data) && (data->has_lookahead || scard_queue_pending(&data->commands))) {
+        return start_batch(data);
     }
 
-    // clear flag; perform update only once
-    data->do_update = false;
-    return STATE_UPDATE;
+    DBG("waiting for user command..\n");
+    scard_event_t event = wait_event(data);
+    // this point is reached if the card was removed or user queued a command
+
+    if (event == SC_EVENT_INSERT) {
+        // stale insert from before the connect
+        return GOTO(STATE_WAIT_USER, STATE_WAIT_USER);
+    }
+    if (event != SC_EVENT_COMMAND) {
+        return GOTO(STATE_WAIT_USER, STATE_DISCONNECT);
+    }
+    return start_batch(data);
 }
 
 state_t do_state_update( instance_data_t *data )
 {
     TRC(">>>\n");
 
-    uint32_t value = 0;
-    if (data->new_id == SC_REGULAR_ID) {
-        // add new value to remaining user value
-        value = data->user_value + data->new_value;
-    }
+    uint32_t value = data->new_value;
 
     // always use latest magic value!
     uint32_t magic = SC_MAGIC_VALUE;
-    // 4x 32-bit integer in order: magic, ID, total, value
+    // blank cards get their serial with the write after SET_PIN, cards from
+    // before serials with their next write
+    uint64_t serial = data->card_serial ? data->card_serial : new_card_serial();
+    // 4x 32-bit integer in order: magic, ID, total, value, then the serial
     BYTE bytes[USER_AREA_LENGTH] = {0};
     *(uint32_t *)&bytes[0] = magic;
     *(uint32_t *)&bytes[4] = data->new_id;
     // set value and total to be equal
     *(uint32_t *)&bytes[8] = value;
     *(uint32_t *)&bytes[12] = value;
-    printf("new MAGIC %u\n", magic);
-    printf("new ID    %u\n", data->new_id);
-    printf("new TOTAL %u\n", value);
-    printf("new VALUE %u\n", value);
-    for (int i = 0; i < USER_AREA_LENGTH; i++) {
-        printf("%02X ", *(bytes + i));
+    *(uint64_t *)&bytes[16] = serial;
+    DBG("new MAGIC %u ID %u TOTAL %u VALUE %u SERIAL %016llX\n", magic, data->new_id, value, value,
+        (unsigned long long)serial);
+    DBG_HEX("new user data", bytes, USER_AREA_LENGTH);
+
+    // the intent is on disk before the card is touched
+    data->txn = scard_journal_intent(data->slot, serial, scard_card_hash(&data->reader),
+        data->user_id, data->new_id, data->user_value, value);
+    if (! data->txn && scard_journal_enabled()) {
+        ERR("journal append failed, card left as is\n");
+        finish_batch(data, SC_CMD_FAILED);
+        return GOTO(STATE_UPDATE, STATE_WAIT_USER);
     }
-    printf("\n");
 
-    if (! scard_write_card(_card, USER_AREA_ADDRESS, bytes, USER_AREA_LENGTH)) {
-        return STATE_ERROR;
+    // on failure the transaction stays open until the card is read again
+    if (! scard_write_card(&data->reader, data->card, USER_AREA_ADDRESS, bytes, USER_AREA_LENGTH)) {
+        data->txn = 0;
+        finish_batch(data, SC_CMD_FAILED);
+        return GOTO(STATE_UPDATE, STATE_ERROR);
+    }
+    for (unsigned i = 0; i < data->batch_len; i++) {
+        scard_metrics_timer(SC_TIMER_UPDATE_TO_WRITTEN, scard_now_ns() - data->batch[i].submit_ns);
     }
+    data->card_written = true;
+    scard_write_stats_t stats;
+    scard_get_write_stats(&data->reader, &stats);
     DBG("Card updated, new value/total %u!\n", value);
+    INF("update wrote %u bytes in %u APDUs\n", stats.bytes_written, stats.apdus);
 
-    // force re-connect of the card, and re-read
-    return STATE_DISCONNECT;
+    // card stays connected, only the written range is read back
+    return GOTO(STATE_UPDATE, STATE_VERIFY);
+}
+
+state_t do_state_verify( instance_data_t *data )
+{
+    TRC(">>>\n");
+    if (! scard_verify_card(&data->reader, data->card, USER_AREA_ADDRESS, USER_AREA_LENGTH)) {
+        // reconnect and start over with a full read, that settles the journal
+        data->txn = 0;
+        finish_batch(data, SC_CMD_FAILED);
+        return GOTO(STATE_VERIFY, STATE_ERROR);
+    }
+    BYTE bytes[USER_AREA_LENGTH];
+    if (! scard_read_user_data(&data->reader, data->card, USER_AREA_ADDRESS, bytes, USER_AREA_LENGTH)) {
+        data->txn = 0;
+        finish_batch(data, SC_CMD_FAILED);
+        return GOTO(STATE_VERIFY, STATE_ERROR);
+    }
+    set_user_data(data, bytes);
+    if (data->txn) {
+        scard_journal_commit(data->txn);
+        data->txn = 0;
+    }
+    if (data->card_written) {
+        scard_metrics_count(SC_COUNTER_CARD_WRITES);
+        uint32_t topups = 0;
+        for (unsigned i = 0; i < data->batch_len; i++) {
+            topups += (data->batch[i].command.type == SC_CMD_TOPUP);
+        }
+        record_card(data, topups);
+        data->card_written = false;
+    }
+    if (data->provision_start_ns) {
+        INF("card provisioned in %.1f ms\n", (scard_now_ns() - data->provision_start_ns) / 1e6);
+        count_provision(data, PROVISION_DONE);
+    }
+    set_card_ready(data);
+    finish_batch(data, SC_CMD_DONE);
+    return GOTO(STATE_VERIFY, STATE_WAIT_USER);
+}
+
+state_t do_state_reject( instance_data_t *data )
+{
+    TRC(">>>\n");
+    // nothing to do with this card until it is gone
+    scard_event_t event = wait_event(data);
+    if (event == SC_EVENT_REMOVE || event == SC_EVENT_DETACH) {
+        return GOTO(STATE_REJECT, STATE_DISCONNECT);
+    }
+    if (event == SC_EVENT_COMMAND) {
+        fail_commands(data, SC_CMD_NO_CARD);
+    }
+    return GOTO(STATE_REJECT, STATE_REJECT);
+}
+
+state_t do_state_audit( instance_data_t *data )
+{
+    TRC(">>>\n");
+    if (! data->audited) {
+        scard_card_image_t image;
+        scard_get_card_image(&data->reader, &image);
+        scard_audit_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.ts_ns = scard_wall_ns();
+        record.card_hash = scard_card_hash(&data->reader);
+        record.reader = data->slot;
+        record.card_class = data->reader.card_class;
+        record.pin_retries = data->pin_retries;
+        record.user_magic = data->user_magic;
+        record.user_id = data->user_id;
+        record.user_total = data->user_total;
+        record.user_value = data->user_value;
+        memcpy(record.protection, image.protection, SC_CARD_PROTECTION_LEN);
+        memcpy(record.memory, image.memory, SC_CARD_MEMORY_LEN);
+        scard_audit_export(&record);
+        data->audited = true;
+        if (data->ready_from_ns) {
+            scard_metrics_timer(SC_TIMER_INSERT_TO_AUDITED, scard_now_ns() - data->ready_from_ns);
+            data->ready_from_ns = 0;
+        }
+        DBG("card ID %u audited\n", data->user_id);
+        return GOTO(STATE_AUDIT, STATE_AUDIT);
+    }
+    // card stays read only until it is gone
+    scard_event_t event = wait_event(data);
+    if (event == SC_EVENT_REMOVE || event == SC_EVENT_DETACH) {
+        return GOTO(STATE_AUDIT, STATE_DISCONNECT);
+    }
+    if (event == SC_EVENT_COMMAND) {
+        fail_commands(data, SC_CMD_INVALID);
+    }
+    return GOTO(STATE_AUDIT, STATE_AUDIT);
 }
 
 state_t do_state_idle( instance_data_t *data )
@@ -375,57 +1349,262 @@ state_t do_state_idle( instance_data_t *data )
     TRC(">>>\n");
 
     DBG("waiting for change..\n");
-    scard_wait_for_card(_context, INFINITE);
-    // this point is reached if state has changed or user canceled the wait
-    return STATE_INITIAL;
+    wait_event(data);
+    // this point is reached if state has changed
+    return GOTO(STATE_IDLE, STATE_INITIAL);
 }
 
 state_t do_state_error( instance_data_t *data )
 {
     TRC(">>>\n");
-    
-    ERR("ERROR ERROR ERROR\n");
-    // debug
-    sleep(10);
-    // debug
+    if (! data->error_parked) {
+        data->error_class = scard_classify_error(&data->reader);
+        scard_metrics_card_error(data->error_class);
+        if (data->error_class == SC_ERROR_REMOVED) {
+            DBG("card is gone\n");
+            return GOTO(STATE_ERROR, STATE_DISCONNECT);
+        }
+        if (data->error_retries < error_retries[data->error_class]) {
+            unsigned retry = data->error_retries++;
+            uint64_t backoff_us = 0;
+            if (retry) {
+                backoff_us = ERROR_BACKOFF_MIN_US << (retry - 1);
+                if (backoff_us > ERROR_BACKOFF_MAX_US) {
+                    backoff_us = ERROR_BACKOFF_MAX_US;
+                }
+            }
+            INF("%s: %s error (rv 0x%08lX, SW %02X %02X), retry %u of %u in %lu us\n", data->reader.name,
+                scard_error_class_name(data->error_class), (unsigned long)data->reader.last_rv,
+                data->reader.last_sw[0], data->reader.last_sw[1], data->error_retries,
+                error_retries[data->error_class], (unsigned long)backoff_us);
+            // any event cuts the wait short; it is put back so the states
+            // that follow still see it, a command must not get lost here
+            scard_event_t event;
+            if (backoff_us && wait_event_timeout(data, backoff_us, &event)) {
+                DBG("backoff ended by event %d\n", event);
+                data->events.fetch_or(1 << event, std::memory_order_release);
+            }
+            // reconnect and start over
+            return GOTO(STATE_ERROR, STATE_DISCONNECT);
+        }
+        ERR("%s: %s error, giving up on the card until it is removed\n", data->reader.name,
+            scard_error_class_name(data->error_class));
+        data->error_parked = true;
+        // the wait below may be long, let the UI know why
+        publish_session(data, STATE_ERROR);
+    }
 
-    if (! scard_card_presence()) {
-        return STATE_INITIAL;
+    // nothing more to try with this card, no sleeping either
+    scard_event_t event = wait_event(data);
+    if (event == SC_EVENT_REMOVE || event == SC_EVENT_DETACH) {
+        data->error_parked = false;
+        return GOTO(STATE_ERROR, STATE_DISCONNECT);
     }
-    return STATE_ERROR;
+    if (event == SC_EVENT_COMMAND) {
+        fail_commands(data, SC_CMD_NO_CARD);
+    }
+    return GOTO(STATE_ERROR, STATE_ERROR);
+}
+
+void scard_get_monitor_stats(scard_monitor_stats_t *stats)
+{
+    pthread_mutex_lock(&_mutex);
+    *stats = _monitor_stats;
+    pthread_mutex_unlock(&_mutex);
 }
 
-unsigned scard_get_pin_retries()
+bool scard_get_fsm_stats(unsigned slot, scard_fsm_stats_t *stats)
 {
-    return _data.pin_retries;
+    assert(slot < SC_MAX_READERS);
+    instance_data_t *data = &_sessions[slot];
+    // keeps the session from going away under us
+    pthread_mutex_lock(&_mutex);
+    bool rv = data->used;
+    if (rv) {
+        scard_fsm_get_stats(&data->fsm, stats);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return rv;
 }
-unsigned scard_get_pin_user_magic()
+
+void scard_set_provisioning(bool enable)
 {
-    return _data.user_magic;
+    pthread_mutex_lock(&_provision_mutex);
+    if (enable && ! _provisioning.load(std::memory_order_relaxed)) {
+        memset(_provision, 0, sizeof(_provision));
+        _provision_start_ns = scard_now_ns();
+    }
+    _provisioning.store(enable, std::memory_order_relaxed);
+    pthread_mutex_unlock(&_provision_mutex);
+    INF("provisioning %s\n", enable ? "enabled" : "disabled");
 }
-unsigned scard_get_pin_user_id()
+
+bool scard_provisioning()
 {
-    return _data.user_id;
+    return _provisioning.load(std::memory_order_relaxed);
 }
-unsigned scard_get_pin_user_total()
+
+bool scard_get_provision_stats(unsigned slot, scard_provision_stats_t *stats)
 {
-    return _data.user_total;
+    assert(slot < SC_MAX_READERS);
+    pthread_mutex_lock(&_provision_mutex);
+    *stats = _provision[slot];
+    stats->start_ns = _provision_start_ns;
+    pthread_mutex_unlock(&_provision_mutex);
+    return stats->name[0] != 0;
 }
-unsigned scard_get_pin_user_value()
+
+double scard_provision_rate(const scard_provision_stats_t *stats)
 {
-    return _data.user_value;
+    if (! stats->provisioned || stats->last_ns <= stats->start_ns) {
+        return 0;
+    }
+    return stats->provisioned * 60e9 / (stats->last_ns - stats->start_ns);
 }
 
-void update_card(uint32_t value, uint32_t id)
+void scard_provision_report(FILE *file)
 {
-    _data.new_value = value;
-    _data.new_id = id;
-    _data.do_update = true;
-    // cancel wait and perform update
-    scard_cancel_wait(_context);
+    scard_provision_stats_t total;
+    memset(&total, 0, sizeof(total));
+    fprintf(file, "%-40s %11s %6s %7s %8s %8s %8s\n", "reader", "provisioned", "failed", "skipped",
+        "per min", "avg ms", "max ms");
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        scard_provision_stats_t stats;
+        if (! scard_get_provision_stats(slot, &stats)) {
+            continue;
+        }
+        fprintf(file, "%-40s %11lu %6lu %7lu %8.1f %8.1f %8.1f\n", stats.name, stats.provisioned, stats.failed,
+            stats.skipped, scard_provision_rate(&stats),
+            stats.provisioned ? stats.time_ns / 1e6 / stats.provisioned : 0.0, stats.time_max_ns / 1e6);
+        total.provisioned += stats.provisioned;
+        total.failed += stats.failed;
+        total.skipped += stats.skipped;
+        total.time_ns += stats.time_ns;
+        if (stats.time_max_ns > total.time_max_ns) {
+            total.time_max_ns = stats.time_max_ns;
+        }
+        if (stats.last_ns > total.last_ns) {
+            total.last_ns = stats.last_ns;
+        }
+        total.start_ns = stats.start_ns;
+    }
+    fprintf(file, "%-40s %11lu %6lu %7lu %8.1f %8.1f %8.1f\n", "total", total.provisioned, total.failed,
+        total.skipped, scard_provision_rate(&total),
+        total.provisioned ? total.time_ns / 1e6 / total.provisioned : 0.0, total.time_max_ns / 1e6);
 }
 
-bool is_card_ready()
+void scard_set_notify(scard_notify_fn fn, void *arg)
 {
-    return _data.card_ready;
+    pthread_mutex_lock(&_notify_mutex);
+    _notify_fn = fn;
+    _notify_arg = arg;
+    pthread_mutex_unlock(&_notify_mutex);
+}
+
+void scard_get_status(scard_status_t *status)
+{
+    uint32_t seq;
+    do {
+        seq = scard_seqlock_read_begin(&_status_lock);
+        memcpy(status, &_status, sizeof(scard_status_t));
+    } while (scard_seqlock_read_retry(&_status_lock, seq));
+}
+
+const char *scard_state_name(unsigned state)
+{
+    if (state >= NUM_STATES) {
+        return "?";
+    }
+    return state_names[state];
+}
+
+const char *scard_command_name(unsigned type)
+{
+    if (type >= SC_NUM_CMDS) {
+        return "?";
+    }
+    return command_names[type];
+}
+
+const char *scard_command_status_name(unsigned status)
+{
+    if (status >= SC_NUM_CMD_STATUS) {
+        return "?";
+    }
+    return command_status_names[status];
+}
+
+scard_command_status_t scard_command_status(const scard_completion_t *completion)
+{
+    return (scard_command_status_t)__atomic_load_n(&completion->status, __ATOMIC_ACQUIRE);
+}
+
+bool scard_command_done(const scard_completion_t *completion)
+{
+    return scard_command_status(completion) >= SC_CMD_DONE;
+}
+
+bool scard_command_wait(const scard_completion_t *completion, unsigned timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&_completion_mutex);
+    while (! scard_command_done(completion)) {
+        if (pthread_cond_timedwait(&_completion_cond, &_completion_mutex, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_completion_mutex);
+    return scard_command_done(completion);
+}
+
+bool scard_submit(unsigned slot, const scard_command_t *command, scard_completion_t *completion)
+{
+    assert(slot < SC_MAX_READERS);
+    assert(command->type < SC_NUM_CMDS);
+    queued_command_t item;
+    item.command = *command;
+    item.completion = completion;
+    item.submit_ns = scard_now_ns();
+    if (completion) {
+        memset(completion, 0, sizeof(scard_completion_t));
+        completion->command = *command;
+        completion->submit_ns = item.submit_ns;
+        completion->status = SC_CMD_QUEUED;
+    }
+
+    instance_data_t *data = &_sessions[slot];
+    scard_command_status_t status = SC_CMD_NO_CARD;
+    // keeps the session from going away under us without a lock, see stop_session()
+    if (_gates[slot].fetch_add(1, std::memory_order_acquire) & GATE_OPEN) {
+        // bound to the card in the reader now, a later card does not get it
+        item.generation = __atomic_load_n(&data->card_generation, __ATOMIC_ACQUIRE);
+        // recorded before the session can act on it, replay relies on the order
+        uint32_t record[2] = { command->type, command->arg };
+        scard_trace_event(slot, SC_TRACE_COMMAND, record, sizeof(record));
+        if (scard_queue_push(&data->commands, &item)) {
+            status = SC_CMD_QUEUED;
+            // wake the session in case it waits for the user
+            post_event(data, SC_EVENT_COMMAND);
+        } else {
+            status = SC_CMD_BUSY;
+        }
+    }
+    _gates[slot].fetch_sub(1, std::memory_order_release);
+
+    if (status != SC_CMD_QUEUED) {
+        DBG("command %s not queued: %s\n", command_names[command->type], command_status_names[status]);
+        scard_metrics_command(command->type, status);
+        if (completion) {
+            complete(completion, status);
+        }
+        return false;
+    }
+    return true;
 }
@@ -0,0 +1,241 @@
+/**
+ *
+ */
+
+// scardctl: talks to a running scardd or scui over the IPC socket
+//
+//   ./scardctl status                  readers and cards
+//   ./scardctl watch insert remove     events as they happen
+//   ./scardctl topup 0 100             adds 100 to the card in reader 0
+//   ./scardctl page                    status from the shared page, no daemon round trip
+
+#include "scard.h"
+#include "scard_ipc.h"
+#include "scard_shm.h"
+
+#include <errno.h>
+#include <getopt.h>
+
+static const char *_event_names[SC_IPC_NUM_EVENTS] = {
+    "attach", "detach", "insert", "remove", "ready", "update", "state"
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s <socket>] <command>\n", prog);
+    fprintf(stderr, "  status                   readers and cards\n");
+    fprintf(stderr, "  watch [event ...]        print events, all of them by default:\n");
+    fprintf(stderr, "                           attach detach insert remove ready update state\n");
+    fprintf(stderr, "  topup <slot> <value>     add value to the card\n");
+    fprintf(stderr, "  set-type <slot> <id>     set the user ID of the card\n");
+    fprintf(stderr, "  read <slot>              read the card again\n");
+    fprintf(stderr, "  page [file]              status from the status page, %s by default\n", SC_SHM_DEFAULT_PATH);
+    fprintf(stderr, "default socket is %s\n", SC_IPC_DEFAULT_PATH);
+}
+
+static void print_reader(const scard_ipc_reader_t *reader, const char *name)
+{
+    if (! reader->active) {
+        printf("%u: detached\n", reader->slot);
+    } else if (! reader->card_present) {
+        printf("%u: %s, no card, %s\n", reader->slot, name, scard_state_name(reader->state));
+    } else {
+        printf("%u: %s, %s %s, ID %u value %u total %u, retries %u%s%s\n", reader->slot, name,
+            scard_card_class_name((scard_card_class_t)reader->card_class), scard_state_name(reader->state),
+            reader->user_id, reader->user_value, reader->user_total, reader->pin_retries,
+            reader->error_class ? ", error " : "",
+            reader->error_class ? scard_error_class_name(reader->error_class) : "");
+    }
+}
+
+static int do_status(int fd)
+{
+    uint8_t type;
+    uint8_t body[SC_IPC_MAX_PAYLOAD];
+    if (! scard_ipc_send(fd, SC_IPC_GET_STATUS, NULL, 0)) {
+        return 1;
+    }
+    int len = scard_ipc_recv(fd, &type, body, sizeof(body));
+    if (len < 5 || type != SC_IPC_STATUS) {
+        fprintf(stderr, "bad status reply\n");
+        return 1;
+    }
+    uint32_t version;
+    memcpy(&version, body, sizeof(version));
+    unsigned count = body[4];
+    int pos = 5;
+    printf("status version %u, %u readers\n", version, count);
+    for (unsigned i = 0; i < count; i++) {
+        if (pos + (int)sizeof(scard_ipc_reader_t) + 1 > len) {
+            fprintf(stderr, "short status reply\n");
+            return 1;
+        }
+        scard_ipc_reader_t reader;
+        memcpy(&reader, &body[pos], sizeof(reader));
+        pos += sizeof(reader);
+        char name[256];
+        unsigned name_len = body[pos++];
+        if (pos + (int)name_len > len) {
+            fprintf(stderr, "short status reply\n");
+            return 1;
+        }
+        memcpy(name, &body[pos], name_len);
+        name[name_len] = 0;
+        pos += name_len;
+        print_reader(&reader, name);
+    }
+    return 0;
+}
+
+static int do_page(const char *path)
+{
+    const scard_shm_page_t *page = scard_shm_map(path);
+    if (! page) {
+        return 1;
+    }
+    scard_shm_page_t *copy = (scard_shm_page_t *)malloc(sizeof(scard_shm_page_t));
+    if (! scard_shm_read(page, copy)) {
+        fprintf(stderr, "status page stays locked, is pid %u alive?\n", page->pid);
+        free(copy);
+        scard_shm_unmap(page);
+        return 1;
+    }
+    uint64_t now = scard_wall_ns();
+    printf("pid %u, status version %u, %lu updates, last %.1f s ago\n", copy->pid, copy->status_version,
+        (unsigned long)copy->updates, (now - copy->updated_ns) / 1e9);
+    for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+        const scard_shm_reader_t *reader = &copy->readers[slot];
+        if (! reader->active) {
+            continue;
+        }
+        const char *state = reader->state < copy->num_states ? copy->state_names[reader->state] : "?";
+        if (! reader->card_present) {
+            printf("%u: %s, no card, %s", slot, reader->name, state);
+        } else {
+            printf("%u: %s, %s %s, ID %u value %u total %u, retries %u", slot, reader->name,
+                scard_card_class_name((scard_card_class_t)reader->card_class), state,
+                reader->user_id, reader->user_value, reader->user_total, reader->pin_retries);
+        }
+        printf(", %lu transitions\n", (unsigned long)reader->transitions);
+        for (unsigned i = 0; i < copy->num_states; i++) {
+            if (reader->entries[i]) {
+                printf("    %-12s %lu\n", copy->state_names[i], (unsigned long)reader->entries[i]);
+            }
+        }
+    }
+    free(copy);
+    scard_shm_unmap(page);
+    return 0;
+}
+
+static int do_watch(int fd, int argc, char **argv)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < argc; i++) {
+        unsigned event = 0;
+        while (event < SC_IPC_NUM_EVENTS && strcmp(argv[i], _event_names[event])) {
+            event++;
+        }
+        if (event == SC_IPC_NUM_EVENTS) {
+            fprintf(stderr, "unknown event %s\n", argv[i]);
+            return 1;
+        }
+        mask |= 1u << event;
+    }
+    if (! mask) {
+        mask = (1u << SC_IPC_NUM_EVENTS) - 1;
+    }
+    if (! scard_ipc_send(fd, SC_IPC_SUBSCRIBE, &mask, sizeof(mask))) {
+        return 1;
+    }
+    uint8_t type;
+    uint8_t body[SC_IPC_MAX_PAYLOAD];
+    int len;
+    while ((len = scard_ipc_recv(fd, &type, body, sizeof(body))) >= 0) {
+        if (type != SC_IPC_EVENT || len != sizeof(scard_ipc_event_t)) {
+            continue;
+        }
+        scard_ipc_event_t event;
+        memcpy(&event, body, sizeof(event));
+        printf("%-7s ", event.event < SC_IPC_NUM_EVENTS ? _event_names[event.event] : "?");
+        print_reader(&event.reader, "-");
+        fflush(stdout);
+    }
+    fprintf(stderr, "connection closed\n");
+    return 1;
+}
+
+static int do_command(int fd, unsigned slot, scard_command_type_t command, uint32_t arg)
+{
+    scard_ipc_submit_t submit;
+    submit.tag = 1;
+    submit.slot = slot;
+    submit.type = command;
+    submit.arg = arg;
+    if (! scard_ipc_send(fd, SC_IPC_SUBMIT, &submit, sizeof(submit))) {
+        return 1;
+    }
+    uint8_t type;
+    scard_ipc_result_t result;
+    int len = scard_ipc_recv(fd, &type, &result, sizeof(result));
+    if (len != sizeof(result) || type != SC_IPC_RESULT) {
+        fprintf(stderr, "bad result reply\n");
+        return 1;
+    }
+    printf("%s %s", scard_command_name(command), scard_command_status_name(result.status));
+    if (result.status == SC_CMD_DONE) {
+        printf(", ID %u value %u total %u", result.user_id, result.user_value, result.user_total);
+    }
+    printf(", %u us\n", result.latency_us);
+    return result.status == SC_CMD_DONE ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *prog = argv[0];
+    const char *path = SC_IPC_DEFAULT_PATH;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        default:
+            usage(prog);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) {
+        usage(prog);
+        return 1;
+    }
+
+    if (! strcmp(argv[0], "page")) {
+        return do_page(argc > 1 ? argv[1] : SC_SHM_DEFAULT_PATH);
+    }
+
+    int fd = scard_ipc_connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "failed to connect to %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int rv;
+    if (! strcmp(argv[0], "status")) {
+        rv = do_status(fd);
+    } else if (! strcmp(argv[0], "watch")) {
+        rv = do_watch(fd, argc - 1, argv + 1);
+    } else if (! strcmp(argv[0], "topup") && argc == 3) {
+        rv = do_command(fd, atoi(argv[1]), SC_CMD_TOPUP, strtoul(argv[2], NULL, 0));
+    } else if (! strcmp(argv[0], "set-type") && argc == 3) {
+        rv = do_command(fd, atoi(argv[1]), SC_CMD_SET_TYPE, strtoul(argv[2], NULL, 0));
+    } else if (! strcmp(argv[0], "read") && argc == 2) {
+        rv = do_command(fd, atoi(argv[1]), SC_CMD_READ, 0);
+    } else {
+        usage(prog);
+        rv = 1;
+    }
+    close(fd);
+    return rv;
+}
@@ -0,0 +1,242 @@
+/**
+ *
+ */
+
+// scardd: runs the card FSM without a window, for headless stations
+//
+//   ./scardd                           pcscd readers, status changes on stdout
+//   ./scardd -m 2 -p                   two mock readers, provision blank cards
+//   ./scardd -s /tmp/scard.sock        status and commands for scardctl
+
+#include "scard.h"
+#include "scard_audit.h"
+#include "scard_exporter.h"
+#include "scard_ipc.h"
+#include "scard_journal.h"
+#include "scard_ledger.h"
+#include "scard_metrics.h"
+#include "scard_shm.h"
+#include "scard_trace.h"
+#include "scard_transport.h"
+
+#include <getopt.h>
+#include <signal.h>
+
+// status is checked this often for changes to print
+#define DAEMON_POLL_MS                  100
+
+static volatile sig_atomic_t _signal = 0;
+
+static void on_signal(int sig)
+{
+    _signal = sig;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -m <n>       use n mock readers instead of pcscd, a blank card in the first\n");
+    fprintf(stderr, "  -p           provision blank cards\n");
+    fprintf(stderr, "  -a <prefix>  audit mode, export to <prefix>.csv and <prefix>.bin\n");
+    fprintf(stderr, "  -j <file>    transaction journal\n");
+    fprintf(stderr, "  -L <file>    card ledger\n");
+    fprintf(stderr, "  -c <file>    reader capability cache\n");
+    fprintf(stderr, "  -t <file>    APDU trace, see scard_replay\n");
+    fprintf(stderr, "  -M <secs>    log the latency histograms periodically\n");
+    fprintf(stderr, "  -e <addr>    serve Prometheus metrics on [host:]port or a Unix socket path\n");
+    fprintf(stderr, "  -o <file>    log to the file instead of stderr\n");
+    fprintf(stderr, "  -s <socket>  serve status and commands on the Unix socket, see scardctl\n");
+    fprintf(stderr, "  -P <file>    keep a status page for other processes, e.g. %s\n", SC_SHM_DEFAULT_PATH);
+    fprintf(stderr, "  -q           do not print status changes\n");
+}
+
+static void print_reader(unsigned slot, const scard_reader_status_t *reader)
+{
+    if (! reader->active) {
+        printf("%u: detached\n", slot);
+    } else if (! reader->card_present) {
+        printf("%u: %s, no card, %s\n", slot, reader->name, scard_state_name(reader->state));
+    } else {
+        printf("%u: %s, %s %s, ID %u value %u total %u, retries %u%s%s\n", slot, reader->name,
+            scard_card_class_name((scard_card_class_t)reader->card_class), scard_state_name(reader->state),
+            reader->user_id, reader->user_value, reader->user_total, reader->pin_retries,
+            reader->error_class ? ", error " : "",
+            reader->error_class ? scard_error_class_name(reader->error_class) : "");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned mock_readers = 0;
+    bool provision = false;
+    bool quiet = false;
+    const char *audit = nullptr;
+    const char *journal = nullptr;
+    const char *ledger = nullptr;
+    const char *cache = nullptr;
+    const char *trace = nullptr;
+    const char *log = nullptr;
+    const char *socket_path = nullptr;
+    const char *page = nullptr;
+    const char *exporter = nullptr;
+    unsigned metrics = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:pa:j:L:c:t:M:e:o:s:P:qh")) != -1) {
+        switch (opt) {
+        case 'm':
+            mock_readers = atoi(optarg);
+            break;
+        case 'p':
+            provision = true;
+            break;
+        case 'a':
+            audit = optarg;
+            break;
+        case 'j':
+            journal = optarg;
+            break;
+        case 'L':
+            ledger = optarg;
+            break;
+        case 'c':
+            cache = optarg;
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'M':
+            metrics = atoi(optarg);
+            break;
+        case 'e':
+            exporter = optarg;
+            break;
+        case 'o':
+            log = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'P':
+            page = optarg;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *log_file = nullptr;
+    if (log) {
+        log_file = fopen(log, "a");
+        if (! log_file) {
+            fprintf(stderr, "failed to open %s\n", log);
+            return 1;
+        }
+        scard_log_set_file(log_file);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (mock_readers) {
+        scard_mock_config_t config;
+        scard_mock_default_config(&config);
+        config.readers = mock_readers < SC_MOCK_MAX_READERS ? mock_readers : SC_MOCK_MAX_READERS;
+        scard_mock_configure(&config);
+        scard_set_transport(&scard_mock_transport);
+        scard_mock_insert_card(0, NULL, NULL);
+    }
+    if (trace && ! scard_trace_open(trace, SC_TRACE_DEFAULT_SLOTS)) {
+        return 1;
+    }
+    if (cache) {
+        scard_reader_cache_open(cache);
+    }
+    if (metrics) {
+        scard_metrics_set_dump_interval(metrics);
+    }
+    if (audit) {
+        char csv_path[256], bin_path[256];
+        snprintf(csv_path, sizeof(csv_path), "%s.csv", audit);
+        snprintf(bin_path, sizeof(bin_path), "%s.bin", audit);
+        if (! scard_audit_open(csv_path, bin_path)) {
+            return 1;
+        }
+    }
+    if (journal && ! scard_journal_open(journal)) {
+        return 1;
+    }
+    if (ledger && ! scard_ledger_open(ledger)) {
+        return 1;
+    }
+    if (page && ! scard_shm_open(page)) {
+        return 1;
+    }
+    if (provision) {
+        scard_set_provisioning(true);
+    }
+    if (! scard_user_thread_start()) {
+        return 1;
+    }
+    if (socket_path && ! scard_ipc_start(socket_path)) {
+        scard_user_thread_stop();
+        return 1;
+    }
+    if (exporter && ! scard_exporter_start(exporter)) {
+        scard_ipc_stop();
+        scard_user_thread_stop();
+        return 1;
+    }
+
+    scard_status_t shown;
+    memset(&shown, 0, sizeof(shown));
+    while (! _signal) {
+        usleep(DAEMON_POLL_MS * 1000);
+        if (quiet) {
+            continue;
+        }
+        scard_status_t status;
+        scard_get_status(&status);
+        if (status.version == shown.version) {
+            continue;
+        }
+        for (unsigned slot = 0; slot < SC_MAX_READERS; slot++) {
+            const scard_reader_status_t *reader = &status.readers[slot];
+            const scard_reader_status_t *prev = &shown.readers[slot];
+            if (reader->active == prev->active && reader->card_present == prev->card_present
+                && reader->state == prev->state && reader->user_value == prev->user_value
+                && reader->error_class == prev->error_class) {
+                continue;
+            }
+            print_reader(slot, reader);
+        }
+        fflush(stdout);
+        shown = status;
+    }
+    INF("%s, shutting down\n", strsignal(_signal));
+
+    scard_exporter_stop();
+    scard_ipc_stop();
+    scard_user_thread_stop();
+    if (provision) {
+        scard_provision_report(stdout);
+    }
+    scard_audit_close();
+    scard_journal_close();
+    scard_ledger_close();
+    scard_shm_close();
+    scard_metrics_set_dump_interval(0);
+    scard_trace_close();
+    scard_log_flush();
+    if (log_file) {
+        scard_log_set_file(stderr);
+        fclose(log_file);
+    }
+    return 0;
+}
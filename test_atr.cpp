@@ -0,0 +1,79 @@
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "scard.h"
+#include "scard_transport.h"
+
+#define EXPECT(cond) \
+    do { \
+        if (! (cond)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+static bool test_classify()
+{
+    // bare ISO 7816-10 header and the ATR a PC/SC reader reports for it
+    static const BYTE sle4442[] = {0xA2, 0x13, 0x10, 0x91};
+    static const BYTE sle4442_atr[] = {0x3B, 0x04, 0xA2, 0x13, 0x10, 0x91};
+    static const BYTE sle4428_atr[] = {0x3B, 0x04, 0x92, 0x23, 0x10, 0x91};
+    // a processor card, its historical bytes are no memory card header
+    static const BYTE cpu_atr[] = {0x3B, 0x02, 0x14, 0x50};
+    static const BYTE other_prefix[] = {0x3B, 0x05, 0xA2, 0x13, 0x10, 0x91};
+    static const BYTE trailing[] = {0x3B, 0x04, 0xA2, 0x13, 0x10, 0x91, 0x00};
+
+    EXPECT(scard_classify_atr(sle4442, sizeof(sle4442)) == SC_CARD_SLE4442);
+    EXPECT(scard_classify_atr(sle4442_atr, sizeof(sle4442_atr)) == SC_CARD_SLE4442);
+    EXPECT(scard_card_class_supported(scard_classify_atr(sle4442_atr, sizeof(sle4442_atr))));
+    EXPECT(scard_classify_atr(sle4428_atr, sizeof(sle4428_atr)) == SC_CARD_SLE4428);
+    EXPECT(! scard_card_class_supported(SC_CARD_SLE4428));
+    EXPECT(scard_classify_atr(cpu_atr, sizeof(cpu_atr)) == SC_CARD_UNKNOWN);
+    EXPECT(scard_classify_atr(other_prefix, sizeof(other_prefix)) == SC_CARD_UNKNOWN);
+    EXPECT(scard_classify_atr(trailing, sizeof(trailing)) == SC_CARD_UNKNOWN);
+    EXPECT(scard_classify_atr(sle4442, 3) == SC_CARD_UNKNOWN);
+    EXPECT(scard_classify_atr(sle4442_atr, 0) == SC_CARD_UNKNOWN);
+    return true;
+}
+
+// the mock reports the full ATR like a real reader, the card must be taken
+static bool test_mock_reader()
+{
+    scard_set_transport(&scard_mock_transport);
+    scard_mock_config_t config;
+    scard_mock_default_config(&config);
+    config.readers = 1;
+    scard_mock_configure(&config);
+    EXPECT(scard_user_thread_start());
+    scard_mock_insert_card(0, NULL, NULL);
+
+    scard_status_t status;
+    uint64_t deadline = scard_now_ns() + 2000000000ULL;
+    do {
+        usleep(1000);
+        scard_get_status(&status);
+    } while (! status.readers[0].card_ready && scard_now_ns() < deadline);
+    scard_user_thread_stop();
+    EXPECT(status.readers[0].card_class == SC_CARD_SLE4442);
+    EXPECT(status.readers[0].card_ready);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    if (! test_classify()) {
+        fprintf(stderr, "classify FAILED\n");
+        ok = false;
+    }
+    if (! test_mock_reader()) {
+        fprintf(stderr, "mock reader FAILED\n");
+        ok = false;
+    }
+    printf("test_atr: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "scard.h"
+#include "scard_exporter.h"
+#include "scard_metrics.h"
+
+#define MAX_RESPONSE    (256 * 1024)
+#define MAX_FAMILIES    64
+#define MAX_SERIES      256
+
+#define EXPECT(cond) \
+    do { \
+        if (! (cond)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+typedef struct {
+    char name[64];
+    char type[16];
+    bool help;
+} family_t;
+
+// one histogram series, its labels without le
+typedef struct {
+    char key[160];
+    double last_le;
+    unsigned long last_bucket;
+    bool inf;
+    unsigned long inf_bucket;
+    bool count;
+} series_t;
+
+static char _path[64];
+static char _response[MAX_RESPONSE];
+static family_t _families[MAX_FAMILIES];
+static unsigned _num_families;
+static series_t _series[MAX_SERIES];
+static unsigned _num_series;
+
+static family_t *find_family(const char *name, size_t len)
+{
+    for (unsigned i = 0; i < _num_families; i++) {
+        if (strlen(_families[i].name) == len && strncmp(_families[i].name, name, len) == 0) {
+            return &_families[i];
+        }
+    }
+    return nullptr;
+}
+
+static series_t *get_series(const char *key)
+{
+    for (unsigned i = 0; i < _num_series; i++) {
+        if (strcmp(_series[i].key, key) == 0) {
+            return &_series[i];
+        }
+    }
+    if (_num_series == MAX_SERIES) {
+        return nullptr;
+    }
+    series_t *series = &_series[_num_series++];
+    memset(series, 0, sizeof(series_t));
+    snprintf(series->key, sizeof(series->key), "%s", key);
+    series->last_le = -1;
+    return series;
+}
+
+static bool scrape(const char *request)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT(fd >= 0);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", _path);
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        fprintf(stderr, "connect %s: %s\n", _path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    send(fd, request, strlen(request), 0);
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(_response) - 1 && (n = recv(fd, _response + len, sizeof(_response) - 1 - len, 0)) > 0) {
+        len += n;
+    }
+    _response[len] = 0;
+    close(fd);
+    EXPECT(len < sizeof(_response) - 1);
+    return true;
+}
+
+// "# HELP name text" and "# TYPE name type"
+static bool parse_comment(const char *line)
+{
+    bool help = strncmp(line, "# HELP ", 7) == 0;
+    EXPECT(help || strncmp(line, "# TYPE ", 7) == 0);
+    const char *name = line + 7;
+    size_t len = strcspn(name, " ");
+    EXPECT(len > 0 && len < sizeof(_families[0].name) && name[len] == ' ');
+    family_t *family = find_family(name, len);
+    if (! family) {
+        // HELP comes first and a family is described only once
+        EXPECT(help && _num_families < MAX_FAMILIES);
+        family = &_families[_num_families++];
+        memset(family, 0, sizeof(family_t));
+        memcpy(family->name, name, len);
+        family->help = true;
+        return true;
+    }
+    EXPECT(! help && family->type[0] == 0);
+    const char *type = name + len + 1;
+    EXPECT(strcmp(type, "counter") == 0 || strcmp(type, "gauge") == 0 || strcmp(type, "histogram") == 0);
+    snprintf(family->type, sizeof(family->type), "%s", type);
+    return true;
+}
+
+// name{labels} value, the labels of a bucket end with le
+static bool parse_sample(const char *line)
+{
+    size_t name_len = strcspn(line, "{ ");
+    const char *labels = "";
+    size_t labels_len = 0;
+    const char *value = line + name_len;
+    if (*value == '{') {
+        labels = value + 1;
+        const char *end = strchr(labels, '}');
+        EXPECT(end);
+        labels_len = end - labels;
+        value = end + 1;
+    }
+    EXPECT(*value == ' ');
+    char *end;
+    double number = strtod(value + 1, &end);
+    EXPECT(end != value + 1 && *end == 0);
+
+    family_t *family = find_family(line, name_len);
+    const char *suffix = "";
+    if (! family) {
+        static const char *suffixes[] = { "_bucket", "_sum", "_count" };
+        for (unsigned i = 0; i < 3 && ! family; i++) {
+            size_t len = strlen(suffixes[i]);
+            if (name_len > len && strncmp(line + name_len - len, suffixes[i], len) == 0) {
+                family = find_family(line, name_len - len);
+                suffix = suffixes[i];
+            }
+        }
+        EXPECT(family && strcmp(family->type, "histogram") == 0);
+    }
+    // every sample follows the HELP and TYPE lines of its family
+    EXPECT(family->help && family->type[0]);
+    if (strcmp(family->type, "histogram") != 0) {
+        return true;
+    }
+    EXPECT(suffix[0]);
+
+    char key[160];
+    const char *le = strstr(labels, "le=\"");
+    size_t key_labels = labels_len;
+    if (strcmp(suffix, "_bucket") == 0) {
+        EXPECT(le && le < labels + labels_len);
+        key_labels = (le > labels) ? (size_t)(le - labels - 1) : 0;
+    } else {
+        EXPECT(! le || le >= labels + labels_len);
+    }
+    snprintf(key, sizeof(key), "%s{%.*s}", family->name, (int)key_labels, labels);
+    series_t *series = get_series(key);
+    EXPECT(series);
+
+    unsigned long count = (unsigned long)number;
+    if (strcmp(suffix, "_bucket") == 0) {
+        EXPECT(! series->inf && ! series->count);
+        // buckets are cumulative, in increasing le order
+        EXPECT(count >= series->last_bucket);
+        series->last_bucket = count;
+        if (strncmp(le + 4, "+Inf\"", 5) == 0) {
+            series->inf = true;
+            series->inf_bucket = count;
+        } else {
+            double bound = strtod(le + 4, &end);
+            EXPECT(*end == '"' && bound > series->last_le);
+            series->last_le = bound;
+        }
+    } else if (strcmp(suffix, "_count") == 0) {
+        EXPECT(series->inf && ! series->count);
+        EXPECT(count == series->inf_bucket);
+        series->count = true;
+    } else {
+        EXPECT(series->inf);
+    }
+    return true;
+}
+
+static bool test_scrape()
+{
+    // READ MEMORY from well below the first bound to past the last one
+    static const double read_s[] = { 0.00005, 0.0003, 0.002, 0.04, 1, 100, 400 };
+    for (unsigned i = 0; i < sizeof(read_s) / sizeof(read_s[0]); i++) {
+        scard_metrics_apdu(0xB0, (uint64_t)(read_s[i] * 1e9));
+    }
+    scard_metrics_apdu(0xD0, 5000000);
+    scard_metrics_apdu(0xD0, 7000000);
+    scard_metrics_timer(SC_TIMER_INSERT_TO_READY, 120000000);
+    scard_metrics_pin_retries(3);
+    scard_metrics_pin_retries(3);
+    scard_metrics_pin_retries(1);
+    scard_metrics_count(SC_COUNTER_CARD_INSERTS);
+
+    EXPECT(scrape("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+    EXPECT(strncmp(_response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    EXPECT(strstr(_response, "Content-Type: text/plain; version=0.0.4\r\n"));
+    char *body = strstr(_response, "\r\n\r\n");
+    EXPECT(body);
+    body += 4;
+    const char *length = strstr(_response, "Content-Length: ");
+    EXPECT(length && atol(length + 16) == (long)strlen(body));
+
+    // 400 s is past the last bound, counted only by +Inf
+    EXPECT(strstr(_response, "scard_apdu_duration_seconds_bucket{apdu=\"READ_MEMORY\",le=\"300\"} 6\n"));
+    EXPECT(strstr(_response, "scard_pin_retries_bucket{le=\"1\"} 1\n"));
+
+    // lines are cut apart in place from here on
+    unsigned lines = 0;
+    for (char *line = strtok(body, "\n"); line; line = strtok(NULL, "\n")) {
+        if (line[0] == '#') {
+            if (! parse_comment(line)) {
+                fprintf(stderr, "bad comment: %s\n", line);
+                return false;
+            }
+        } else if (! parse_sample(line)) {
+            fprintf(stderr, "bad sample: %s\n", line);
+            return false;
+        }
+        lines++;
+    }
+    EXPECT(lines > 0);
+    for (unsigned i = 0; i < _num_families; i++) {
+        EXPECT(_families[i].type[0]);
+    }
+    // every histogram series closed with +Inf and _count
+    for (unsigned i = 0; i < _num_series; i++) {
+        EXPECT(_series[i].inf && _series[i].count);
+    }
+
+    series_t *read = get_series("scard_apdu_duration_seconds{apdu=\"READ_MEMORY\"}");
+    EXPECT(read && read->inf_bucket == sizeof(read_s) / sizeof(read_s[0]));
+    series_t *write = get_series("scard_apdu_duration_seconds{apdu=\"WRITE_MEMORY\"}");
+    EXPECT(write && write->inf_bucket == 2);
+    series_t *pin = get_series("scard_pin_retries{}");
+    EXPECT(pin && pin->inf_bucket == 3);
+    return true;
+}
+
+static bool test_not_found()
+{
+    EXPECT(scrape("GET / HTTP/1.0\r\n\r\n"));
+    EXPECT(strncmp(_response, "HTTP/1.0 404 Not Found\r\n", 24) == 0);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    snprintf(_path, sizeof(_path), "/tmp/test_exporter.%d", (int)getpid());
+    unlink(_path);
+    if (! scard_exporter_start(_path)) {
+        fprintf(stderr, "exporter did not start on %s\n", _path);
+        return 1;
+    }
+    bool ok = true;
+    if (! test_scrape()) {
+        fprintf(stderr, "scrape FAILED\n");
+        ok = false;
+    }
+    if (! test_not_found()) {
+        fprintf(stderr, "not found FAILED\n");
+        ok = false;
+    }
+    scard_exporter_stop();
+    unlink(_path);
+    printf("test_exporter: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include "scard.h"
+#include "scard_journal.h"
+
+#define EXPECT(cond) \
+    do { \
+        if (! (cond)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+// every card of a batch has the same header, so the same hash
+#define BATCH_HASH      0xC0FFEE11
+
+static char _path[] = "/tmp/test_journal.XXXXXX";
+static bool _fail_sync = false;
+
+#ifndef __APPLE__
+// the journal syncs with fdatasync(), this one fails on demand
+extern "C" int fdatasync(int fd)
+{
+    if (_fail_sync) {
+        errno = EIO;
+        return -1;
+    }
+    return syscall(SYS_fdatasync, fd);
+}
+#endif
+
+static scard_journal_stats_t stats()
+{
+    scard_journal_stats_t s;
+    scard_journal_get_stats(&s);
+    return s;
+}
+
+// overwrites part of a record the way a crash in the middle of a write would
+static bool tear_record(uint64_t idx, const void *bytes, size_t len)
+{
+    int fd = open(_path, O_RDWR);
+    EXPECT(fd >= 0);
+    off_t offset = sizeof(scard_journal_header_t) + idx * sizeof(scard_journal_record_t);
+    bool ok = pwrite(fd, bytes, len, offset) == (ssize_t)len;
+    close(fd);
+    return ok;
+}
+
+static bool read_record(uint64_t idx, scard_journal_record_t *rec)
+{
+    int fd = open(_path, O_RDONLY);
+    EXPECT(fd >= 0);
+    off_t offset = sizeof(scard_journal_header_t) + idx * sizeof(scard_journal_record_t);
+    bool ok = pread(fd, rec, sizeof(*rec), offset) == (ssize_t)sizeof(*rec);
+    close(fd);
+    return ok;
+}
+
+static bool test_recover()
+{
+    EXPECT(scard_journal_open(_path));
+    uint64_t a = scard_journal_intent(0, 0x1111, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 0, 10);
+    EXPECT(a == 1);
+    scard_journal_commit(a);
+    // crash before the outcome of the second write
+    uint64_t b = scard_journal_intent(1, 0x2222, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 5, 7);
+    EXPECT(b == 3);
+    EXPECT(stats().open == 1);
+    scard_journal_close();
+
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().records == 3);
+    EXPECT(stats().open == 1);
+    // a card that is not in doubt changes nothing
+    scard_journal_reconcile(0x1111, SC_REGULAR_ID, 10);
+    EXPECT(stats().open == 1);
+    // neither old nor new data, stays in doubt
+    scard_journal_reconcile(0x2222, SC_REGULAR_ID, 6);
+    EXPECT(stats().open == 1);
+    EXPECT(stats().reconciled == 0);
+    // the write made it to the card
+    scard_journal_reconcile(0x2222, SC_REGULAR_ID, 7);
+    EXPECT(stats().open == 0);
+    EXPECT(stats().reconciled == 1);
+    EXPECT(stats().records == 4);
+    scard_journal_close();
+
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().records == 4);
+    EXPECT(stats().open == 0);
+    // the write never happened
+    uint64_t c = scard_journal_intent(2, 0x3333, BATCH_HASH, SC_REGULAR_ID, SC_ADMIN_ID, 3, 0);
+    EXPECT(c == 5);
+    scard_journal_close();
+
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().open == 1);
+    scard_journal_reconcile(0x3333, SC_REGULAR_ID, 3);
+    EXPECT(stats().open == 0);
+    scard_journal_close();
+
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().records == 6);
+    EXPECT(stats().open == 0);
+    scard_journal_close();
+    return true;
+}
+
+static bool test_card_identity()
+{
+    EXPECT(scard_journal_open(_path));
+    uint64_t base = stats().records;
+    // two cards of one batch, the first one's write is in doubt
+    uint64_t a = scard_journal_intent(0, 0xA0A0A0A0A0A0ULL, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 10, 20);
+    EXPECT(a == base + 1);
+    scard_journal_close();
+
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().open == 1);
+    // the other card holds the old and then the new data, it settles nothing
+    scard_journal_reconcile(0xB0B0B0B0B0B0ULL, SC_REGULAR_ID, 10);
+    scard_journal_reconcile(0xB0B0B0B0B0B0ULL, SC_REGULAR_ID, 20);
+    EXPECT(stats().open == 1);
+    // neither does a card without a serial
+    scard_journal_reconcile(0, SC_REGULAR_ID, 20);
+    EXPECT(stats().open == 1);
+    EXPECT(stats().reconciled == 0);
+    // the card itself does
+    scard_journal_reconcile(0xA0A0A0A0A0A0ULL, SC_REGULAR_ID, 20);
+    EXPECT(stats().open == 0);
+    EXPECT(stats().reconciled == 1);
+    scard_journal_close();
+    return true;
+}
+
+static bool test_torn_tail()
+{
+    EXPECT(scard_journal_open(_path));
+    uint64_t base = stats().records;
+    uint64_t d = scard_journal_intent(3, 0x4444, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 1, 2);
+    EXPECT(d == base + 1);
+    scard_journal_close();
+
+    // the start of the intent never made it, a stale record past it did
+    static const uint8_t zero[16] = { 0 };
+    EXPECT(tear_record(base + 0, zero, sizeof(zero)));
+    scard_journal_record_t stale;
+    memset(&stale, 0x5A, sizeof(stale));
+    EXPECT(tear_record(base + 1, &stale, sizeof(stale)));
+
+    EXPECT(scard_journal_open(_path));
+    // the torn intent was never acknowledged, it is dropped and not in doubt
+    EXPECT(stats().records == base);
+    EXPECT(stats().open == 0);
+    scard_journal_close();
+    scard_journal_record_t rec;
+    EXPECT(read_record(base + 1, &rec));
+    EXPECT(rec.seq == 0);
+
+    // appends go where the torn record was
+    EXPECT(scard_journal_open(_path));
+    uint64_t e = scard_journal_intent(3, 0x4444, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 1, 2);
+    EXPECT(e == base + 1);
+    scard_journal_commit(e);
+    scard_journal_close();
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().records == base + 2);
+    EXPECT(stats().open == 0);
+    scard_journal_close();
+    return true;
+}
+
+static bool test_sync_failure()
+{
+#ifndef __APPLE__
+    EXPECT(scard_journal_open(_path));
+    _fail_sync = true;
+    // not on disk, the caller must leave the card alone
+    EXPECT(scard_journal_intent(0, 0x5555, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 0, 1) == 0);
+    _fail_sync = false;
+    // a sync that works now proves nothing about the lost pages
+    EXPECT(scard_journal_intent(0, 0x5555, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 0, 1) == 0);
+    EXPECT(scard_journal_enabled());
+    scard_journal_close();
+
+    // a fresh open starts trusting the file again
+    EXPECT(scard_journal_open(_path));
+    EXPECT(stats().open == 1);
+    EXPECT(scard_journal_intent(0, 0x5555, BATCH_HASH, SC_REGULAR_ID, SC_REGULAR_ID, 0, 1) != 0);
+    scard_journal_close();
+#endif
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int fd = mkstemp(_path);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    bool ok = true;
+    if (! test_recover()) {
+        fprintf(stderr, "recover FAILED\n");
+        ok = false;
+    }
+    if (ok && ! test_card_identity()) {
+        fprintf(stderr, "card identity FAILED\n");
+        ok = false;
+    }
+    if (ok && ! test_torn_tail()) {
+        fprintf(stderr, "torn tail FAILED\n");
+        ok = false;
+    }
+    if (ok && ! test_sync_failure()) {
+        fprintf(stderr, "sync failure FAILED\n");
+        ok = false;
+    }
+    scard_journal_close();
+    unlink(_path);
+    printf("test_journal: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "scard.h"
+#include "scard_ledger.h"
+#include "scard_transport.h"
+
+#define CARDS           3
+// card serial follows the 16 bytes of user data at 64
+#define SERIAL_ADDRESS  80
+
+#define EXPECT(cond) \
+    do { \
+        if (! (cond)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+static char _path[] = "/tmp/test_ledger.XXXXXX";
+static char _compact_path[] = "/tmp/test_ledger_compact.XXXXXX";
+static const BYTE _pin[3] = { SC_PIN_CODE_BYTE_1, SC_PIN_CODE_BYTE_2, SC_PIN_CODE_BYTE_3 };
+
+static scard_reader_status_t reader_status(unsigned slot)
+{
+    scard_status_t status;
+    scard_get_status(&status);
+    return status.readers[slot];
+}
+
+static bool wait_ready(unsigned slot, bool ready)
+{
+    uint64_t deadline = scard_now_ns() + 2000000000ULL;
+    while (reader_status(slot).card_ready != ready) {
+        if (scard_now_ns() > deadline) {
+            return false;
+        }
+        usleep(1000);
+    }
+    return true;
+}
+
+static scard_ledger_summary_t summary()
+{
+    scard_ledger_summary_t s;
+    scard_ledger_get_summary(&s);
+    return s;
+}
+
+static bool test_distinct_cards()
+{
+    BYTE memory[CARDS][SC_CARD_MEMORY_LEN];
+    uint64_t serials[CARDS];
+
+    // blank cards of one batch, only their header is programmed and it is
+    // the same on all of them
+    for (unsigned i = 0; i < CARDS; i++) {
+        scard_mock_insert_card(0, NULL, NULL);
+        EXPECT(wait_ready(0, true));
+        scard_completion_t completion;
+        scard_command_t command = { SC_CMD_TOPUP, 10 * (i + 1) };
+        EXPECT(scard_submit(0, &command, &completion));
+        EXPECT(scard_command_wait(&completion, 2000));
+        EXPECT(scard_command_status(&completion) == SC_CMD_DONE);
+        EXPECT(scard_mock_card_memory(0, memory[i]));
+        memcpy(&serials[i], &memory[i][SERIAL_ADDRESS], sizeof(uint64_t));
+        scard_mock_remove_card(0);
+        EXPECT(wait_ready(0, false));
+        EXPECT(summary().cards == i + 1);
+    }
+    EXPECT(memcmp(memory[0], memory[1], 32) == 0);
+    EXPECT(serials[0] != serials[1] && serials[1] != serials[2] && serials[0] != serials[2]);
+    EXPECT(summary().value == 10 + 20 + 30);
+    for (unsigned i = 0; i < CARDS; i++) {
+        scard_ledger_entry_t entry;
+        EXPECT(scard_ledger_lookup(serials[i], &entry));
+        EXPECT(entry.user_id == SC_REGULAR_ID);
+        EXPECT(entry.value == 10 * (i + 1));
+        EXPECT(entry.topups == 1);
+    }
+
+    // the second card comes back and is recognized, no new entry
+    scard_mock_insert_card(0, memory[1], _pin);
+    EXPECT(wait_ready(0, true));
+    scard_reader_status_t status = reader_status(0);
+    EXPECT(status.card_known);
+    EXPECT(status.card_topups == 1);
+    EXPECT(status.user_value == 20);
+    EXPECT(summary().cards == CARDS);
+    scard_mock_remove_card(0);
+    EXPECT(wait_ready(0, false));
+
+    // and survives a restart
+    scard_ledger_close();
+    EXPECT(scard_ledger_open(_path));
+    EXPECT(summary().cards == CARDS);
+    EXPECT(summary().value == 10 + 20 + 30);
+    scard_ledger_entry_t entry;
+    EXPECT(scard_ledger_lookup(serials[2], &entry));
+    EXPECT(entry.value == 30);
+    return true;
+}
+
+static bool wait_compactions(unsigned long compactions)
+{
+    uint64_t deadline = scard_now_ns() + 5000000000ULL;
+    while (summary().compactions < compactions) {
+        if (scard_now_ns() > deadline) {
+            return false;
+        }
+        usleep(1000);
+    }
+    return true;
+}
+
+static bool test_compaction()
+{
+    EXPECT(scard_ledger_open(_compact_path));
+    // a few repeats are not worth a rewrite
+    for (uint64_t serial = 1; serial <= 2000; serial++) {
+        EXPECT(! scard_ledger_record(serial, SC_REGULAR_ID, 1, 1, 0, NULL));
+    }
+    for (uint64_t serial = 1; serial <= 100; serial++) {
+        EXPECT(scard_ledger_record(serial, SC_REGULAR_ID, 2, 2, 1, NULL));
+    }
+    usleep(50000);
+    EXPECT(summary().compactions == 0);
+    EXPECT(summary().records == 2100);
+
+    // past the ratio the log is rewritten, records go on meanwhile
+    uint64_t max_ns = 0;
+    for (unsigned round = 0; round < 4; round++) {
+        for (uint64_t serial = 1; serial <= 2000; serial++) {
+            uint64_t start_ns = scard_now_ns();
+            scard_ledger_record(serial, SC_REGULAR_ID, 3 + round, 3 + round, 0, NULL);
+            uint64_t ns = scard_now_ns() - start_ns;
+            max_ns = (ns > max_ns) ? ns : max_ns;
+        }
+    }
+    EXPECT(wait_compactions(1));
+    EXPECT(summary().cards == 2000);
+    EXPECT(summary().records < SC_LEDGER_COMPACT_RATIO * 2000);
+    printf("compaction: slowest record %.3f ms\n", max_ns / 1e6);
+
+    scard_ledger_close();
+    EXPECT(scard_ledger_open(_compact_path));
+    EXPECT(summary().cards == 2000);
+    scard_ledger_entry_t entry;
+    EXPECT(scard_ledger_lookup(1, &entry));
+    EXPECT(entry.value == 6 && entry.topups == 1);
+    EXPECT(scard_ledger_lookup(2000, &entry));
+    EXPECT(entry.value == 6 && entry.topups == 0);
+    scard_ledger_close();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int fd = mkstemp(_path);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+    fd = mkstemp(_compact_path);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        unlink(_path);
+        return 1;
+    }
+    close(fd);
+
+    bool ok = test_compaction();
+    if (! ok) {
+        fprintf(stderr, "compaction FAILED\n");
+    }
+    scard_ledger_close();
+    unlink(_compact_path);
+    char tmp[sizeof(_compact_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", _compact_path);
+    unlink(tmp);
+
+    scard_set_transport(&scard_mock_transport);
+    scard_mock_config_t config;
+    scard_mock_default_config(&config);
+    config.readers = 1;
+    scard_mock_configure(&config);
+
+    bool cards_ok = scard_ledger_open(_path);
+    if (cards_ok && scard_user_thread_start()) {
+        cards_ok = test_distinct_cards();
+        scard_user_thread_stop();
+    } else {
+        cards_ok = false;
+    }
+    if (! cards_ok) {
+        fprintf(stderr, "distinct cards FAILED\n");
+        ok = false;
+    }
+    scard_ledger_close();
+    unlink(_path);
+    printf("test_ledger: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "scard_queue.h"
+
+#define PRODUCERS       4
+#define ITEMS           200000
+
+#define EXPECT(cond) \
+    do { \
+        if (! (cond)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+} item_t;
+
+// small on purpose, producers keep running into a full queue
+static scard_queue_t<item_t, 64> _queue;
+
+static bool test_fill_drain()
+{
+    scard_queue_t<item_t, 8> queue;
+    scard_queue_init(&queue);
+    item_t item = { 0, 0 };
+
+    EXPECT(! scard_queue_pending(&queue));
+    EXPECT(! scard_queue_pop(&queue, &item));
+    // several laps so the cell sequence numbers wrap around the ring
+    for (uint32_t lap = 0; lap < 3; lap++) {
+        for (uint32_t i = 0; i < 8; i++) {
+            item.seq = lap * 8 + i;
+            EXPECT(scard_queue_push(&queue, &item));
+        }
+        EXPECT(! scard_queue_push(&queue, &item));
+        for (uint32_t i = 0; i < 8; i++) {
+            EXPECT(scard_queue_pending(&queue));
+            EXPECT(scard_queue_pop(&queue, &item));
+            EXPECT(item.seq == lap * 8 + i);
+        }
+        EXPECT(! scard_queue_pending(&queue));
+        EXPECT(! scard_queue_pop(&queue, &item));
+    }
+    return true;
+}
+
+static void *producer_fnc(void *arg)
+{
+    item_t item;
+    item.producer = (uint32_t)(uintptr_t)arg;
+    for (item.seq = 0; item.seq < ITEMS; item.seq++) {
+        while (! scard_queue_push(&_queue, &item)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static bool test_producers()
+{
+    scard_queue_init(&_queue);
+    pthread_t threads[PRODUCERS];
+    for (uintptr_t i = 0; i < PRODUCERS; i++) {
+        EXPECT(pthread_create(&threads[i], NULL, producer_fnc, (void *)i) == 0);
+    }
+
+    // every producer's items arrive in order, none lost or seen twice
+    uint32_t next[PRODUCERS] = { 0 };
+    uint32_t total = 0;
+    uint32_t errors = 0;
+    while (total < PRODUCERS * ITEMS) {
+        item_t item;
+        if (! scard_queue_pop(&_queue, &item)) {
+            sched_yield();
+            continue;
+        }
+        total++;
+        // keep draining on a mismatch, producers would block on a full queue
+        if (item.producer >= PRODUCERS) {
+            fprintf(stderr, "bad producer %u\n", item.producer);
+            errors++;
+            continue;
+        }
+        if (item.seq != next[item.producer]) {
+            fprintf(stderr, "producer %u: got item %u, expected %u\n",
+                item.producer, item.seq, next[item.producer]);
+            errors++;
+        }
+        next[item.producer] = item.seq + 1;
+    }
+
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    EXPECT(errors == 0);
+    item_t item;
+    EXPECT(! scard_queue_pop(&_queue, &item));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    if (! test_fill_drain()) {
+        fprintf(stderr, "fill/drain FAILED\n");
+        ok = false;
+    }
+    if (! test_producers()) {
+        fprintf(stderr, "producers FAILED\n");
+        ok = false;
+    }
+    printf("test_queue: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}